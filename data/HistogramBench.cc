@@ -0,0 +1,68 @@
+// Times the raw volume min/max + histogram pass: the old per-voxel float binning
+// against the fused, threaded CountVoxelValues the renderer now uses
+//      histogrambench [GB] [threads]
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "VoxelCounts.h"
+
+const size_t BIN_COUNT = 32;
+
+double seconds(std::chrono::steady_clock::time_point start){
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// What loadRawFile/NormaliseAndBin used to do, minus the stack array
+void legacy(const unsigned char* data, size_t size, unsigned int* hist){
+  int lowest = std::numeric_limits<int>::max();
+  int highest = std::numeric_limits<int>::min();
+  float range[2] = {0.f, 0.f};
+  for (size_t i = 0; i < size; i++) {
+    int val = (int)data[i];
+    (val < lowest) ? range[0] = val, lowest = val : (val > highest) ? range[1] = val, highest = val : 0;
+  }
+  for (size_t i = 0; i < size; i++) {
+    float normalised = ((float)data[i] - range[0]) / (range[1] - range[0]);
+    float step = 1.f/BIN_COUNT;
+    size_t idx = std::min((size_t)(normalised/step), BIN_COUNT - 1);
+    hist[idx] += 1;
+  }
+}
+
+int main(int argc, char *argv[]){
+
+  double gb = (argc > 1) ? atof(argv[1]) : 2.0;
+  size_t threads = (argc > 2) ? atoi(argv[2]) : 0;
+  size_t size = (size_t)(gb * (1 << 30));
+
+  // Mostly empty space with a noisy object in it, like a scan
+  std::vector<unsigned char> data(size, 0);
+  uint32_t seed = 12345;
+  for (size_t i = size/4; i < size - size/4; i++) {
+    seed = seed*1664525u + 1013904223u;
+    data[i] = (unsigned char)(64 + (seed >> 26));
+  }
+
+  std::vector<unsigned int> hist(BIN_COUNT, 0);
+  auto start = std::chrono::steady_clock::now();
+  legacy(data.data(), size, hist.data());
+  double legacyTime = seconds(start);
+
+  uint64_t counts[256];
+  start = std::chrono::steady_clock::now();
+  CountVoxelValues(data.data(), size, counts, threads);
+  double fusedTime = seconds(start);
+
+  uint64_t total = 0;
+  for (int v = 0; v < 256; v++) total += counts[v];
+
+  std::cout << size/double(1 << 30) << " GB, " << (total == size ? "counts ok" : "COUNTS WRONG") << std::endl;
+  std::cout << "legacy: " << legacyTime << " s (" << gb/legacyTime << " GB/s)" << std::endl;
+  std::cout << "fused:  " << fusedTime << " s (" << gb/fusedTime << " GB/s), " << legacyTime/fusedTime << "x" << std::endl;
+  return total == size ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+// Converts an 8 bit .raw volume into the bricked, compressed format the renderer
+// also loads (see src/io/BrickedVolume.h)
+//      volumecompressor in.raw width height depth out.bvol [brickSize]
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "BrickedVolume.h"
+
+int main(int argc, char *argv[]){
+
+  if (argc < 6) {
+    std::cout << "usage: volumecompressor in.raw width height depth out.bvol [brickSize]" << std::endl;
+    return 1;
+  }
+
+  size_t width = atoi(argv[2]), height = atoi(argv[3]), depth = atoi(argv[4]);
+  size_t brickSize = (argc > 6) ? atoi(argv[6]) : BrickedVolume::DEFAULT_BRICK_SIZE;
+  size_t size = width*height*depth;
+
+  FILE *fp = fopen(argv[1], "rb");
+  if (!fp) {std::cout << "file open failed" << std::endl; return 1;}
+  std::vector<unsigned char> data(size);
+  size_t read = fread(data.data(), 1, size, fp);
+  fclose(fp);
+  if (read != size) {std::cout << "expected " << size << " bytes, read " << read << std::endl; return 1;}
+
+  if (!BrickedVolume::Write(argv[5], data.data(), width, height, depth, brickSize)) {std::cout << "file write failed" << std::endl; return 1;}
+
+  // Read it straight back, a converter that silently loses data is worse than none
+  BrickedVolume check;
+  std::vector<unsigned char> decoded(size);
+  if (!check.Open(argv[5]) || !check.Read(0, depth, decoded.data()) || decoded != data) {
+    std::cout << "verification failed" << std::endl;
+    return 1;
+  }
+
+  fp = fopen(argv[5], "rb");
+  fseek(fp, 0, SEEK_END);
+  long compressed = ftell(fp);
+  fclose(fp);
+  std::cout << argv[1] << ": " << size << " -> " << compressed << " bytes" << std::endl;
+  return 0;
+}
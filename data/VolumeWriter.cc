@@ -1,14 +1,110 @@
-#include <fstream>
+// Synthetic 8 bit volumes, from the old 32^3 test patterns up to multi-GB
+// scaling benchmarks. Every voxel is a pure function of (x, y, z, seed), so the
+// output is the same whatever the thread count.
+//      volumewriter [field] [size] [seed] [file]
+//          field = 0-4 (the original patterns), noise, spheres, shells or gradient
+//          size  = N for N^3, or WxHxD                    (default 32)
+//          seed  = anything, same seed -> same volume     (default 1)
+//          file  = output                                 (default Bucky.raw)
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
 #include <string>
-#include <cstdlib>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 using namespace std;
-const int sz = 32;
-const int sy = 32;
-const int sx = 32; 
-const int method_max = 4;
 
+int sx = 32, sy = 32, sz = 32;
+uint32_t seed = 1;
+
+const int SPHERE_COUNT = 64;
+struct sphere { float x, y, z, r, value; };
+vector<sphere> spheres;
+
+
+uint32_t hash3(int x, int y, int z){
+  uint32_t h = seed * 0x9E3779B1u;
+  h ^= (uint32_t)x * 0x85EBCA77u; h = (h << 13) | (h >> 19);
+  h ^= (uint32_t)y * 0xC2B2AE3Du; h = (h << 13) | (h >> 19);
+  h ^= (uint32_t)z * 0x27D4EB2Fu;
+  h ^= h >> 15; h *= 0x2C1B3C6Du; h ^= h >> 12; h *= 0x297A2D39u; h ^= h >> 15;
+  return h;
+}
+
+float lattice(int x, int y, int z){
+  return (hash3(x, y, z) & 0xffffff) / float(0xffffff);
+}
+
+float smooth(float t){
+  return t*t*(3.f - 2.f*t);
+}
+
+// Trilinear value noise over a lattice 'cell' voxels apart
+float valueNoise(float x, float y, float z, float cell){
+  x /= cell; y /= cell; z /= cell;
+  int x0 = (int)floor(x), y0 = (int)floor(y), z0 = (int)floor(z);
+  float fx = smooth(x - x0), fy = smooth(y - y0), fz = smooth(z - z0);
+  float c[2][2];
+  for (int j = 0; j < 2; j++)
+    for (int k = 0; k < 2; k++)
+      c[j][k] = lattice(x0, y0 + j, z0 + k)*(1.f - fx) + lattice(x0 + 1, y0 + j, z0 + k)*fx;
+  float c0 = c[0][0]*(1.f - fy) + c[1][0]*fy;
+  float c1 = c[0][1]*(1.f - fy) + c[1][1]*fy;
+  return c0*(1.f - fz) + c1*fz;
+}
+
+// Four octaves, coarsest an eighth of the volume across
+float noise(int x, int y, int z){
+  float cell = max(sx, max(sy, sz)) / 8.f, sum = 0.f, weight = 0.5f, total = 0.f;
+  for (int octave = 0; octave < 4 && cell >= 1.f; octave++, cell *= 0.5f, weight *= 0.5f) {
+    sum += weight*valueNoise(x, y, z, cell);
+    total += weight;
+  }
+  return 255.f*sum/total;
+}
+
+void makeSpheres(){
+  // Placed from the seed alone, with sizes relative to the volume so every size looks alike
+  float extent = min(sx, min(sy, sz));
+  for (int i = 0; i < SPHERE_COUNT; i++) {
+    sphere s;
+    s.x = lattice(i, 0, -1)*sx;
+    s.y = lattice(i, 1, -1)*sy;
+    s.z = lattice(i, 2, -1)*sz;
+    s.r = (0.02f + 0.1f*lattice(i, 3, -1))*extent;
+    s.value = 32.f + 223.f*lattice(i, 4, -1);
+    spheres.push_back(s);
+  }
+}
+
+float sphereField(int x, int y, int z){
+  float value = 0.f;
+  for (size_t i = 0; i < spheres.size(); i++) {
+    float dx = x - spheres[i].x, dy = y - spheres[i].y, dz = z - spheres[i].z;
+    if (dx*dx + dy*dy + dz*dz <= spheres[i].r*spheres[i].r)
+      value = max(value, spheres[i].value);
+  }
+  return value;
+}
+
+// Concentric shells about the centre, eight across the volume
+float shells(int x, int y, int z){
+  float dx = (x + 0.5f)/sx - 0.5f, dy = (y + 0.5f)/sy - 0.5f, dz = (z + 0.5f)/sz - 0.5f;
+  float r = sqrt(dx*dx + dy*dy + dz*dz);
+  return 127.5f + 127.5f*cos(r*16.f*3.14159265f);
+}
+
+float gradient(int x, int y, int z){
+  return 255.f*(x/float(max(sx - 1, 1)) + y/float(max(sy - 1, 1)) + z/float(max(sz - 1, 1)))/3.f;
+}
 
 float myfunc(int x, int y, int z, int method){
 //
@@ -30,6 +126,14 @@ float myfunc(int x, int y, int z, int method){
     case 4:
       return (x+y)*2*((z+1)/float(sz));
       break;
+    case 5:
+      return noise(x, y, z);
+    case 6:
+      return sphereField(x, y, z);
+    case 7:
+      return shells(x, y, z);
+    case 8:
+      return gradient(x, y, z);
     default:
       return x;
       break;
@@ -37,21 +141,47 @@ float myfunc(int x, int y, int z, int method){
     return 0;
 }
 
+int parseMethod(const string& name){
+  const char* names[] = { "noise", "spheres", "shells", "gradient" };
+  for (int i = 0; i < 4; i++)
+    if (name == names[i]) return 5 + i;
+  return atoi(name.c_str());
+}
 
 
 int main(int argc, char *argv[]){
 
   int method = 0;
-  if (argc > 1) method = atoi(argv[1]);
-  ofstream fout;
-  string foname("Bucky.raw");
-  fout.open(foname.c_str());
-  if (!fout) {std::cout << "file open failed" << std::endl; return 1;}
-  for (int z = 0; z < sz; z++)
-    for (int y = 0; y < sy; y++)
-      for (int x = 0; x < sx; x++)
-        fout << (unsigned char)(myfunc(x, y, z, method));
-  if (!fout) {std::cout << "file write failed" << std::endl; return 1;}
-  fout.close();
+  if (argc > 1) method = parseMethod(argv[1]);
+  if (argc > 2 && sscanf(argv[2], "%dx%dx%d", &sx, &sy, &sz) != 3) sx = sy = sz = atoi(argv[2]);
+  if (argc > 3) seed = (uint32_t)strtoul(argv[3], NULL, 10);
+  string foname((argc > 4) ? argv[4] : "Bucky.raw");
+  if (sx <= 0 || sy <= 0 || sz <= 0) {std::cout << "bad size" << std::endl; return 1;}
+  makeSpheres();
+
+  // Map the output and let every thread write its own slices straight into it
+  size_t slice = (size_t)sx*sy, size = slice*sz;
+  int fd = open(foname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) != 0) {std::cout << "file open failed" << std::endl; return 1;}
+  unsigned char* out = (unsigned char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (out == MAP_FAILED) {std::cout << "file map failed" << std::endl; return 1;}
+
+  int threads = max((int)thread::hardware_concurrency(), 1);
+  vector<thread> pool;
+  for (int t = 0; t < threads; t++)
+    pool.push_back(thread([=]() {
+      // Interleaved slices keep the threads' work even when the field isn't
+      for (int z = t; z < sz; z += threads)
+        for (int y = 0; y < sy; y++)
+          for (int x = 0; x < sx; x++)
+            out[z*slice + (size_t)y*sx + x] = (unsigned char)min(max(myfunc(x, y, z, method), 0.f), 255.f);
+    }));
+  for (size_t t = 0; t < pool.size(); t++) pool[t].join();
+
+  bool ok = msync(out, size, MS_SYNC) == 0;
+  munmap(out, size);
+  ok = (close(fd) == 0) && ok;
+  if (!ok) {std::cout << "file write failed" << std::endl; return 1;}
+  std::cout << foname << ": " << sx << "x" << sy << "x" << sz << " (" << size << " bytes)" << std::endl;
   return 0;
 }
@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "MICache.h"
+
+static const char     kMagic[4]  = {'M', 'I', 'C', '7'};
+static const uint64_t kFnvOffset = 14695981039346656037ull;
+static const uint64_t kFnvPrime  = 1099511628211ull;
+
+static int32_t Quantise(float value, float step)
+{
+    return (int32_t)std::lround(value / step);
+}
+
+static uint64_t Mix(uint64_t hash, uint64_t word)
+{
+    hash ^= word;
+    hash *= kFnvPrime;
+    return hash ^ (hash >> 29);
+}
+
+bool MICacheKey::operator==(const MICacheKey& other) const
+{
+    return std::memcmp(this, &other, sizeof(MICacheKey)) == 0;
+}
+
+size_t MICacheKeyHash::operator()(const MICacheKey& key) const
+{
+    return (size_t)MICache::HashBytes(&key, sizeof(MICacheKey));
+}
+
+MICache::MICache(const char* directory)
+    : directory(directory ? directory : ""), hits(0), misses(0)
+{
+    if(!this->directory.empty())
+    {
+        // Another process may have made it already, which is fine
+        mkdir(this->directory.c_str(), 0775);
+    }
+}
+
+uint64_t MICache::HashBytes(const void* data, size_t size)
+{
+    // FNV style, but a word at a time - byte-wise FNV is far too slow for multi-GB volumes
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hash = kFnvOffset ^ size;
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(uint64_t));
+        hash = Mix(hash, word);
+    }
+
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + i, size - i);
+    return Mix(hash, tail);
+}
+
+MICacheKey MICache::MakeKey(uint64_t volumeHash, const float halfExtent[3], float rotX, float rotY,
+                            float transX, float transY, float transZ,
+                            float transferOffset, float transferScale, float density,
+                            size_t binCount, unsigned int imageW, unsigned int imageH,
+                            bool linearFiltering, float tstep, bool preIntegrated,
+                            bool shaded, float brightness, unsigned int estimator, float opacityThreshold,
+                            uint64_t transferFuncHash)
+{
+    MICacheKey key;
+    std::memset(&key, 0, sizeof(MICacheKey)); // Padding takes part in the hash and compare
+    key.volumeHash      = volumeHash;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        key.halfExtent[axis] = Quantise(halfExtent[axis], 1e-4f);
+    }
+    key.rotX            = Quantise(rotX, 1e-3f);
+    key.rotY            = Quantise(rotY, 1e-3f);
+    key.transX          = Quantise(transX, 1e-3f);
+    key.transY          = Quantise(transY, 1e-3f);
+    key.transZ          = Quantise(transZ, 1e-3f);
+    key.transferOffset  = Quantise(transferOffset, 1e-4f);
+    key.transferScale   = Quantise(transferScale, 1e-4f);
+    key.density         = Quantise(density, 1e-4f);
+    key.binCount        = (uint32_t)binCount;
+    key.imageW          = imageW;
+    key.imageH          = imageH;
+    key.linearFiltering = linearFiltering ? 1 : 0;
+    key.tstep           = Quantise(tstep, 1e-5f);
+    key.preIntegrated   = preIntegrated ? 1 : 0;
+    key.shaded          = shaded ? 1 : 0;
+    key.brightness      = Quantise(brightness, 1e-4f);
+    key.estimator       = estimator;
+    key.opacityThreshold = Quantise(opacityThreshold, 1e-4f);
+    key.transferFuncHash = transferFuncHash;
+    return key;
+}
+
+bool MICache::Lookup(const MICacheKey& key, MICacheEntry* entry)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = memory.find(key);
+    if(found != memory.end())
+    {
+        *entry = found->second;
+        ++hits;
+        return true;
+    }
+
+    if(!directory.empty() && ReadEntry(key, entry))
+    {
+        memory[key] = *entry;
+        ++hits;
+        return true;
+    }
+
+    ++misses;
+    return false;
+}
+
+void MICache::Store(const MICacheKey& key, const MICacheEntry& entry)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    memory[key] = entry;
+    if(!directory.empty())
+    {
+        WriteEntry(key, entry);
+    }
+}
+
+std::string MICache::PathFor(const MICacheKey& key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.mic", (unsigned long long)HashBytes(&key, sizeof(MICacheKey)));
+    return directory + "/" + name;
+}
+
+bool MICache::ReadEntry(const MICacheKey& key, MICacheEntry* entry) const
+{
+    FILE* fp = fopen(PathFor(key).c_str(), "rb");
+    if(!fp)
+    {
+        return false;
+    }
+
+    // The full key is stored so a file name collision reads as a miss rather than a wrong MI
+    char magic[4];
+    MICacheKey storedKey;
+    float values[10];
+    uint32_t count = 0;
+    bool ok =   fread(magic, sizeof(magic), 1, fp) == 1 && std::memcmp(magic, kMagic, sizeof(magic)) == 0 &&
+                fread(&storedKey, sizeof(MICacheKey), 1, fp) == 1 && storedKey == key &&
+                fread(values, sizeof(values), 1, fp) == 1 &&
+                fread(&count, sizeof(count), 1, fp) == 1 && count == key.binCount;
+
+    if(ok)
+    {
+        entry->histogram.resize(count);
+        ok = fread(entry->histogram.data(), sizeof(unsigned int), count, fp) == count;
+        entry->entropyA             = values[0];
+        entry->entropyB             = values[1];
+        entry->jointEntropy         = values[2];
+        entry->mutualInformation    = values[3];
+        std::copy(values + 4, values + 9, entry->imageEntropy);
+        entry->viewEntropy          = values[9];
+    }
+
+    fclose(fp);
+    return ok;
+}
+
+void MICache::WriteEntry(const MICacheKey& key, const MICacheEntry& entry) const
+{
+    std::string path = PathFor(key);
+    std::string temp = path + ".tmp." + std::to_string(getpid());
+
+    FILE* fp = fopen(temp.c_str(), "wb");
+    if(!fp)
+    {
+        std::cout << "MICache: could not write '" << temp << "'" << std::endl;
+        return;
+    }
+
+    float values[10] = { entry.entropyA, entry.entropyB, entry.jointEntropy, entry.mutualInformation,
+                         entry.imageEntropy[0], entry.imageEntropy[1], entry.imageEntropy[2], entry.imageEntropy[3],
+                         entry.imageEntropy[4], entry.viewEntropy };
+    uint32_t count = (uint32_t)entry.histogram.size();
+    bool ok =   fwrite(kMagic, sizeof(kMagic), 1, fp) == 1 &&
+                fwrite(&key, sizeof(MICacheKey), 1, fp) == 1 &&
+                fwrite(values, sizeof(values), 1, fp) == 1 &&
+                fwrite(&count, sizeof(count), 1, fp) == 1 &&
+                fwrite(entry.histogram.data(), sizeof(unsigned int), count, fp) == count;
+    ok = (fclose(fp) == 0) && ok;
+
+    // rename() is atomic on POSIX, readers see either nothing or the whole entry
+    if(!ok || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temp.c_str());
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef HEMELB_MICACHE_H
+#define HEMELB_MICACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Everything that changes the sample histogram of a frame. Floats are quantised
+// so that the integer-degree / 0.1 zoom steps the RL loop produces always land
+// on the same key, even after the python side accumulates rounding error.
+struct MICacheKey
+{
+    uint64_t volumeHash;
+    int32_t  halfExtent[3];              // 1e-4 units - the box from a header's spacing, not in the voxels
+    int32_t  rotX, rotY;                 // 1e-3 degrees
+    int32_t  transX, transY, transZ;     // 1e-3 units
+    int32_t  transferOffset, transferScale, density;  // 1e-4 units
+    uint32_t binCount;
+    uint32_t imageW, imageH;
+    uint32_t linearFiltering;
+    int32_t  tstep;                      // 1e-5 units
+    uint32_t preIntegrated;
+    uint32_t shaded;                     // Only the image changes, but its entropy is cached too
+    int32_t  brightness;                 // 1e-4 units, and likewise only the image
+    uint32_t estimator;                  // EntropyEstimator behind the cached entropies
+    int32_t  opacityThreshold;           // 1e-4 units
+    uint64_t transferFuncHash;           // 0 for the built-in table
+
+    bool operator==(const MICacheKey& other) const;
+};
+
+struct MICacheKeyHash
+{
+    size_t operator()(const MICacheKey& key) const;
+};
+
+struct MICacheEntry
+{
+    float entropyA, entropyB, jointEntropy, mutualInformation;
+    float imageEntropy[5];               // r, g, b, a, luminance
+    float viewEntropy;
+    std::vector<unsigned int> histogram;
+};
+
+// Two level cache of MI results. The in-memory map serves repeated poses within
+// a run, the optional directory serves every renderer process pointed at it.
+// Disk entries are written to a private temp file and rename()d into place, so
+// concurrent processes only ever see complete entries.
+class MICache {
+
+    public:
+        explicit MICache(const char* directory = nullptr);
+
+        static uint64_t   HashBytes(const void* data, size_t size);
+        static MICacheKey MakeKey(  uint64_t volumeHash, const float halfExtent[3], float rotX, float rotY,
+                                    float transX, float transY, float transZ,
+                                    float transferOffset, float transferScale, float density,
+                                    size_t binCount, unsigned int imageW, unsigned int imageH,
+                                    bool linearFiltering, float tstep, bool preIntegrated,
+                                    bool shaded, float brightness, unsigned int estimator, float opacityThreshold,
+                                    uint64_t transferFuncHash);
+
+        bool Lookup(const MICacheKey& key, MICacheEntry* entry);
+        void Store(const MICacheKey& key, const MICacheEntry& entry);
+
+        size_t Hits() const   { return hits; }
+        size_t Misses() const { return misses; }
+
+    private:
+        std::string PathFor(const MICacheKey& key) const;
+        bool        ReadEntry(const MICacheKey& key, MICacheEntry* entry) const;
+        void        WriteEntry(const MICacheKey& key, const MICacheEntry& entry) const;
+
+        std::string directory;
+        std::unordered_map<MICacheKey, MICacheEntry, MICacheKeyHash> memory;
+        std::mutex  lock;
+        size_t      hits, misses;
+};
+#endif
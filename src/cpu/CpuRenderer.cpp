@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <thread>
+
+#include "CpuRenderer.h"
+#include "Entropy.h"
+#include "PreIntegration.h"
+#include "TransferFunction.h"
+
+// Must match volumeRender_kernel.cu
+static const int      kMaxSteps                 = 500;
+static const size_t   kPreIntegrationTableSize  = 256;
+
+// What a RenderRows variant does per sample, as d_render's RenderFeature. The histogram is
+// always gathered here, and the filter mode is a branch of its own on the host.
+enum CpuRenderFeature
+{
+    CPU_RENDER_LINEAR           = 1 << 0,
+    CPU_RENDER_PREINTEGRATED    = 1 << 1,
+    CPU_RENDER_SHADED           = 1 << 2,
+    CPU_RENDER_VISIBILITY       = 1 << 3,
+    CPU_RENDER_BRICKS           = 1 << 4,
+    CPU_RENDER_EARLY_OUT        = 1 << 5,
+    CPU_RENDER_VARIANTS         = 1 << 6
+};
+
+static float3 Make3(float x, float y, float z)
+{
+    float3 v = { x, y, z };
+    return v;
+}
+
+static float Dot(float3 a, const float* row)
+{
+    return a.x*row[0] + a.y*row[1] + a.z*row[2];
+}
+
+static float Saturate(float v)
+{
+    return std::min(std::max(v, 0.f), 1.f);
+}
+
+static uint32_t RgbaFloatToInt(const float* rgba)
+{
+    return ((uint32_t)(Saturate(rgba[3])*255) << 24) | ((uint32_t)(Saturate(rgba[2])*255) << 16) |
+           ((uint32_t)(Saturate(rgba[1])*255) << 8) | (uint32_t)(Saturate(rgba[0])*255);
+}
+
+// Slab test against an axis aligned box, as intersectBox in the kernel
+static bool IntersectBox(float3 o, float3 d, float3 boxMin, float3 boxMax, float* tnear, float* tfar)
+{
+    float ox[3] = { o.x, o.y, o.z }, dx[3] = { d.x, d.y, d.z };
+    float lo[3] = { boxMin.x, boxMin.y, boxMin.z }, hi[3] = { boxMax.x, boxMax.y, boxMax.z };
+    float largestMin = -INFINITY, smallestMax = INFINITY;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        float inv = 1.f / dx[axis];
+        float tbot = inv * (lo[axis] - ox[axis]);
+        float ttop = inv * (hi[axis] - ox[axis]);
+        largestMin = std::max(largestMin, std::min(ttop, tbot));
+        smallestMax = std::min(smallestMax, std::max(ttop, tbot));
+    }
+    *tnear = largestMin;
+    *tfar = smallestMax;
+    return smallestMax > largestMin;
+}
+
+CpuRenderer::CpuRenderer()
+    : width(0), height(0), depth(0),
+      boxMin(Make3(-1.f, -1.f, -1.f)), boxMax(Make3(1.f, 1.f, 1.f)),
+      texScale(Make3(1.f, 1.f, 1.f)), texOffset(Make3(0.f, 0.f, 0.f))
+{
+    std::fill(preIntegrationBuilt, preIntegrationBuilt + 4, -1.f);
+    std::fill(bricks, bricks + 3, 1);
+    std::fill(brickScale, brickScale + 3, 0.f);
+
+    // The same starting table initCuda uploads
+    TransferFunction defaultTransferFunc;
+    SetTransferFunction(defaultTransferFunc.Data(), defaultTransferFunc.Size());
+}
+
+void CpuRenderer::SetVolume(const unsigned char* voxels, size_t w, size_t h, size_t d)
+{
+    volume.assign(voxels, voxels + w*h*d);
+    gradients.clear();
+    width = w;
+    height = h;
+    depth = d;
+}
+
+void CpuRenderer::SetVolumeBox(float3 min, float3 max, float3 scale, float3 offset)
+{
+    boxMin = min;
+    boxMax = max;
+    texScale = scale;
+    texOffset = offset;
+}
+
+void CpuRenderer::SetTransferFunction(const float4* entries, size_t count)
+{
+    transferFunc.assign(entries, entries + count);
+    preIntegrationBuilt[0] = -1.f;
+}
+
+void CpuRenderer::SetGradients(const int8_t* data)
+{
+    gradients.assign(data, data + volume.size()*4);
+}
+
+size_t CpuRenderer::SetVisibilityBricks(size_t brickSize)
+{
+    size_t size[3] = { width, height, depth };
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        bricks[axis] = (size[axis] + brickSize - 1) / brickSize;
+        brickScale[axis] = (float)size[axis] / brickSize;
+    }
+    return bricks[0]*bricks[1]*bricks[2];
+}
+
+void CpuRenderer::VolumeCoord(float3 pos, float* coord) const
+{
+    coord[0] = (pos.x*0.5f + 0.5f)*texScale.x + texOffset.x;
+    coord[1] = (pos.y*0.5f + 0.5f)*texScale.y + texOffset.y;
+    coord[2] = (pos.z*0.5f + 0.5f)*texScale.z + texOffset.z;
+}
+
+size_t CpuRenderer::BrickAt(float3 pos) const
+{
+    float coord[3];
+    VolumeCoord(pos, coord);
+    size_t b[3];
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        b[axis] = std::min((size_t)std::max(coord[axis]*brickScale[axis], 0.f), bricks[axis] - 1);
+    }
+    return (b[2]*bricks[1] + b[1])*bricks[0] + b[0];
+}
+
+// The voxels a texture read at pos blends and their weights - one for point sampling, eight with
+// the half texel offset CUDA's linear filter uses - clamped at the faces. Returns how many.
+template <bool LINEAR>
+size_t CpuRenderer::Footprint(float3 pos, size_t* voxels, float* weights) const
+{
+    float coord[3];
+    VolumeCoord(pos, coord);
+    long size[3] = { (long)width, (long)height, (long)depth };
+
+    if(!LINEAR)
+    {
+        long i[3];
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            i[axis] = std::min(std::max((long)std::floor(coord[axis]*size[axis]), 0L), size[axis] - 1);
+        }
+        voxels[0] = (i[2]*size[1] + i[1])*size[0] + i[0];
+        weights[0] = 1.f;
+        return 1;
+    }
+
+    long i0[3], i1[3];
+    float frac[3];
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        float x = coord[axis]*size[axis] - 0.5f;
+        float base = std::floor(x);
+        frac[axis] = x - base;
+        i0[axis] = std::min(std::max((long)base, 0L), size[axis] - 1);
+        i1[axis] = std::min(std::max((long)base + 1, 0L), size[axis] - 1);
+    }
+
+    for(int corner = 0; corner < 8; ++corner)
+    {
+        float weight = 1.f;
+        long index[3];
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            bool upper = (corner >> axis) & 1;
+            index[axis] = upper ? i1[axis] : i0[axis];
+            weight *= upper ? frac[axis] : 1.f - frac[axis];
+        }
+        voxels[corner] = (index[2]*size[1] + index[1])*size[0] + index[0];
+        weights[corner] = weight;
+    }
+    return 8;
+}
+
+// Normalised, clamped reads of the 8 bit volume
+template <bool LINEAR>
+float CpuRenderer::SampleVolume(float3 pos) const
+{
+    size_t voxels[8];
+    float weights[8];
+    size_t count = Footprint<LINEAR>(pos, voxels, weights);
+
+    float value = 0.f;
+    for(size_t i = 0; i < count; ++i)
+    {
+        value += weights[i] * volume[voxels[i]];
+    }
+    return value / 255.f;
+}
+
+// As shadeSample in the kernel, the gradients read as a normalised char4 texture
+template <bool LINEAR>
+float4 CpuRenderer::ShadeSample(float4 col, float3 pos, float3 viewDir, const CpuRenderParams& params) const
+{
+    size_t voxels[8];
+    float weights[8];
+    size_t count = Footprint<LINEAR>(pos, voxels, weights);
+
+    float g[4] = { 0.f, 0.f, 0.f, 0.f };
+    for(size_t i = 0; i < count; ++i)
+    {
+        const int8_t* voxel = &gradients[voxels[i]*4];
+        for(int c = 0; c < 4; ++c)
+        {
+            g[c] += weights[i] * std::max(voxel[c] / 127.f, -1.f);
+        }
+    }
+
+    const ShadingParams& s = params.shading;
+    float weight = Saturate(g[3]*s.magnitudeGain);
+    float len = std::sqrt(g[0]*g[0] + g[1]*g[1] + g[2]*g[2]);
+    float ndotv = (len > 0.f) ? std::fabs(g[0]*viewDir.x + g[1]*viewDir.y + g[2]*viewDir.z)/len : 0.f;
+
+    float lit = 1.f + (s.ambient + s.diffuse*ndotv - 1.f)*weight;
+    float highlight = weight*s.specular*std::pow(ndotv, s.shininess)*col.w;
+    col.x = col.x*lit + highlight;
+    col.y = col.y*lit + highlight;
+    col.z = col.z*lit + highlight;
+    return col;
+}
+
+// Point sampled and clamped, with the density and premultiply classifySample does
+float4 CpuRenderer::LookupTransfer(float sample, const CpuRenderParams& params) const
+{
+    long count = (long)transferFunc.size();
+    float u = (sample - params.transferOffset)*params.transferScale;
+    long i = std::min(std::max((long)std::floor(u*count), 0L), count - 1);
+
+    float4 col = transferFunc[i];
+    col.w *= params.density;
+    col.x *= col.w;
+    col.y *= col.w;
+    col.z *= col.w;
+    return col;
+}
+
+// Bilinear over the table, texel centres at i/(N-1) in sample space as in preIntegratedLookup
+float4 CpuRenderer::LookupPreIntegrated(float front, float back) const
+{
+    const long n = (long)kPreIntegrationTableSize;
+    float x = Saturate(front)*(n - 1), y = Saturate(back)*(n - 1);
+    long x0 = std::min((long)x, n - 1), y0 = std::min((long)y, n - 1);
+    long x1 = std::min(x0 + 1, n - 1), y1 = std::min(y0 + 1, n - 1);
+    float fx = x - x0, fy = y - y0;
+
+    const float4* t = &preIntegrationTable[0];
+    float4 a = t[y0*n + x0], b = t[y0*n + x1], c = t[y1*n + x0], d = t[y1*n + x1];
+    float4 col;
+    col.x = (a.x*(1.f - fx) + b.x*fx)*(1.f - fy) + (c.x*(1.f - fx) + d.x*fx)*fy;
+    col.y = (a.y*(1.f - fx) + b.y*fx)*(1.f - fy) + (c.y*(1.f - fx) + d.y*fx)*fy;
+    col.z = (a.z*(1.f - fx) + b.z*fx)*(1.f - fy) + (c.z*(1.f - fx) + d.z*fx)*fy;
+    col.w = (a.w*(1.f - fx) + b.w*fx)*(1.f - fy) + (c.w*(1.f - fx) + d.w*fx)*fy;
+    return col;
+}
+
+template <unsigned FEATURES>
+void CpuRenderer::RenderRows(const CpuRenderParams& params, uint32_t imageW, uint32_t imageH, uint32_t firstRow, uint32_t rowStep,
+                             uint32_t* image, uint32_t* histogram, size_t binCount,
+                             float* visibility, float* brickVisibility) const
+{
+    const bool linear = (FEATURES & CPU_RENDER_LINEAR) != 0;
+    const float* m = params.invViewMatrix;
+    float3 origin = Make3(m[3], m[7], m[11]);
+
+    for(uint32_t y = firstRow; y < imageH; y += rowStep)
+    {
+        for(uint32_t x = 0; x < imageW; ++x)
+        {
+            float sum[4] = { 0.f, 0.f, 0.f, 0.f };
+
+            // Eye ray, then the whole volume's box for the sample grid and ours for the extent
+            float u = (x / (float)imageW)*2.f - 1.f;
+            float v = (y / (float)imageH)*2.f - 1.f;
+            float length = std::sqrt(u*u + v*v + 4.f);
+            float3 local = Make3(u/length, v/length, -2.f/length);
+            float3 dir = Make3(Dot(local, m), Dot(local, m + 4), Dot(local, m + 8));
+
+            float fullNear, fullFar, tnear, tfar;
+            bool hit = IntersectBox(origin, dir, Make3(-1.f, -1.f, -1.f), Make3(1.f, 1.f, 1.f), &fullNear, &fullFar) &&
+                       IntersectBox(origin, dir, boxMin, boxMax, &tnear, &tfar);
+            if(hit)
+            {
+                fullNear = std::max(fullNear, 0.f);
+                tnear = std::max(tnear, 0.f);
+                tnear = fullNear + std::ceil((tnear - fullNear)/params.tstep)*params.tstep;
+                hit = tnear <= tfar;
+            }
+            if(!hit)
+            {
+                image[y*imageW + x] = 0;
+                continue;
+            }
+
+            float t = tnear;
+            float3 pos = Make3(origin.x + dir.x*tnear, origin.y + dir.y*tnear, origin.z + dir.z*tnear);
+            float3 step = Make3(dir.x*params.tstep, dir.y*params.tstep, dir.z*params.tstep);
+            float front = -1.f;
+
+            for(int i = 0; i < kMaxSteps; ++i)
+            {
+                float sample = SampleVolume<linear>(pos);
+                histogram[std::min((size_t)(sample*binCount), binCount - 1)]++;
+
+                float4 col;
+                if(FEATURES & CPU_RENDER_PREINTEGRATED)
+                {
+                    col = (front < 0.f) ? float4() : LookupPreIntegrated(front, sample);
+                    front = sample;
+                }
+                else
+                {
+                    col = LookupTransfer(sample, params);
+                }
+                if((FEATURES & CPU_RENDER_SHADED) && col.w > 0.f)
+                {
+                    col = ShadeSample<linear>(col, pos, dir, params);
+                }
+
+                float transmittance = 1.f - sum[3];
+                if((FEATURES & CPU_RENDER_VISIBILITY) && col.w*transmittance > 0.f)
+                {
+                    visibility[std::min((size_t)(Saturate(sample)*VISIBILITY_BINS), VISIBILITY_BINS - 1)] += col.w*transmittance;
+                }
+                if((FEATURES & CPU_RENDER_BRICKS) && col.w*transmittance > 0.f)
+                {
+                    brickVisibility[BrickAt(pos)] += col.w*transmittance;
+                }
+                sum[0] += col.x*transmittance;
+                sum[1] += col.y*transmittance;
+                sum[2] += col.z*transmittance;
+                sum[3] += col.w*transmittance;
+
+                if((FEATURES & CPU_RENDER_EARLY_OUT) && sum[3] > params.opacityThreshold)
+                {
+                    break;
+                }
+
+                t += params.tstep;
+                if(t > tfar)
+                {
+                    break;
+                }
+
+                pos.x += step.x;
+                pos.y += step.y;
+                pos.z += step.z;
+            }
+
+            for(int c = 0; c < 4; ++c)
+            {
+                sum[c] *= params.brightness;
+            }
+            image[y*imageW + x] = RgbaFloatToInt(sum);
+        }
+    }
+}
+
+// Every RenderRows<FEATURES> for FEATURES <= N, by index
+template <unsigned N>
+struct RowRendererTable
+{
+    static void Fill(CpuRenderer::RowRenderer* table)
+    {
+        table[N] = &CpuRenderer::RenderRows<N>;
+        RowRendererTable<N - 1>::Fill(table);
+    }
+};
+
+template <>
+struct RowRendererTable<0>
+{
+    static void Fill(CpuRenderer::RowRenderer* table)
+    {
+        table[0] = &CpuRenderer::RenderRows<0>;
+    }
+};
+
+void CpuRenderer::Render(const CpuRenderParams& params, uint32_t imageW, uint32_t imageH,
+                         uint32_t* image, uint32_t* histogram, size_t binCount,
+                         const CpuFrameStats* stats, size_t threads)
+{
+    float* visibility = stats ? stats->visibility : nullptr;
+    float* brickVisibility = stats ? stats->brickVisibility : nullptr;
+    size_t brickCount = bricks[0]*bricks[1]*bricks[2];
+
+    if(params.preIntegrated)
+    {
+        float depends[4] = { params.transferOffset, params.transferScale, params.density, params.tstep };
+        if(!std::equal(depends, depends + 4, preIntegrationBuilt))
+        {
+            BuildPreIntegrationTable(&transferFunc[0], transferFunc.size(),
+                                     params.transferOffset, params.transferScale, params.density, params.tstep,
+                                     kPreIntegrationTableSize, preIntegrationTable);
+            std::copy(depends, depends + 4, preIntegrationBuilt);
+        }
+    }
+
+    if(threads == 0)
+    {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    threads = std::max((size_t)1, std::min(threads, (size_t)imageH));
+
+    static RowRenderer variants[CPU_RENDER_VARIANTS];
+    static std::once_flag filled;
+    std::call_once(filled, []() { RowRendererTable<CPU_RENDER_VARIANTS - 1>::Fill(variants); });
+    unsigned features = (params.linearFiltering ? CPU_RENDER_LINEAR : 0) |
+                        (params.preIntegrated ? CPU_RENDER_PREINTEGRATED : 0) |
+                        ((params.shaded && !gradients.empty()) ? CPU_RENDER_SHADED : 0) |
+                        (visibility ? CPU_RENDER_VISIBILITY : 0) |
+                        (brickVisibility ? CPU_RENDER_BRICKS : 0) |
+                        ((params.opacityThreshold < 1.f) ? CPU_RENDER_EARLY_OUT : 0);
+    RowRenderer renderRows = variants[features];
+
+    // Interleaved rows, so the threads whose rows miss the volume aren't left idle
+    std::vector<uint32_t> partial(threads * binCount, 0);
+    std::vector<float> partialVisibility(visibility ? threads * VISIBILITY_BINS : 0, 0.f);
+    std::vector<float> partialBricks(brickVisibility ? threads * brickCount : 0, 0.f);
+    std::vector<std::thread> pool;
+    for(size_t t = 1; t < threads; ++t)
+    {
+        pool.push_back(std::thread(renderRows, this, std::cref(params), imageW, imageH, (uint32_t)t, (uint32_t)threads,
+                                   image, &partial[t * binCount], binCount,
+                                   visibility ? &partialVisibility[t * VISIBILITY_BINS] : nullptr,
+                                   brickVisibility ? &partialBricks[t * brickCount] : nullptr));
+    }
+    (this->*renderRows)(params, imageW, imageH, 0, (uint32_t)threads, image, &partial[0], binCount,
+               visibility ? &partialVisibility[0] : nullptr, brickVisibility ? &partialBricks[0] : nullptr);
+    for(size_t t = 0; t < pool.size(); ++t)
+    {
+        pool[t].join();
+    }
+
+    for(size_t t = 0; t < threads; ++t)
+    {
+        for(size_t bin = 0; bin < binCount; ++bin)
+        {
+            histogram[bin] += partial[t * binCount + bin];
+        }
+        for(size_t bin = 0; visibility && bin < VISIBILITY_BINS; ++bin)
+        {
+            visibility[bin] += partialVisibility[t * VISIBILITY_BINS + bin];
+        }
+        for(size_t brick = 0; brickVisibility && brick < brickCount; ++brick)
+        {
+            brickVisibility[brick] += partialBricks[t * brickCount + brick];
+        }
+    }
+
+    if(stats && stats->imageHistogram)
+    {
+        Entropy::BinImage(image, (size_t)imageW*imageH, stats->imageHistogram);
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef HEMELB_CPURENDERER_H
+#define HEMELB_CPURENDERER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <vector_types.h>
+
+#include "GradientVolume.h"
+
+// Everything one frame depends on, as the kernel gets it
+struct CpuRenderParams
+{
+    float   invViewMatrix[12];
+    float   density, brightness, transferOffset, transferScale, tstep;
+    float   opacityThreshold;   // 1 or more marches every ray through
+    bool    linearFiltering, preIntegrated;
+    bool    shaded;             // Ignored until SetGradients
+    ShadingParams shading;
+};
+
+// Optional per-frame statistics, as the kernel gathers them (see Entropy.h). Null skips one.
+struct CpuFrameStats
+{
+    uint32_t*   imageHistogram;     // IMAGE_HISTOGRAM_CHANNELS * IMAGE_HISTOGRAM_BINS
+    float*      visibility;         // VISIBILITY_BINS
+    float*      brickVisibility;    // One per brick of SetVisibilityBricks
+};
+
+// Host copy of d_render - same rays, box, sampling, classification and early
+// termination - for machines without a GPU and as a reference to check kernel
+// changes against. Texture reads are emulated, clamped and normalised as the
+// CUDA textures are set up, so images agree to within filtering precision.
+// Rows are shared out over threads (0 = one per core), each marched by a
+// RenderRows variant compiled for the frame's filtering, classification,
+// shading, statistics and early termination.
+class CpuRenderer {
+
+    public:
+        CpuRenderer();
+
+        // Copied, so the caller's buffer can go as soon as this returns
+        void    SetVolume(const unsigned char* voxels, size_t width, size_t height, size_t depth);
+        void    SetVolumeBox(float3 boxMin, float3 boxMax, float3 texScale, float3 texOffset);
+        void    SetTransferFunction(const float4* entries, size_t count);
+
+        // As BuildGradientVolume makes them, for the volume last set. Copied too.
+        void    SetGradients(const int8_t* gradients);
+
+        // Same bricks as setVisibilityGrid, returns how many there are
+        size_t  SetVisibilityBricks(size_t brickSize);
+
+        // histogram gets binCount bins of every sample taken, and stats whatever it asks for,
+        // all added to what's already there
+        void    Render(const CpuRenderParams& params, uint32_t imageW, uint32_t imageH,
+                       uint32_t* image, uint32_t* histogram, size_t binCount,
+                       const CpuFrameStats* stats = nullptr, size_t threads = 0);
+
+    private:
+        typedef void (CpuRenderer::*RowRenderer)(const CpuRenderParams&, uint32_t, uint32_t, uint32_t, uint32_t,
+                                                 uint32_t*, uint32_t*, size_t, float*, float*) const;
+        template <unsigned N> friend struct RowRendererTable;
+
+        // FEATURES is a mask of the CPU_RENDER_* bits in CpuRenderer.cpp
+        template <unsigned FEATURES>
+        void    RenderRows(const CpuRenderParams& params, uint32_t imageW, uint32_t imageH, uint32_t firstRow, uint32_t rowStep,
+                           uint32_t* image, uint32_t* histogram, size_t binCount,
+                           float* visibility, float* brickVisibility) const;
+        void    VolumeCoord(float3 pos, float* coord) const;
+        size_t  BrickAt(float3 pos) const;
+        template <bool LINEAR>
+        size_t  Footprint(float3 pos, size_t* voxels, float* weights) const;
+        template <bool LINEAR>
+        float   SampleVolume(float3 pos) const;
+        template <bool LINEAR>
+        float4  ShadeSample(float4 col, float3 pos, float3 viewDir, const CpuRenderParams& params) const;
+        float4  LookupTransfer(float sample, const CpuRenderParams& params) const;
+        float4  LookupPreIntegrated(float front, float back) const;
+
+        std::vector<unsigned char>  volume;
+        std::vector<int8_t>         gradients;
+        size_t                      width, height, depth;
+        float3                      boxMin, boxMax, texScale, texOffset;
+        std::vector<float4>         transferFunc;
+        size_t                      bricks[3];
+        float                       brickScale[3];
+
+        // Rebuilt whenever what it depends on changes
+        std::vector<float4>         preIntegrationTable;
+        float                       preIntegrationBuilt[4];
+};
+#endif
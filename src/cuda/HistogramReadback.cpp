@@ -0,0 +1,127 @@
+#include <cstdlib>
+#include <cstring>
+
+#include <cuda_runtime.h>
+#include "helper_cuda.h"
+
+#include "HistogramReadback.h"
+
+HistogramReadback::HistogramReadback(bool emulate)
+    : stream(0), done(0), emulate(emulate), ownStream(!emulate)
+{
+    if(ownStream)
+    {
+        checkCudaErrors(cudaStreamCreate(&stream));
+    }
+    if(!emulate)
+    {
+        checkCudaErrors(cudaEventCreateWithFlags(&done, cudaEventDisableTiming));
+    }
+}
+
+HistogramReadback::HistogramReadback(cudaStream_t stream, bool emulate)
+    : stream(stream), done(0), emulate(emulate), ownStream(false)
+{
+    if(!emulate)
+    {
+        checkCudaErrors(cudaEventCreateWithFlags(&done, cudaEventDisableTiming));
+    }
+}
+
+HistogramReadback::~HistogramReadback()
+{
+    for(size_t i = 0; i < buffers.size(); ++i)
+    {
+        if(emulate)
+        {
+            std::free(buffers[i].device);
+            std::free(buffers[i].host);
+        }
+        else
+        {
+            cudaFree(buffers[i].device);
+            cudaFreeHost(buffers[i].host);
+        }
+    }
+    if(done)
+    {
+        cudaEventDestroy(done);
+    }
+    if(ownStream)
+    {
+        cudaStreamDestroy(stream);
+    }
+}
+
+size_t HistogramReadback::Add(size_t bytes)
+{
+    Buffer buffer = { nullptr, nullptr, bytes };
+    if(emulate)
+    {
+        buffer.device = std::calloc(bytes, 1);
+        buffer.host = std::calloc(bytes, 1);
+    }
+    else
+    {
+        checkCudaErrors(cudaMalloc(&buffer.device, bytes));
+        checkCudaErrors(cudaMallocHost(&buffer.host, bytes));
+        checkCudaErrors(cudaMemset(buffer.device, 0, bytes));
+        std::memset(buffer.host, 0, bytes);
+    }
+    buffers.push_back(buffer);
+    return buffers.size() - 1;
+}
+
+void HistogramReadback::Clear(size_t buffer, size_t bytes)
+{
+    if(emulate)
+    {
+        std::memset(buffers[buffer].device, 0, bytes);
+    }
+    else
+    {
+        checkCudaErrors(cudaMemsetAsync(buffers[buffer].device, 0, bytes, stream));
+    }
+}
+
+void HistogramReadback::Download(size_t buffer, size_t bytes)
+{
+    if(emulate)
+    {
+        std::memcpy(buffers[buffer].host, buffers[buffer].device, bytes);
+    }
+    else
+    {
+        checkCudaErrors(cudaMemcpyAsync(buffers[buffer].host, buffers[buffer].device, bytes, cudaMemcpyDeviceToHost, stream));
+    }
+}
+
+void HistogramReadback::Record()
+{
+    if(!emulate)
+    {
+        checkCudaErrors(cudaEventRecord(done, stream));
+    }
+}
+
+bool HistogramReadback::Ready()
+{
+    if(emulate)
+    {
+        return true;
+    }
+    cudaError_t status = cudaEventQuery(done);
+    if(status != cudaErrorNotReady)
+    {
+        checkCudaErrors(status);
+    }
+    return status == cudaSuccess;
+}
+
+void HistogramReadback::Wait()
+{
+    if(!emulate)
+    {
+        checkCudaErrors(cudaEventSynchronize(done));
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef HEMELB_HISTOGRAMREADBACK_H
+#define HEMELB_HISTOGRAMREADBACK_H
+
+#include <cstddef>
+#include <vector>
+
+#include <cuda_runtime.h>
+
+// A frame's histograms on their way back from the device. Each buffer is a plain device
+// allocation the march adds into and a pinned host copy it is read back into. Clears and
+// copies are queued on one stream, and Record() marks the end of what is queued so far, so
+// the host only waits on that event - never on the whole device, and never on managed pages
+// migrating back and forth.
+//
+// The stream is the readback's own, created blocking so it stays ordered with the legacy
+// default stream, unless one is handed in to share. Emulated, both sides are host memory and
+// every call completes before it returns, so the CPU renderer and tests without a device go
+// through the same calls.
+class HistogramReadback {
+
+    public:
+        explicit HistogramReadback(bool emulate = false);
+        explicit HistogramReadback(cudaStream_t stream, bool emulate = false);
+        ~HistogramReadback();
+
+        // A buffer of the given size on both sides, and its index
+        size_t          Add(size_t bytes);
+        void*           Device(size_t buffer) const { return buffers[buffer].device; }
+        void*           Host(size_t buffer) const   { return buffers[buffer].host; }
+
+        cudaStream_t    Stream() const      { return stream; }
+        bool            Emulated() const    { return emulate; }
+
+        // Queued on the stream, the first bytes of the buffer only
+        void            Clear(size_t buffer, size_t bytes);
+        void            Download(size_t buffer, size_t bytes);
+
+        // Marks everything queued so far. Ready() once it has all happened, Wait() until it has.
+        void            Record();
+        bool            Ready();
+        void            Wait();
+
+    private:
+        HistogramReadback(const HistogramReadback&);
+        HistogramReadback& operator=(const HistogramReadback&);
+
+        struct Buffer
+        {
+            void*   device;
+            void*   host;
+            size_t  bytes;
+        };
+
+        std::vector<Buffer> buffers;
+        cudaStream_t        stream;
+        cudaEvent_t         done;
+        bool                emulate, ownStream;
+};
+#endif
@@ -17,17 +17,62 @@
 #include <helper_cuda.h>
 #include <helper_math.h>
 
+#include <algorithm>
+#include <vector>
+
+#include "GradientVolume.h"
+#include "PreIntegration.h"
+#include "TransferFunction.h"
+
 typedef unsigned int  uint;
 typedef unsigned char uchar;
 
 cudaArray *d_volumeArray = 0;
-cudaArray *d_transferFuncArray;
+cudaArray *d_preIntegrationArray = 0;
+cudaArray *d_gradientArray = 0;
+
+// Transfer functions are double buffered - a new one is uploaded into the back
+// array on its own stream while frames keep using the front one, then the
+// texture is rebound at the start of the first frame after the copy has landed.
+cudaArray   *d_transferFuncArray[2] = { 0, 0 };
+size_t      transferFuncSize[2]     = { 0, 0 };
+int         transferFuncFront       = 0;
+bool        transferFuncPending     = false;
+float4      *h_transferFuncStaging  = 0;    // pinned, so the upload really is async
+size_t      transferFuncStagingSize = 0;
+cudaStream_t transferFuncStream;
+cudaEvent_t  transferFuncUploaded;
 
 typedef unsigned char VolumeType;
 //typedef unsigned short VolumeType;
 
 texture<VolumeType, 3, cudaReadModeNormalizedFloat> tex;         // 3D texture
 texture<float4, 1, cudaReadModeElementType>         transferTex; // 1D transfer function texture
+texture<float4, 2, cudaReadModeElementType>         preIntTex;   // 2D pre-integrated transfer function, (front, back) sample
+texture<char4, 3, cudaReadModeNormalizedFloat>      gradientTex; // 3D normals and relative gradient magnitude, see GradientVolume.h
+
+// Pre-integration table resolution per axis - 1MB of float4
+const uint PREINTEGRATION_TABLE_SIZE = 256;
+
+// Per view sample captures, one per slot so a few fixed views can all be re-composited. Each
+// ray's samples are packed at its own offset, so a slot only holds the samples its view has.
+const int SAMPLE_CACHE_SLOTS = 4;
+ushort  *d_sampleCache[SAMPLE_CACHE_SLOTS]       = { 0 };
+ushort  *d_sampleCounts[SAMPLE_CACHE_SLOTS]      = { 0 };
+unsigned long long *d_sampleOffsets[SAMPLE_CACHE_SLOTS] = { 0 };
+size_t  sampleCacheSize[SAMPLE_CACHE_SLOTS]      = { 0 };   // samples
+size_t  sampleCountsSize[SAMPLE_CACHE_SLOTS]     = { 0 };   // rays
+size_t  sampleOffsetsSize[SAMPLE_CACHE_SLOTS]    = { 0 };   // rays
+__device__ unsigned long long d_sampleCursor;               // Samples counted, then handed out
+
+// Per-frame image and visibility histograms - must match Entropy.h
+const uint IMAGE_HISTOGRAM_BINS     = 256;
+const uint IMAGE_HISTOGRAM_CHANNELS = 5;    // r, g, b, a, luminance
+const uint VISIBILITY_BINS          = 256;
+
+// Host copies of the front and pending transfer functions, the pre-integration table is built from the front one
+std::vector<float4> h_transferFunc, h_transferFuncPending;
+bool preIntegrationDirty = true;
 
 typedef struct
 {
@@ -36,6 +81,35 @@ typedef struct
 
 __constant__ float3x4 c_invViewMatrix;  // inverse view matrix
 
+// The part of the [-1,1] world box this process renders, and how world space
+// maps into the texture it holds. The whole volume unless rendering one slab
+// of a sort-last split, where the texture only holds that slab (plus overlap).
+typedef struct
+{
+    float3 boxMin, boxMax;
+    float3 texScale, texOffset;
+} VolumeBox;
+
+__constant__ VolumeBox c_volumeBox;
+
+// Bricks the volume is cut into for per-region visibility - volume texture coordinates times
+// brickScale is the brick, clamped to the last one on each axis
+typedef struct
+{
+    uint3  bricks;
+    float3 brickScale;
+} VisibilityGrid;
+
+__constant__ VisibilityGrid c_visibilityGrid;
+
+typedef struct
+{
+    bool          enabled;      // only ever with a gradient volume uploaded
+    ShadingParams params;
+} Shading;
+
+__constant__ Shading c_shading;
+
 struct Ray
 {
     float3 o;   // origin
@@ -99,66 +173,210 @@ __device__ uint rgbaFloatToInt(float4 rgba)
     return (uint(rgba.w*255)<<24) | (uint(rgba.z*255)<<16) | (uint(rgba.y*255)<<8) | uint(rgba.x*255);
 }
 
+// Any bin count. Clamped at both ends, so a sample of exactly 1.0 lands in the top bin rather
+// than one past it.
 __device__ void BinSingle(float input, uint* histogram, size_t size)
 {
   uint bin_count = size/sizeof(uint);
-  float step = 1.f/bin_count;
-  uint idx = (uint)(input/step);
+  uint idx = min((uint)(__saturatef(input)*bin_count), bin_count - 1);
 
   atomicAdd(&histogram[idx], 1);
 }
 
-__global__ void
-d_render(uint *d_output, uint imageW, uint imageH,
-         float density, float brightness,
-         float transferOffset, float transferScale, uint* pVolumeDataHist, size_t histSize)
+// Each block gathers its pixels' image histogram and its rays' visibility in shared memory, and
+// adds them to the frame's once at the end, so the global atomics are per block rather than per
+// pixel or sample. Every thread of a block has to call both, which is why the kernels below never
+// return early.
+__device__ void clearFrameStats(uint *s_imageHist, float *s_visibility)
 {
-    const int maxSteps = 500;
-    const float tstep = 0.01f;
-    const float opacityThreshold = 0.95f;
-    const float3 boxMin = make_float3(-1.0f, -1.0f, -1.0f);
-    const float3 boxMax = make_float3(1.0f, 1.0f, 1.0f);
+    uint tid = threadIdx.y*blockDim.x + threadIdx.x;
+    uint threads = blockDim.x*blockDim.y;
+    for (uint i = tid; i < IMAGE_HISTOGRAM_CHANNELS*IMAGE_HISTOGRAM_BINS; i += threads) s_imageHist[i] = 0;
+    for (uint i = tid; i < VISIBILITY_BINS; i += threads) s_visibility[i] = 0.0f;
+    __syncthreads();
+}
 
-    uint x = blockIdx.x*blockDim.x + threadIdx.x;
-    uint y = blockIdx.y*blockDim.y + threadIdx.y;
+__device__ void flushFrameStats(uint rgba, bool inImage, uint *s_imageHist, float *s_visibility,
+                                uint *pImageHist, float *pVisibilityHist)
+{
+    if (pImageHist && inImage)
+    {
+        uint r = rgba & 0xff, g = (rgba >> 8) & 0xff, b = (rgba >> 16) & 0xff, a = rgba >> 24;
+        atomicAdd(&s_imageHist[r], 1);
+        atomicAdd(&s_imageHist[IMAGE_HISTOGRAM_BINS + g], 1);
+        atomicAdd(&s_imageHist[2*IMAGE_HISTOGRAM_BINS + b], 1);
+        atomicAdd(&s_imageHist[3*IMAGE_HISTOGRAM_BINS + a], 1);
+        atomicAdd(&s_imageHist[4*IMAGE_HISTOGRAM_BINS + ((54*r + 183*g + 19*b) >> 8)], 1);   // LuminanceBin
+    }
+    __syncthreads();
 
-    if ((x >= imageW) || (y >= imageH)) return;
+    uint tid = threadIdx.y*blockDim.x + threadIdx.x;
+    uint threads = blockDim.x*blockDim.y;
+    for (uint i = tid; pImageHist && i < IMAGE_HISTOGRAM_CHANNELS*IMAGE_HISTOGRAM_BINS; i += threads)
+    {
+        if (s_imageHist[i]) atomicAdd(&pImageHist[i], s_imageHist[i]);
+    }
+    for (uint i = tid; pVisibilityHist && i < VISIBILITY_BINS; i += threads)
+    {
+        if (s_visibility[i] > 0.0f) atomicAdd(&pVisibilityHist[i], s_visibility[i]);
+    }
+}
+
+// Opacity this sample adds to the final pixel, by the sample's value
+__device__ void accumulateVisibility(float *s_visibility, float sample, float contribution)
+{
+    if (s_visibility && contribution > 0.0f)
+    {
+        atomicAdd(&s_visibility[min((uint)(__saturatef(sample)*VISIBILITY_BINS), VISIBILITY_BINS - 1)], contribution);
+    }
+}
+
+// Table texel centres sit at i/(N-1) in sample space
+__device__ float4 preIntegratedLookup(float front, float back)
+{
+    const float scale = (PREINTEGRATION_TABLE_SIZE - 1.0f) / PREINTEGRATION_TABLE_SIZE;
+    const float bias = 0.5f / PREINTEGRATION_TABLE_SIZE;
+    return tex2D(preIntTex, front*scale + bias, back*scale + bias);
+}
+
+const int maxSteps = 500;
+
+// Rays stop once this opaque, 1 or more marches every ray to the far side - see setOpacityThreshold
+float opacityThreshold = 0.95f;
+
+// Mirrors c_shading.enabled, for picking the march variant on the host
+bool shadingEnabled = false;
+
+// What a d_render variant gathers and does per sample. Each combination is its own instantiation,
+// so the march loop only has the branches its frame actually needs, folded away at compile time.
+// The filter mode is texture state and VolumeType one texture, so neither needs a variant.
+enum RenderFeature
+{
+    RENDER_VOLUME_HIST      = 1 << 0,   // Sample histogram, pVolumeDataHist
+    RENDER_FRAME_STATS      = 1 << 1,   // Image histogram and visibility, gathered per block
+    RENDER_BRICKS           = 1 << 2,   // Per-brick visibility
+    RENDER_PREINTEGRATED    = 1 << 3,
+    RENDER_SHADED           = 1 << 4,
+    RENDER_EARLY_OUT        = 1 << 5,   // Stop at opacityThreshold
+    RENDER_VARIANTS         = 1 << 6
+};
+
+// Eye ray for pixel (x, y) and where it enters/leaves the volume, false on a miss
+__device__ bool eyeRayForPixel(uint x, uint y, uint imageW, uint imageH, float tstep, Ray *eyeRay, float *tnear, float *tfar)
+{
+    const float3 boxMin = make_float3(-1.0f, -1.0f, -1.0f);
+    const float3 boxMax = make_float3(1.0f, 1.0f, 1.0f);
 
     float u = (x / (float) imageW)*2.0f-1.0f;
     float v = (y / (float) imageH)*2.0f-1.0f;
 
     // calculate eye ray in world space
-    Ray eyeRay;
-    eyeRay.o = make_float3(mul(c_invViewMatrix, make_float4(0.0f, 0.0f, 0.0f, 1.0f)));
-    eyeRay.d = normalize(make_float3(u, v, -2.0f));
-    eyeRay.d = mul(c_invViewMatrix, eyeRay.d);
+    eyeRay->o = make_float3(mul(c_invViewMatrix, make_float4(0.0f, 0.0f, 0.0f, 1.0f)));
+    eyeRay->d = normalize(make_float3(u, v, -2.0f));
+    eyeRay->d = mul(c_invViewMatrix, eyeRay->d);
 
     // find intersection with box
-    float tnear, tfar;
-    int hit = intersectBox(eyeRay, boxMin, boxMax, &tnear, &tfar);
+    float fullNear, fullFar;
+    if (!intersectBox(*eyeRay, boxMin, boxMax, &fullNear, &fullFar)) return false;
+    if (!intersectBox(*eyeRay, c_volumeBox.boxMin, c_volumeBox.boxMax, tnear, tfar)) return false;
 
-    if (!hit) return;
+    if (fullNear < 0.0f) fullNear = 0.0f;     // clamp to near plane
+    if (*tnear < 0.0f) *tnear = 0.0f;
 
-    if (tnear < 0.0f) tnear = 0.0f;     // clamp to near plane
+    // Start on the sample grid the whole volume would use, so slabs share out the samples rather than resample
+    *tnear = fullNear + ceilf((*tnear - fullNear)/tstep)*tstep;
+    return *tnear <= *tfar;
+}
 
-    // march along ray from front to back, accumulating color
-    float4 sum = make_float4(0.0f);
-    float t = tnear;
-    float3 pos = eyeRay.o + eyeRay.d*tnear;
-    float3 step = eyeRay.d*tstep;
+// world position to volume texture coordinates
+__device__ float3 volumeCoord(float3 pos)
+{
+    // remap position to [0, 1] coordinates, then into whatever part of the volume the texture holds
+    return (pos*0.5f + 0.5f)*c_volumeBox.texScale + c_volumeBox.texOffset;
+}
 
-    for (int i=0; i<maxSteps; i++)
+// world position to volume sample
+__device__ float sampleVolume(float3 pos)
+{
+    float3 coord = volumeCoord(pos);
+    return tex3D(tex, coord.x, coord.y, coord.z);
+}
+
+__device__ uint brickAt(float3 pos)
+{
+    float3 b = volumeCoord(pos)*c_visibilityGrid.brickScale;
+    uint3 last = c_visibilityGrid.bricks - make_uint3(1);
+    uint bx = min((uint)fmaxf(b.x, 0.0f), last.x);
+    uint by = min((uint)fmaxf(b.y, 0.0f), last.y);
+    uint bz = min((uint)fmaxf(b.z, 0.0f), last.z);
+    return (bz*c_visibilityGrid.bricks.y + by)*c_visibilityGrid.bricks.x + bx;
+}
+
+// Headlight Blinn-Phong of a premultiplied sample - the light is at the eye, so N.H is N.V and one
+// dot product does both terms. Two sided, and faded out where the gradient is too weak to trust.
+__device__ float4 shadeSample(float4 col, float3 pos, float3 viewDir)
+{
+    float3 coord = volumeCoord(pos);
+    float4 g = tex3D(gradientTex, coord.x, coord.y, coord.z);
+    float3 normal = make_float3(g.x, g.y, g.z);
+    float weight = __saturatef(g.w*c_shading.params.magnitudeGain);
+    float len = length(normal);
+    float ndotv = (len > 0.0f) ? fabsf(dot(normal, viewDir))/len : 0.0f;
+
+    float lit = lerp(1.0f, c_shading.params.ambient + c_shading.params.diffuse*ndotv, weight);
+    float highlight = weight*c_shading.params.specular*__powf(ndotv, c_shading.params.shininess)*col.w;
+    col.x = col.x*lit + highlight;
+    col.y = col.y*lit + highlight;
+    col.z = col.z*lit + highlight;
+    return col;
+}
+
+// Sums a ray's visible opacity per brick in registers, and only touches global memory when the
+// ray moves on to another brick - a handful of atomics per ray rather than one per sample
+struct BrickVisibility
+{
+    float   *bricks;    // null when not being gathered
+    uint    current;
+    float   pending;
+
+    __device__ BrickVisibility(float *bricks) : bricks(bricks), current(0), pending(0.0f) {}
+
+    __device__ void add(float3 pos, float contribution)
     {
-        // read from 3D texture
-        // remap position to [0, 1] coordinates
-        float sample = tex3D(tex, pos.x*0.5f+0.5f, pos.y*0.5f+0.5f, pos.z*0.5f+0.5f);
-        //sample *= 64.0f;    // scale for 10-bit data
+        if (!bricks) return;
+        uint brick = brickAt(pos);
+        if (brick != current)
+        {
+            flush();
+            current = brick;
+        }
+        pending += contribution;
+    }
 
-        BinSingle(sample, pVolumeDataHist, histSize);
-        __syncthreads();
+    __device__ void flush()
+    {
+        if (bricks && pending > 0.0f) atomicAdd(&bricks[current], pending);
+        pending = 0.0f;
+    }
+};
 
+// Premultiplied colour of one sample, or of the segment ending at it when pre-integrated. Inlined,
+// so a compile-time preIntegrated leaves only the one lookup.
+__device__ __forceinline__ float4 classifySample(float sample, float *front, float density,
+                                 float transferOffset, float transferScale, bool preIntegrated)
+{
+    float4 col;
+    if (preIntegrated)
+    {
+        // segment [front, sample] - already premultiplied, with offset/scale/density and
+        // the step length baked in. The first sample only opens the segment.
+        col = (*front < 0.0f) ? make_float4(0.0f) : preIntegratedLookup(*front, sample);
+        *front = sample;
+    }
+    else
+    {
         // lookup in transfer function texture
-        float4 col = tex1D(transferTex, (sample-transferOffset)*transferScale);
+        col = tex1D(transferTex, (sample-transferOffset)*transferScale);
         col.w *= density;
 
         // "under" operator for back-to-front blending
@@ -168,11 +386,50 @@ d_render(uint *d_output, uint imageW, uint imageH,
         col.x *= col.w;
         col.y *= col.w;
         col.z *= col.w;
+    }
+    return col;
+}
+
+// Colour of one pixel's ray, before brightness
+template <uint FEATURES>
+__device__ float4 marchRay(uint x, uint y, uint imageW, uint imageH,
+                           float density, float transferOffset, float transferScale, uint* pVolumeDataHist, size_t histSize,
+                           float tstep, float opacity, float *s_visibility, float *pBrickVisibility)
+{
+    const bool preIntegrated = (FEATURES & RENDER_PREINTEGRATED) != 0;
+
+    float4 sum = make_float4(0.0f);
+
+    Ray eyeRay;
+    float tnear, tfar;
+    if (!eyeRayForPixel(x, y, imageW, imageH, tstep, &eyeRay, &tnear, &tfar)) return sum;
+
+    // march along ray from front to back, accumulating color
+    float t = tnear;
+    float3 pos = eyeRay.o + eyeRay.d*tnear;
+    float3 step = eyeRay.d*tstep;
+    float front = -1.0f;   // previous sample, the start of the pre-integrated segment
+    BrickVisibility brickVisibility(pBrickVisibility);
+
+    for (int i=0; i<maxSteps; i++)
+    {
+        // read from 3D texture
+        float sample = sampleVolume(pos);
+        //sample *= 64.0f;    // scale for 10-bit data
+
+        if (FEATURES & RENDER_VOLUME_HIST) BinSingle(sample, pVolumeDataHist, histSize);
+
+        float4 col = classifySample(sample, &front, density, transferOffset, transferScale, preIntegrated);
+        // Only samples that show get the extra fetch, so empty space costs what it always did
+        if ((FEATURES & RENDER_SHADED) && col.w > 0.0f) col = shadeSample(col, pos, eyeRay.d);
+        if (FEATURES & RENDER_FRAME_STATS) accumulateVisibility(s_visibility, sample, col.w*(1.0f - sum.w));
+        if (FEATURES & RENDER_BRICKS) brickVisibility.add(pos, col.w*(1.0f - sum.w));
+
         // "over" operator for front-to-back blending
         sum = sum + col*(1.0f - sum.w);
 
         // exit early if opaque
-        if (sum.w > opacityThreshold)
+        if ((FEATURES & RENDER_EARLY_OUT) && sum.w > opacity)
             break;
 
         t += tstep;
@@ -181,17 +438,314 @@ d_render(uint *d_output, uint imageW, uint imageH,
 
         pos += step;
     }
+    if (FEATURES & RENDER_BRICKS) brickVisibility.flush();
+    return sum;
+}
+
+// Which pixel of its cell a thread marches in a subsampling batch. A fixed per-cell offset plus an odd
+// stride walks every pixel of a power of two cell once over pixelStep^2 batches, each batch taking
+// one ray per cell - a jittered stratified sample that never repeats a ray.
+__device__ uint subsamplePixel(uint cellX, uint cellY, uint pixelStep, uint batch)
+{
+    uint h = cellX*0x85EBCA77u ^ cellY*0xC2B2AE3Du;
+    h ^= h >> 15; h *= 0x2C1B3C6Du; h ^= h >> 12;
+    return (h + batch*0x9E3779B1u) & (pixelStep*pixelStep - 1);
+}
+
+// One thread per pixelStep x pixelStep cell, marching its top left pixel and filling the cell with it.
+// A refining pass skips the cells' pixels a pass at twice the step already marched, so running
+// steps N, N/2, ... 1 marches every pixel exactly once and ends on the full resolution image,
+// with every histogram holding what one full frame would. With batch >= 0 the pixel is
+// subsamplePixel's instead, and only batch 0 fills the cell. A null d_output makes it a stats
+// pass and a null pVolumeDataHist a colour-only one, so the two can run at different resolutions.
+// FEATURES has to agree with the pointers - renderVariant picks it from them.
+template <uint FEATURES>
+__global__ void
+d_render(uint *d_output, uint imageW, uint imageH,
+         float density, float brightness,
+         float transferOffset, float transferScale, uint* pVolumeDataHist, size_t histSize,
+         float tstep, float opacity, uint *pImageHist, float *pVisibilityHist, float *pBrickVisibility,
+         uint pixelStep, bool refining, int batch)
+{
+    __shared__ uint  s_imageHist[IMAGE_HISTOGRAM_CHANNELS*IMAGE_HISTOGRAM_BINS];
+    __shared__ float s_visibility[VISIBILITY_BINS];
+    const bool stats = (FEATURES & RENDER_FRAME_STATS) != 0;
+    if (stats) clearFrameStats(s_imageHist, s_visibility);
+
+    uint cellX = blockIdx.x*blockDim.x + threadIdx.x;
+    uint cellY = blockIdx.y*blockDim.y + threadIdx.y;
+    uint x0 = cellX*pixelStep, y0 = cellY*pixelStep;
+    uint x = x0, y = y0;
+    bool fill = true;
+    if (batch >= 0)
+    {
+        uint k = subsamplePixel(cellX, cellY, pixelStep, batch);
+        x += k % pixelStep;
+        y += k / pixelStep;
+        fill = (batch == 0);
+    }
+    bool inImage = (x < imageW) && (y < imageH);
+    if (refining && x % (2*pixelStep) == 0 && y % (2*pixelStep) == 0) inImage = false;
+
+    uint rgba = 0;
+    if (inImage)
+    {
+        float4 sum = marchRay<FEATURES>(x, y, imageW, imageH, density, transferOffset, transferScale, pVolumeDataHist, histSize,
+                                        tstep, opacity, s_visibility, pBrickVisibility);
+        sum *= brightness;
+
+        // write output color
+        rgba = rgbaFloatToInt(sum);
+        if (d_output && fill)
+        {
+            uint x1 = min(x0 + pixelStep, imageW), y1 = min(y0 + pixelStep, imageH);
+            for (uint py = y0; py < y1; py++)
+                for (uint px = x0; px < x1; px++)
+                    d_output[py*imageW + px] = rgba;
+        }
+        else if (d_output)
+        {
+            d_output[y*imageW + x] = rgba;
+        }
+    }
+
+    if (stats) flushFrameStats(rgba, inImage, s_imageHist, s_visibility, pImageHist, pVisibilityHist);
+}
+
+typedef void (*RenderKernel)(uint *, uint, uint, float, float, float, float, uint *, size_t,
+                             float, float, uint *, float *, float *, uint, bool, int);
+
+// Every d_render<FEATURES> for FEATURES <= N, by index
+template <uint N>
+struct RenderVariantTable
+{
+    static void fill(RenderKernel *table)
+    {
+        table[N] = d_render<N>;
+        RenderVariantTable<N - 1>::fill(table);
+    }
+};
+
+template <>
+struct RenderVariantTable<0>
+{
+    static void fill(RenderKernel *table)
+    {
+        table[0] = d_render<0>;
+    }
+};
+
+RenderKernel renderVariant(uint features)
+{
+    static RenderKernel table[RENDER_VARIANTS];
+    static bool filled = false;
+    if (!filled)
+    {
+        RenderVariantTable<RENDER_VARIANTS - 1>::fill(table);
+        filled = true;
+    }
+    return table[features];
+}
+
+// How many samples each ray will capture - the same steps as d_captureSamples takes - and
+// their total in d_sampleCursor
+__global__ void
+d_countSamples(uint imageW, uint imageH, float tstep, ushort *counts)
+{
+    uint x = blockIdx.x*blockDim.x + threadIdx.x;
+    uint y = blockIdx.y*blockDim.y + threadIdx.y;
+
+    if ((x >= imageW) || (y >= imageH)) return;
+
+    uint ray = y*imageW + x;
+    Ray eyeRay;
+    float tnear, tfar;
+    if (!eyeRayForPixel(x, y, imageW, imageH, tstep, &eyeRay, &tnear, &tfar))
+    {
+        counts[ray] = 0;
+        return;
+    }
+
+    float t = tnear;
+    uint i = 0;
+    while (i < (uint)maxSteps)
+    {
+        i++;
+        t += tstep;
+
+        if (t > tfar) break;
+    }
+    counts[ray] = (ushort)i;
+    atomicAdd(&d_sampleCursor, (unsigned long long)i);
+}
+
+// Records the raw samples along every ray, all the way to where it leaves the
+// volume since how early it terminates depends on the transfer function.
+// 16 bit, so linearly filtered samples keep their fractional part. Each ray takes
+// its counted samples' worth of room from d_sampleCursor.
+__global__ void
+d_captureSamples(uint imageW, uint imageH, float tstep, ushort *samples, const ushort *counts, unsigned long long *offsets)
+{
+    uint x = blockIdx.x*blockDim.x + threadIdx.x;
+    uint y = blockIdx.y*blockDim.y + threadIdx.y;
+
+    if ((x >= imageW) || (y >= imageH)) return;
+
+    uint ray = y*imageW + x;
+    uint count = counts[ray];
+    Ray eyeRay;
+    float tnear, tfar;
+    if (!count || !eyeRayForPixel(x, y, imageW, imageH, tstep, &eyeRay, &tnear, &tfar))
+    {
+        return;
+    }
+
+    float3 pos = eyeRay.o + eyeRay.d*tnear;
+    float3 step = eyeRay.d*tstep;
+    unsigned long long offset = atomicAdd(&d_sampleCursor, (unsigned long long)count);
+    ushort *raySamples = samples + offset;
+    offsets[ray] = offset;
+
+    for (uint i=0; i<count; i++)
+    {
+        float sample = sampleVolume(pos);
+        raySamples[i] = (ushort)(__saturatef(sample)*65535.0f + 0.5f);
+        pos += step;
+    }
+}
 
-    sum *= brightness;
+// d_render, but reading the samples back from a capture instead of the volume
+__global__ void
+d_renderFromSamples(uint *d_output, uint imageW, uint imageH,
+                    float density, float brightness,
+                    float transferOffset, float transferScale, uint* pVolumeDataHist, size_t histSize,
+                    bool preIntegrated, const ushort *samples, const ushort *counts, const unsigned long long *offsets,
+                    uint *pImageHist, float *pVisibilityHist, float *pBrickVisibility, float tstep, float opacity)
+{
+    __shared__ uint  s_imageHist[IMAGE_HISTOGRAM_CHANNELS*IMAGE_HISTOGRAM_BINS];
+    __shared__ float s_visibility[VISIBILITY_BINS];
+    bool stats = pImageHist || pVisibilityHist;
+    if (stats) clearFrameStats(s_imageHist, s_visibility);
 
-    // write output color
-    d_output[y*imageW + x] = rgbaFloatToInt(sum);
+    uint x = blockIdx.x*blockDim.x + threadIdx.x;
+    uint y = blockIdx.y*blockDim.y + threadIdx.y;
+    bool inImage = (x < imageW) && (y < imageH);
+
+    uint rgba = 0;
+    if (inImage)
+    {
+        uint ray = y*imageW + x;
+        uint count = counts[ray];
+        const ushort *raySamples = count ? samples + offsets[ray] : samples;
+        float4 sum = make_float4(0.0f);
+        float front = -1.0f;
+
+        // Samples don't keep their positions, so walk the same ray alongside them for the bricks and normals
+        Ray eyeRay;
+        float tnear = 0.0f, tfar;
+        bool walk = count && (pBrickVisibility || c_shading.enabled) &&
+                    eyeRayForPixel(x, y, imageW, imageH, tstep, &eyeRay, &tnear, &tfar);
+        BrickVisibility brickVisibility(walk ? pBrickVisibility : 0);
+
+        for (uint i=0; i<count; i++)
+        {
+            float sample = raySamples[i] * (1.0f/65535.0f);
+
+            BinSingle(sample, pVolumeDataHist, histSize);
+
+            float4 col = classifySample(sample, &front, density, transferOffset, transferScale, preIntegrated);
+            float3 pos = walk ? eyeRay.o + eyeRay.d*(tnear + i*tstep) : make_float3(0.0f);
+            if (walk && c_shading.enabled && col.w > 0.0f) col = shadeSample(col, pos, eyeRay.d);
+            if (pVisibilityHist) accumulateVisibility(s_visibility, sample, col.w*(1.0f - sum.w));
+            if (brickVisibility.bricks) brickVisibility.add(pos, col.w*(1.0f - sum.w));
+            sum = sum + col*(1.0f - sum.w);
+
+            // exit early if opaque
+            if (sum.w > opacity)
+                break;
+        }
+        brickVisibility.flush();
+
+        sum *= brightness;
+        rgba = rgbaFloatToInt(sum);
+        d_output[ray] = rgba;
+    }
+
+    if (stats) flushFrameStats(rgba, inImage, s_imageHist, s_visibility, pImageHist, pVisibilityHist);
 }
 
 extern "C"
 void setTextureFilterMode(bool bLinearFilter)
 {
     tex.filterMode = bLinearFilter ? cudaFilterModeLinear : cudaFilterModePoint;
+    gradientTex.filterMode = tex.filterMode;
+}
+
+extern "C" void setTransferFunction(const float4 *entries, size_t count);
+extern "C" void commitTransferFunction();
+
+extern "C"
+void setVolumeBox(float3 boxMin, float3 boxMax, float3 texScale, float3 texOffset)
+{
+    VolumeBox box = { boxMin, boxMax, texScale, texOffset };
+    checkCudaErrors(cudaMemcpyToSymbol(c_volumeBox, &box, sizeof(VolumeBox)));
+}
+
+// Cut the volume into brickSize^3 bricks for per-brick visibility, returns how many bricks that makes
+extern "C"
+size_t setVisibilityGrid(cudaExtent volumeSize, uint brickSize)
+{
+    VisibilityGrid grid;
+    grid.bricks = make_uint3((volumeSize.width + brickSize - 1)/brickSize,
+                             (volumeSize.height + brickSize - 1)/brickSize,
+                             (volumeSize.depth + brickSize - 1)/brickSize);
+    grid.brickScale = make_float3((float)volumeSize.width/brickSize, (float)volumeSize.height/brickSize,
+                                  (float)volumeSize.depth/brickSize);
+    checkCudaErrors(cudaMemcpyToSymbol(c_visibilityGrid, &grid, sizeof(VisibilityGrid)));
+    return (size_t)grid.bricks.x*grid.bricks.y*grid.bricks.z;
+}
+
+extern "C"
+void setShading(bool enabled, const ShadingParams *params)
+{
+    Shading shading = { enabled && d_gradientArray != 0, params ? *params : DEFAULT_SHADING };
+    checkCudaErrors(cudaMemcpyToSymbol(c_shading, &shading, sizeof(Shading)));
+    shadingEnabled = shading.enabled;
+}
+
+// 1 or more turns early ray termination off, so every sample along every ray lands in the
+// histograms whatever the transfer function hides behind it
+extern "C"
+void setOpacityThreshold(float threshold)
+{
+    opacityThreshold = threshold;
+}
+
+// Gradients as BuildGradientVolume makes them, 4 bytes a voxel, same size as the volume.
+// Replaces any already uploaded, so the next timestep can bring its own.
+extern "C"
+void initGradients(const void *h_gradients, cudaExtent volumeSize)
+{
+    cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc<char4>();
+    if (!d_gradientArray)
+    {
+        checkCudaErrors(cudaMalloc3DArray(&d_gradientArray, &channelDesc, volumeSize));
+    }
+
+    cudaMemcpy3DParms copyParams = {0};
+    copyParams.srcPtr   = make_cudaPitchedPtr((void*)h_gradients, volumeSize.width*sizeof(char4), volumeSize.width, volumeSize.height);
+    copyParams.dstArray = d_gradientArray;
+    copyParams.extent   = volumeSize;
+    copyParams.kind     = cudaMemcpyHostToDevice;
+    checkCudaErrors(cudaMemcpy3D(&copyParams));
+
+    // filtered and clamped as the volume is, so the normals line up with the samples
+    gradientTex.normalized = true;
+    gradientTex.filterMode = tex.filterMode;
+    gradientTex.addressMode[0] = cudaAddressModeClamp;
+    gradientTex.addressMode[1] = cudaAddressModeClamp;
+    gradientTex.addressMode[2] = cudaAddressModeClamp;
+    checkCudaErrors(cudaBindTextureToArray(gradientTex, d_gradientArray, channelDesc));
 }
 
 extern "C"
@@ -218,51 +772,252 @@ void initCuda(void *h_volume, cudaExtent volumeSize)
     // bind array to 3D texture
     checkCudaErrors(cudaBindTextureToArray(tex, d_volumeArray, channelDesc));
 
-    // create transfer function texture
-    float4 transferFunc[] =
-    {
-        {  1.0, 0.0, 0.0, 1.0, },
-        {  1.0, 0.5, 0.0, 1.0, },
-        {  1.0, 1.0, 0.0, 1.0, },
-        {  0.0, 1.0, 0.0, 1.0, },
-        {  0.0, 1.0, 1.0, 1.0, },
-        {  0.0, 0.0, 1.0, 1.0, },
-        {  1.0, 0.0, 1.0, 1.0, },
-    };
+    // whole volume until told otherwise, unshaded until there are gradients
+    setVolumeBox(make_float3(-1.0f), make_float3(1.0f), make_float3(1.0f), make_float3(0.0f));
+    setShading(false, 0);
 
+    // create transfer function texture, starting from the default table
     cudaChannelFormatDesc channelDesc2 = cudaCreateChannelDesc<float4>();
-    cudaArray *d_transferFuncArray;
-    checkCudaErrors(cudaMallocArray(&d_transferFuncArray, &channelDesc2, sizeof(transferFunc)/sizeof(float4), 1));
-    checkCudaErrors(cudaMemcpyToArray(d_transferFuncArray, 0, 0, transferFunc, sizeof(transferFunc), cudaMemcpyHostToDevice));
-
     transferTex.filterMode = cudaFilterModePoint;
     transferTex.normalized = true;    // access with normalized texture coordinates
     transferTex.addressMode[0] = cudaAddressModeClamp;   // wrap texture coordinates
 
-    // Bind the array to the texture
-    checkCudaErrors(cudaBindTextureToArray(transferTex, d_transferFuncArray, channelDesc2));
+    // A blocking stream, so an upload still waits for earlier frames that might read the back array
+    checkCudaErrors(cudaStreamCreate(&transferFuncStream));
+    checkCudaErrors(cudaEventCreateWithFlags(&transferFuncUploaded, cudaEventDisableTiming));
+    TransferFunction defaultTransferFunc;
+    setTransferFunction(defaultTransferFunc.Data(), defaultTransferFunc.Size());
+    checkCudaErrors(cudaEventSynchronize(transferFuncUploaded));
+    commitTransferFunction();
+
+    // pre-integration table, filled in by updatePreIntegration
+    checkCudaErrors(cudaMallocArray(&d_preIntegrationArray, &channelDesc2, PREINTEGRATION_TABLE_SIZE, PREINTEGRATION_TABLE_SIZE));
+    preIntTex.filterMode = cudaFilterModeLinear;
+    preIntTex.normalized = true;
+    preIntTex.addressMode[0] = cudaAddressModeClamp;
+    preIntTex.addressMode[1] = cudaAddressModeClamp;
+    checkCudaErrors(cudaBindTextureToArray(preIntTex, d_preIntegrationArray, channelDesc2));
+}
+
+// Replace the volume's contents with another of the same size, e.g. the next timestep
+extern "C"
+void updateVolume(void *h_volume, cudaExtent volumeSize)
+{
+    cudaMemcpy3DParms copyParams = {0};
+    copyParams.srcPtr   = make_cudaPitchedPtr(h_volume, volumeSize.width*sizeof(VolumeType), volumeSize.width, volumeSize.height);
+    copyParams.dstArray = d_volumeArray;
+    copyParams.extent   = volumeSize;
+    copyParams.kind     = cudaMemcpyHostToDevice;
+    checkCudaErrors(cudaMemcpy3D(&copyParams));
+}
+
+// Queue a new transfer function for upload. Returns straight away, the frames
+// keep using the current table until the copy has finished.
+extern "C"
+void setTransferFunction(const float4 *entries, size_t count)
+{
+    // Only one upload in flight - a newer table simply replaces one that hasn't landed yet
+    checkCudaErrors(cudaEventSynchronize(transferFuncUploaded));
+
+    int back = 1 - transferFuncFront;
+    if (transferFuncSize[back] != count)
+    {
+        cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc<float4>();
+        if (d_transferFuncArray[back])
+        {
+            checkCudaErrors(cudaFreeArray(d_transferFuncArray[back]));
+        }
+        checkCudaErrors(cudaMallocArray(&d_transferFuncArray[back], &channelDesc, count, 1));
+        transferFuncSize[back] = count;
+    }
+
+    if (transferFuncStagingSize < count)
+    {
+        checkCudaErrors(cudaFreeHost(h_transferFuncStaging));
+        checkCudaErrors(cudaMallocHost(&h_transferFuncStaging, count*sizeof(float4)));
+        transferFuncStagingSize = count;
+    }
+
+    memcpy(h_transferFuncStaging, entries, count*sizeof(float4));
+    checkCudaErrors(cudaMemcpy2DToArrayAsync(d_transferFuncArray[back], 0, 0, h_transferFuncStaging,
+                                             count*sizeof(float4), count*sizeof(float4), 1,
+                                             cudaMemcpyHostToDevice, transferFuncStream));
+    checkCudaErrors(cudaEventRecord(transferFuncUploaded, transferFuncStream));
+
+    h_transferFuncPending.assign(entries, entries + count);
+    transferFuncPending = true;
+}
+
+// Swap in a pending transfer function if its upload has finished, never waits for it
+extern "C"
+void commitTransferFunction()
+{
+    if (!transferFuncPending || cudaEventQuery(transferFuncUploaded) != cudaSuccess)
+    {
+        return;
+    }
+
+    transferFuncFront = 1 - transferFuncFront;
+    cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc<float4>();
+    checkCudaErrors(cudaBindTextureToArray(transferTex, d_transferFuncArray[transferFuncFront], channelDesc));
+
+    h_transferFunc.swap(h_transferFuncPending);
+    transferFuncPending = false;
+    preIntegrationDirty = true;
+}
+
+extern "C"
+bool isTransferFunctionPending()
+{
+    return transferFuncPending;
+}
+
+// Rebuilds the pre-integration table, but only when something it depends on has changed
+extern "C"
+void updatePreIntegration(float transferOffset, float transferScale, float density, float tstep)
+{
+    static float built[4] = { -1.0f, -1.0f, -1.0f, -1.0f };
+    commitTransferFunction();
+    if (!preIntegrationDirty &&
+        built[0] == transferOffset && built[1] == transferScale && built[2] == density && built[3] == tstep)
+    {
+        return;
+    }
+
+    std::vector<float4> table;
+    BuildPreIntegrationTable(&h_transferFunc[0], h_transferFunc.size(),
+                             transferOffset, transferScale, density, tstep,
+                             PREINTEGRATION_TABLE_SIZE, table);
+    checkCudaErrors(cudaMemcpyToArray(d_preIntegrationArray, 0, 0, &table[0], table.size()*sizeof(float4), cudaMemcpyHostToDevice));
+
+    preIntegrationDirty = false;
+    built[0] = transferOffset;
+    built[1] = transferScale;
+    built[2] = density;
+    built[3] = tstep;
 }
 
 extern "C"
 void freeCudaBuffers()
 {
     checkCudaErrors(cudaFreeArray(d_volumeArray));
-    checkCudaErrors(cudaFreeArray(d_transferFuncArray));
+    checkCudaErrors(cudaEventSynchronize(transferFuncUploaded));
+    for (int i = 0; i < 2; ++i)
+    {
+        if (d_transferFuncArray[i])
+        {
+            checkCudaErrors(cudaFreeArray(d_transferFuncArray[i]));
+        }
+    }
+    checkCudaErrors(cudaFreeHost(h_transferFuncStaging));
+    checkCudaErrors(cudaEventDestroy(transferFuncUploaded));
+    checkCudaErrors(cudaStreamDestroy(transferFuncStream));
+    checkCudaErrors(cudaFreeArray(d_preIntegrationArray));
+    if (d_gradientArray)
+    {
+        checkCudaErrors(cudaFreeArray(d_gradientArray));
+        d_gradientArray = 0;
+    }
+
+    for (int i = 0; i < SAMPLE_CACHE_SLOTS; ++i)
+    {
+        checkCudaErrors(cudaFree(d_sampleCache[i]));
+        checkCudaErrors(cudaFree(d_sampleCounts[i]));
+        checkCudaErrors(cudaFree(d_sampleOffsets[i]));
+    }
 }
 
 
+// gridSize covers the full image, and is cut down here to the cells of a pixelStep > 1 pass.
+// batch >= 0 needs a power of two pixelStep.
 extern "C"
 void render_kernel(dim3 gridSize, dim3 blockSize, uint *d_output, uint imageW, uint imageH,
-                   float density, float brightness, float transferOffset, float transferScale, uint* pVolumeDataHist, size_t histSize)
+                   float density, float brightness, float transferOffset, float transferScale, uint* pVolumeDataHist, size_t histSize,
+                   float tstep, bool preIntegrated, uint* pImageHist, float* pVisibilityHist, float* pBrickVisibility,
+                   uint pixelStep, bool refining, int batch, cudaStream_t stream)
+{
+    commitTransferFunction();
+    uint features = (pVolumeDataHist ? RENDER_VOLUME_HIST : 0) |
+                    ((pImageHist || pVisibilityHist) ? RENDER_FRAME_STATS : 0) |
+                    (pBrickVisibility ? RENDER_BRICKS : 0) |
+                    (preIntegrated ? RENDER_PREINTEGRATED : 0) |
+                    (shadingEnabled ? RENDER_SHADED : 0) |
+                    ((opacityThreshold < 1.0f) ? RENDER_EARLY_OUT : 0);
+    dim3 cells((gridSize.x + pixelStep - 1)/pixelStep, (gridSize.y + pixelStep - 1)/pixelStep);
+    renderVariant(features)<<<cells, blockSize, 0, stream>>>(d_output, imageW, imageH, density,
+                                   brightness, transferOffset, transferScale, pVolumeDataHist, histSize,
+                                   tstep, opacityThreshold, pImageHist, pVisibilityHist, pBrickVisibility,
+                                   pixelStep, refining, batch);
+}
+
+// Grows a sample cache buffer to hold count elements, or leaves it empty when the device is out
+// of room - the caller falls back to marching the volume
+static bool growSampleBuffer(void **buffer, size_t *size, size_t count, size_t elementSize)
+{
+    // Only ever grows, so resizing the window back and forth doesn't thrash the allocator
+    if (*size >= count)
+    {
+        return true;
+    }
+    checkCudaErrors(cudaFree(*buffer));
+    *buffer = 0;
+    *size = 0;
+    if (cudaMalloc(buffer, count*elementSize) != cudaSuccess)
+    {
+        *buffer = 0;
+        cudaGetLastError();     // Not sticky, and not to be reported as the next kernel's failure
+        return false;
+    }
+    *size = count;
+    return true;
+}
+
+// False if there wasn't room on the device for the capture
+extern "C"
+bool captureSampleCache(int slot, dim3 gridSize, dim3 blockSize, uint imageW, uint imageH, float tstep)
+{
+    size_t rays = (size_t)imageW*imageH;
+    if (!growSampleBuffer((void **)&d_sampleCounts[slot], &sampleCountsSize[slot], rays, sizeof(ushort)) ||
+        !growSampleBuffer((void **)&d_sampleOffsets[slot], &sampleOffsetsSize[slot], rays, sizeof(unsigned long long)))
+    {
+        return false;
+    }
+
+    // Sized to what the rays between their entry and exit actually hold, not maxSteps for every pixel
+    unsigned long long total = 0;
+    checkCudaErrors(cudaMemcpyToSymbol(d_sampleCursor, &total, sizeof(total)));
+    d_countSamples<<<gridSize, blockSize>>>(imageW, imageH, tstep, d_sampleCounts[slot]);
+    checkCudaErrors(cudaMemcpyFromSymbol(&total, d_sampleCursor, sizeof(total)));
+    if (!growSampleBuffer((void **)&d_sampleCache[slot], &sampleCacheSize[slot], std::max(total, 1ULL), sizeof(ushort)))
+    {
+        return false;
+    }
+
+    unsigned long long start = 0;
+    checkCudaErrors(cudaMemcpyToSymbol(d_sampleCursor, &start, sizeof(start)));
+    d_captureSamples<<<gridSize, blockSize>>>(imageW, imageH, tstep, d_sampleCache[slot], d_sampleCounts[slot], d_sampleOffsets[slot]);
+    return true;
+}
+
+extern "C"
+void render_from_sample_cache(int slot, dim3 gridSize, dim3 blockSize, uint *d_output, uint imageW, uint imageH,
+                              float density, float brightness, float transferOffset, float transferScale,
+                              uint* pVolumeDataHist, size_t histSize, bool preIntegrated,
+                              uint* pImageHist, float* pVisibilityHist, float* pBrickVisibility, float tstep)
 {
-    d_render<<<gridSize, blockSize>>>(d_output, imageW, imageH, density,
-                                      brightness, transferOffset, transferScale, pVolumeDataHist, histSize);
+    commitTransferFunction();
+    d_renderFromSamples<<<gridSize, blockSize>>>(d_output, imageW, imageH, density, brightness,
+                                                 transferOffset, transferScale, pVolumeDataHist, histSize,
+                                                 preIntegrated, d_sampleCache[slot], d_sampleCounts[slot],
+                                                 d_sampleOffsets[slot], pImageHist, pVisibilityHist, pBrickVisibility, tstep,
+                                                 opacityThreshold);
 }
 
 extern "C"
-void copyInvViewMatrix(float *invViewMatrix, size_t sizeofMatrix)
+void copyInvViewMatrix(float *invViewMatrix, size_t sizeofMatrix, cudaStream_t stream)
 {
-    checkCudaErrors(cudaMemcpyToSymbol(c_invViewMatrix, invViewMatrix, sizeofMatrix));
+    // In stream order, so a frame still marching on the stream keeps the matrix it was launched with
+    checkCudaErrors(cudaMemcpyToSymbolAsync(c_invViewMatrix, invViewMatrix, sizeofMatrix, 0, cudaMemcpyHostToDevice, stream));
 }
 
 
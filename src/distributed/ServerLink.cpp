@@ -0,0 +1,139 @@
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ServerLink.h"
+
+ServerLink::ServerLink(const char* address, int port)
+    : address(address ? address : "127.0.0.1"), port(port), sock(-1),
+      failed(false), waiting(false), haveMessage(false), haveReply(false), stopping(false)
+{
+    worker = std::thread(&ServerLink::Run, this);
+}
+
+ServerLink::~ServerLink()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        if(sock >= 0)
+        {
+            shutdown(sock, SHUT_RDWR);  // Out of a recv() on a server that never answers
+        }
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+bool ServerLink::Failed()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return failed;
+}
+
+bool ServerLink::Send(const float step[5])
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(failed || waiting || haveReply)
+        {
+            return false;
+        }
+        std::memcpy(message, step, sizeof(message));
+        haveMessage = waiting = true;
+    }
+    changed.notify_all();
+    return true;
+}
+
+bool ServerLink::TakeReply(float pose[3])
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if(!haveReply)
+    {
+        return false;
+    }
+    std::memcpy(pose, reply, sizeof(reply));
+    haveReply = false;
+    return true;
+}
+
+int ServerLink::Connect() const
+{
+    int connection = socket(AF_INET, SOCK_STREAM, 0);
+    if(connection == -1)
+    {
+        perror("[CLIENT]: Could not create socket");
+        return -1;
+    }
+
+    sockaddr_in server;
+    std::memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = inet_addr(address.c_str());
+    if(connect(connection, (sockaddr*)&server, sizeof(server)) < 0)
+    {
+        perror("[CLIENT]: Connect failed. Error");
+        close(connection);
+        return -1;
+    }
+    return connection;
+}
+
+void ServerLink::Run()
+{
+    for(;;)
+    {
+        int connection = Connect();
+        float step[5];
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            sock = connection;
+            if(connection < 0 || stopping)
+            {
+                failed = connection < 0;
+                break;
+            }
+            changed.wait(guard, [this]() { return stopping || haveMessage; });
+            if(stopping)
+            {
+                break;
+            }
+            std::memcpy(step, message, sizeof(step));
+            haveMessage = false;
+        }
+
+        // MSG_NOSIGNAL - a server that went away fails the step, not the renderer
+        char answer[2000];
+        ssize_t length = -1;
+        if(send(connection, step, sizeof(step), MSG_NOSIGNAL) == (ssize_t)sizeof(step))
+        {
+            length = recv(connection, answer, sizeof(answer), 0);
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        if(length >= (ssize_t)sizeof(reply))
+        {
+            std::memcpy(reply, answer, sizeof(reply));
+            printf("[SERVER]: %f, %f, %f\n", reply[0], reply[1], reply[2]);
+            haveReply = true;
+        }
+        else
+        {
+            printf("[CLIENT]: Recv Failed\n");
+        }
+        waiting = false;
+        close(connection);
+        sock = -1;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if(sock >= 0)
+    {
+        close(sock);
+        sock = -1;
+    }
+}
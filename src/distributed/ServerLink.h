@@ -0,0 +1,46 @@
+#ifndef HEMELB_SERVERLINK_H
+#define HEMELB_SERVERLINK_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// The step exchange with the RL server, on a thread of its own so the render loop
+// never waits on the network. Each step is one connection: the frame's timestep,
+// rotation x/y, zoom and MI go out as five floats, and the reply's first three are
+// the pose to render next. The next step's connection is opened as soon as a reply
+// is in, while the renderer gets on with that pose. A server that can't be reached
+// is never retried.
+class ServerLink {
+
+    public:
+        ServerLink(const char* address, int port);
+        ~ServerLink();
+
+        bool    Failed();
+
+        // Starts a step with this frame, unless the last step's reply is outstanding or not taken yet - true if it did.
+        // A step whose reply never came can be sent again.
+        bool    Send(const float message[5]);
+        // The pose from the latest reply, if there is one not taken yet
+        bool    TakeReply(float pose[3]);
+
+    private:
+        ServerLink(const ServerLink&);
+        ServerLink& operator=(const ServerLink&);
+
+        void    Run();
+        int     Connect() const;
+
+        std::string             address;
+        int                     port;
+        int                     sock;           // Current step's connection, -1 between them
+        float                   message[5], reply[3];
+        bool                    failed, waiting, haveMessage, haveReply, stopping;
+
+        std::mutex              lock;
+        std::condition_variable changed;
+        std::thread             worker;
+};
+#endif
@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "SlabCompositor.h"
+
+static bool SendAll(int socket, const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+    while(size > 0)
+    {
+        // MSG_NOSIGNAL - a dead peer should fail the frame, not kill the process
+        ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+        if(sent <= 0)
+        {
+            return false;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool ReceiveAll(int socket, void* data, size_t size)
+{
+    char* bytes = (char*)data;
+    while(size > 0)
+    {
+        ssize_t received = recv(socket, bytes, size, 0);
+        if(received <= 0)
+        {
+            return false;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+void SlabRange(size_t depth, int slab, int slabCount, size_t* z0, size_t* z1)
+{
+    *z0 = depth * slab / slabCount;
+    *z1 = depth * (slab + 1) / slabCount;
+}
+
+SlabCompositor::SlabCompositor()
+    : workerSocket(-1)
+{
+}
+
+int SlabCompositor::Launch(int slabCount)
+{
+    for(int slab = 0; slab < slabCount; ++slab)
+    {
+        int fds[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            perror("SlabCompositor: socketpair");
+            exit(EXIT_FAILURE);
+        }
+
+        pid_t pid = fork();
+        if(pid < 0)
+        {
+            perror("SlabCompositor: fork");
+            exit(EXIT_FAILURE);
+        }
+
+        if(pid == 0)
+        {
+            // Worker - drop every coordinator end, including its siblings'
+            close(fds[0]);
+            for(size_t i = 0; i < sockets.size(); ++i)
+            {
+                close(sockets[i]);
+            }
+            sockets.clear();
+            workers.clear();
+            workerSocket = fds[1];
+            return slab;
+        }
+
+        close(fds[1]);
+        sockets.push_back(fds[0]);
+        workers.push_back(pid);
+    }
+    return -1;
+}
+
+// halfDepth is how far the volume reaches either side of z = 0 in world space
+bool SlabCompositor::ReceiveVolumeInfo(size_t depth, float halfDepth, std::vector<SlabVolumeInfo>* infos)
+{
+    infos->resize(sockets.size());
+    slabCentres.resize(sockets.size());
+    for(size_t slab = 0; slab < sockets.size(); ++slab)
+    {
+        if(!ReceiveAll(sockets[slab], &(*infos)[slab], sizeof(SlabVolumeInfo)))
+        {
+            fprintf(stderr, "SlabCompositor: slab %zu failed to load\n", slab);
+            return false;
+        }
+
+        size_t z0, z1;
+        SlabRange(depth, (int)slab, (int)sockets.size(), &z0, &z1);
+        slabCentres[slab] = halfDepth * (-1.f + (float)(z0 + z1) / depth);
+    }
+    return true;
+}
+
+bool SlabCompositor::Render(const SlabRequest& request, float brightness, uint32_t* image, uint32_t* histogram)
+{
+    // Every worker gets the frame before we wait on any of them, so they all march at once
+    for(size_t slab = 0; slab < sockets.size(); ++slab)
+    {
+        if(!SendAll(sockets[slab], &request, sizeof(SlabRequest)))
+        {
+            return false;
+        }
+    }
+
+    size_t pixels = (size_t)request.width * request.height;
+    partialImages.resize(pixels * sockets.size());
+    partialHistogram.resize(request.binCount);
+    std::fill(histogram, histogram + request.binCount, 0u);
+    for(size_t slab = 0; slab < sockets.size(); ++slab)
+    {
+        if(!ReceiveAll(sockets[slab], &partialImages[slab * pixels], pixels * sizeof(uint32_t)) ||
+           !ReceiveAll(sockets[slab], partialHistogram.data(), request.binCount * sizeof(uint32_t)))
+        {
+            return false;
+        }
+        for(size_t bin = 0; bin < request.binCount; ++bin)
+        {
+            histogram[bin] += partialHistogram[bin];
+        }
+    }
+
+    // Slabs are cut along z, so nearest-to-the-eye first is front to back for every ray. Slabs
+    // on the far side of the eye from a ray's direction never touch it, so their order doesn't matter.
+    float eyeZ = request.invViewMatrix[11];
+    std::vector<size_t> order(sockets.size());
+    for(size_t slab = 0; slab < order.size(); ++slab)
+    {
+        order[slab] = slab;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return std::fabs(eyeZ - slabCentres[a]) < std::fabs(eyeZ - slabCentres[b]);
+    });
+
+    // Partials are premultiplied, so this is the same "over" the kernel does per sample
+    for(size_t pixel = 0; pixel < pixels; ++pixel)
+    {
+        float sum[4] = { 0.f, 0.f, 0.f, 0.f };
+        for(size_t i = 0; i < order.size() && sum[3] < 1.f; ++i)
+        {
+            uint32_t packed = partialImages[order[i] * pixels + pixel];
+            float transmittance = 1.f - sum[3];
+            for(int c = 0; c < 4; ++c)
+            {
+                sum[c] += ((packed >> (8 * c)) & 0xff) / 255.f * transmittance;
+            }
+        }
+
+        // Brightness after compositing, as the single process renderer applies it to the whole ray
+        uint32_t out = 0;
+        for(int c = 0; c < 4; ++c)
+        {
+            float value = std::min(std::max(sum[c] * brightness, 0.f), 1.f);
+            out |= (uint32_t)(value * 255) << (8 * c);
+        }
+        image[pixel] = out;
+    }
+    return true;
+}
+
+void SlabCompositor::Shutdown()
+{
+    SlabRequest quit;
+    std::memset(&quit, 0, sizeof(SlabRequest));
+    quit.quit = 1;
+    for(size_t slab = 0; slab < sockets.size(); ++slab)
+    {
+        SendAll(sockets[slab], &quit, sizeof(SlabRequest));
+        close(sockets[slab]);
+    }
+    for(size_t slab = 0; slab < workers.size(); ++slab)
+    {
+        waitpid(workers[slab], nullptr, 0);
+    }
+    sockets.clear();
+    workers.clear();
+}
+
+bool SlabCompositor::SendVolumeInfo(int socket, const SlabVolumeInfo& info)
+{
+    return SendAll(socket, &info, sizeof(SlabVolumeInfo));
+}
+
+bool SlabCompositor::ReceiveRequest(int socket, SlabRequest* request)
+{
+    return ReceiveAll(socket, request, sizeof(SlabRequest));
+}
+
+bool SlabCompositor::SendReply(int socket, const uint32_t* image, size_t pixels, const uint32_t* histogram, size_t bins)
+{
+    return SendAll(socket, image, pixels * sizeof(uint32_t)) &&
+           SendAll(socket, histogram, bins * sizeof(uint32_t));
+}
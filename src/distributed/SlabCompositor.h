@@ -0,0 +1,69 @@
+#ifndef HEMELB_SLABCOMPOSITOR_H
+#define HEMELB_SLABCOMPOSITOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+#include <vector>
+
+// Everything a worker needs to render its part of one frame
+struct SlabRequest
+{
+    float    invViewMatrix[12];
+    float    density, transferOffset, transferScale, tstep;
+    float    opacityThreshold;
+    uint32_t width, height, binCount;
+    uint32_t preIntegrated, linearFiltering;
+    uint32_t transferFuncIndex;
+    uint32_t quit;
+};
+
+// Sent once by every worker after it has loaded its slab, so the coordinator can
+// build the raw histogram and the volume hash without ever reading the volume
+struct SlabVolumeInfo
+{
+    uint64_t hash;
+    uint64_t valueCounts[256];      // Voxels of each value in the slab, overlap slices excluded
+};
+
+// Slices [z0, z1) of a depth-slice volume belong to slab 'slab' of 'slabCount'
+void SlabRange(size_t depth, int slab, int slabCount, size_t* z0, size_t* z1);
+
+// Sort-last rendering over local processes. The volume is cut into slabs along z,
+// one per worker process; each worker only loads and marches its own slab, and
+// sends back a partial RGBA image and a partial sample histogram. Images are
+// composited front to back in slab order and histograms summed. Every worker
+// talks straight to the coordinator (direct send) over a socketpair.
+class SlabCompositor {
+
+    public:
+        SlabCompositor();
+
+        // Forks slabCount workers - must happen before any CUDA or GL init.
+        // Returns the slab index in a worker, or -1 back in the coordinator.
+        int     Launch(int slabCount);
+        int     WorkerSocket() const { return workerSocket; }
+        int     SlabCount() const { return (int)sockets.size(); }
+
+        // Coordinator side
+        bool    ReceiveVolumeInfo(size_t depth, float halfDepth, std::vector<SlabVolumeInfo>* infos);
+        bool    Render(const SlabRequest& request, float brightness, uint32_t* image, uint32_t* histogram);
+        void    Shutdown();
+
+        // Worker side
+        static bool SendVolumeInfo(int socket, const SlabVolumeInfo& info);
+        static bool ReceiveRequest(int socket, SlabRequest* request);
+        static bool SendReply(int socket, const uint32_t* image, size_t pixels, const uint32_t* histogram, size_t bins);
+
+    private:
+        SlabCompositor(const SlabCompositor&);
+        SlabCompositor& operator=(const SlabCompositor&);
+
+        std::vector<int>        sockets;        // Coordinator end, one per slab
+        std::vector<pid_t>      workers;
+        std::vector<float>      slabCentres;    // World z of each slab's middle
+        std::vector<uint32_t>   partialImages;  // Slab after slab
+        std::vector<uint32_t>   partialHistogram;
+        int                     workerSocket;
+};
+#endif
@@ -54,6 +54,42 @@ float Entropy::SingleEntropy(uint* hist, size_t bin_count)
     return eigHist.cwiseProduct(Log2(eigHist)).sum() * -1;
 }
 
+void Entropy::ImageEntropy(uint* imageHist, float* channelEntropy)
+{
+    for(size_t channel = 0; channel < IMAGE_HISTOGRAM_CHANNELS; ++channel)
+    {
+        channelEntropy[channel] = SingleEntropy(imageHist + channel*IMAGE_HISTOGRAM_BINS, IMAGE_HISTOGRAM_BINS);
+    }
+}
+
+float Entropy::VisibilityEntropy(const float* visibility, size_t binCount)
+{
+    Eigen::Map<const Eigen::VectorXf> mapVisibility(visibility, binCount);
+    Eigen::MatrixXd eigVisibility = mapVisibility.cast<double>().transpose();
+    double total = eigVisibility.sum();
+    if(total <= 0.0)
+    {
+        return 0.f;     // Nothing visible
+    }
+    eigVisibility = eigVisibility / total;
+
+    return eigVisibility.cwiseProduct(Log2(eigVisibility)).sum() * -1;
+}
+
+void Entropy::BinImage(const uint* image, size_t pixels, uint* imageHist)
+{
+    for(size_t i = 0; i < pixels; ++i)
+    {
+        uint rgba = image[i];
+        uint r = rgba & 0xff, g = (rgba >> 8) & 0xff, b = (rgba >> 16) & 0xff, a = rgba >> 24;
+        imageHist[r]++;
+        imageHist[IMAGE_HISTOGRAM_BINS + g]++;
+        imageHist[2*IMAGE_HISTOGRAM_BINS + b]++;
+        imageHist[3*IMAGE_HISTOGRAM_BINS + a]++;
+        imageHist[4*IMAGE_HISTOGRAM_BINS + LuminanceBin(r, g, b)]++;
+    }
+}
+
 void Entropy::GetNonZero(Eigen::MatrixXd* inMat)
 {
     Eigen::Matrix<bool, Eigen::Dynamic, 1> zeros = (inMat->array() == 0).colwise().all();
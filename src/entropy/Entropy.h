@@ -4,6 +4,17 @@
 #include <Eigen/Core>
 #include <unsupported/Eigen/MatrixFunctions>
 
+// Per-frame image and visibility histograms - must match volumeRender_kernel.cu
+const size_t IMAGE_HISTOGRAM_BINS       = 256;
+const size_t IMAGE_HISTOGRAM_CHANNELS   = 5;    // r, g, b, a, luminance - one block of bins each
+const size_t VISIBILITY_BINS            = 256;  // Opacity reaching the eye, by sample value
+
+// Rec. 709 luma from 8 bit r, g, b in integer weights summing to 256
+inline unsigned int LuminanceBin(unsigned int r, unsigned int g, unsigned int b)
+{
+    return (54*r + 183*g + 19*b) >> 8;
+}
+
 class Entropy {
 
     public:
@@ -18,6 +29,15 @@ class Entropy {
         void GetEntropy(uint* histA, uint* histB, size_t binCount, float* entA, float* entB, float* jEnt, float* mI);
         float SingleEntropy(uint* hist, size_t bin_count);
 
+        // Entropy of each IMAGE_HISTOGRAM_CHANNELS block of an image histogram
+        void ImageEntropy(uint* imageHist, float* channelEntropy);
+
+        // View entropy - how evenly the visible opacity is spread over the data values
+        float VisibilityEntropy(const float* visibility, size_t binCount);
+
+        // Host side image histogram, added to imageHist, for frames that never went through the kernel
+        static void BinImage(const uint* image, size_t pixels, uint* imageHist);
+
 
     private:
         static Entropy *instance; 
@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "Estimators.h"
+
+static const char*  kNames[ESTIMATOR_COUNT] = { "plugin", "mm", "jackknife", "kde" };
+static const double kLn2        = 0.69314718055994530942;
+static const size_t kKdeGrid    = 256;      // Fixed, so the KDE's MI doesn't move with the bin count
+
+static double NLogN(double n)
+{
+    return (n > 0.0) ? n*std::log(n) : 0.0;
+}
+
+static double EntropyBits(double total, double sumNLogN)
+{
+    return (total > 0.0) ? (std::log(total) - sumNLogN/total) / kLn2 : 0.0;
+}
+
+const char* EstimatorName(EntropyEstimator estimator)
+{
+    return (estimator < ESTIMATOR_COUNT) ? kNames[estimator] : "?";
+}
+
+bool ParseEstimator(const char* name, EntropyEstimator* estimator)
+{
+    for(int i = 0; i < ESTIMATOR_COUNT; ++i)
+    {
+        if(std::strcmp(name, kNames[i]) == 0)
+        {
+            *estimator = (EntropyEstimator)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+HistogramStream::HistogramStream(size_t binCount)
+{
+    Reset(binCount);
+}
+
+void HistogramStream::Reset(size_t binCount)
+{
+    counts.assign(binCount, 0.0);
+    total = sumNLogN = sumX = sumXX = 0.0;
+    occupied = 0;
+}
+
+void HistogramStream::Add(size_t bin, double count)
+{
+    double before = counts[bin], after = before + count;
+    double x = (bin + 0.5) / counts.size();
+    counts[bin] = after;
+    total += count;
+    sumNLogN += NLogN(after) - NLogN(before);
+    sumX += count*x;
+    sumXX += count*x*x;
+    occupied += (after > 0.0) - (before > 0.0);
+}
+
+void HistogramStream::Set(const unsigned int* newCounts, size_t binCount)
+{
+    if(binCount != counts.size())
+    {
+        Reset(binCount);
+    }
+    for(size_t bin = 0; bin < binCount; ++bin)
+    {
+        if(newCounts[bin] != counts[bin])
+        {
+            Add(bin, (double)newCounts[bin] - counts[bin]);
+        }
+    }
+}
+
+double HistogramStream::Mean() const
+{
+    return (total > 0.0) ? sumX/total : 0.0;
+}
+
+double HistogramStream::Variance() const
+{
+    double mean = Mean();
+    return (total > 0.0) ? std::max(sumXX/total - mean*mean, 0.0) : 0.0;
+}
+
+double HistogramStream::PlugInEntropy() const
+{
+    return EntropyBits(total, sumNLogN);
+}
+
+double HistogramStream::MillerMadowEntropy() const
+{
+    return (total > 0.0) ? PlugInEntropy() + (occupied - 1.0)/(2.0*total*kLn2) : 0.0;
+}
+
+// -sum q log2 q over q = a/Na + b/Nb, optionally with one sample taken out of one bin of a or b
+static double SummedEntropy(const HistogramStream& a, const HistogramStream& b, long removeA = -1, long removeB = -1)
+{
+    double totalA = a.Total() - (removeA >= 0), totalB = b.Total() - (removeB >= 0);
+    double sum = 0.0;
+    for(size_t bin = 0; bin < a.Bins(); ++bin)
+    {
+        double countA = a.Count(bin) - ((long)bin == removeA), countB = b.Count(bin) - ((long)bin == removeB);
+        double q = ((totalA > 0.0) ? countA/totalA : 0.0) + ((totalB > 0.0) ? countB/totalB : 0.0);
+        if(q > 0.0)
+        {
+            sum -= q*std::log(q);
+        }
+    }
+    return sum / kLn2;
+}
+
+// Delta method bias of SummedEntropy, sum of Var(q)/2q ln 2 - for one histogram this is Miller-Madow's (m-1)/2N
+static double SummedEntropyBias(const HistogramStream& a, const HistogramStream& b)
+{
+    double bias = 0.0;
+    for(size_t bin = 0; bin < a.Bins(); ++bin)
+    {
+        double pa = (a.Total() > 0.0) ? a.Count(bin)/a.Total() : 0.0;
+        double pb = (b.Total() > 0.0) ? b.Count(bin)/b.Total() : 0.0;
+        double variance = ((pa > 0.0) ? pa*(1.0 - pa)/a.Total() : 0.0) + ((pb > 0.0) ? pb*(1.0 - pb)/b.Total() : 0.0);
+        if(pa + pb > 0.0)
+        {
+            bias += variance / (2.0*(pa + pb)*kLn2);
+        }
+    }
+    return bias;
+}
+
+// N*H - (N-1)*mean of the leave-one-out H, each leave-one-out an O(1) update of the stream's
+// running sum, so O(bins) in all
+static double JackknifeEntropy(const HistogramStream& h)
+{
+    double n = h.Total();
+    if(n <= 1.0)
+    {
+        return h.PlugInEntropy();
+    }
+
+    double sumNLogN = h.SumNLogN();
+    double meanLeftOut = 0.0;
+    for(size_t bin = 0; bin < h.Bins(); ++bin)
+    {
+        double count = h.Count(bin);
+        if(count > 0.0)
+        {
+            double leftOut = sumNLogN - NLogN(count) + NLogN(count - 1.0);
+            meanLeftOut += count*EntropyBits(n - 1.0, leftOut) / n;
+        }
+    }
+    return n*h.PlugInEntropy() - (n - 1.0)*meanLeftOut;
+}
+
+// As JackknifeEntropy, in O(bins): with one sample left out of h, every q moves to h's new total
+// alike, so each leave-one-out differs from one shared sum only in the bin the sample came from
+static double JackknifeSummedEntropy(const HistogramStream& a, const HistogramStream& b)
+{
+    double full = SummedEntropy(a, b), corrected = full;
+    for(int side = 0; side < 2; ++side)
+    {
+        const HistogramStream& h = side ? b : a;
+        const HistogramStream& other = side ? a : b;
+        if(h.Total() <= 1.0)
+        {
+            continue;
+        }
+
+        double scale = 1.0/(h.Total() - 1.0), otherScale = (other.Total() > 0.0) ? 1.0/other.Total() : 0.0;
+        double shared = 0.0;
+        for(size_t bin = 0; bin < h.Bins(); ++bin)
+        {
+            shared -= NLogN(h.Count(bin)*scale + other.Count(bin)*otherScale);
+        }
+
+        double meanLeftOut = 0.0;
+        for(size_t bin = 0; bin < h.Bins(); ++bin)
+        {
+            double count = h.Count(bin);
+            if(count > 0.0)
+            {
+                double q = other.Count(bin)*otherScale;
+                double leftOut = (shared + NLogN(count*scale + q) - NLogN((count - 1.0)*scale + q)) / kLn2;
+                meanLeftOut += count*leftOut / h.Total();
+            }
+        }
+        corrected += (h.Total() - 1.0)*(full - meanLeftOut);
+    }
+    return corrected;
+}
+
+// Binned Gaussian KDE on the fixed grid, as probability masses. Silverman's bandwidth, but
+// never under half a bin, since the histogram can't say anything about finer detail.
+static std::vector<double> KdeMasses(const HistogramStream& h)
+{
+    std::vector<double> masses(kKdeGrid, 0.0);
+    if(h.Total() <= 0.0)
+    {
+        return masses;
+    }
+
+    double bandwidth = std::max(1.06*std::sqrt(h.Variance())*std::pow(h.Total(), -0.2), 0.5/h.Bins());
+    double sum = 0.0;
+    for(size_t g = 0; g < kKdeGrid; ++g)
+    {
+        double x = (g + 0.5) / kKdeGrid;
+        for(size_t bin = 0; bin < h.Bins(); ++bin)
+        {
+            if(h.Count(bin) > 0.0)
+            {
+                double u = (x - (bin + 0.5)/h.Bins()) / bandwidth;
+                masses[g] += h.Count(bin)*std::exp(-0.5*u*u);
+            }
+        }
+        sum += masses[g];
+    }
+    for(size_t g = 0; sum > 0.0 && g < kKdeGrid; ++g)
+    {
+        masses[g] /= sum;
+    }
+    return masses;
+}
+
+static double MassEntropy(const std::vector<double>& p)
+{
+    double sum = 0.0;
+    for(size_t i = 0; i < p.size(); ++i)
+    {
+        if(p[i] > 0.0)
+        {
+            sum -= p[i]*std::log(p[i]);
+        }
+    }
+    return sum / kLn2;
+}
+
+void EstimateMI(EntropyEstimator estimator, const HistogramStream& a, const HistogramStream& b,
+                float* entA, float* entB, float* jEnt, float* mI)
+{
+    double ha, hb, joint;
+    switch(estimator)
+    {
+        case ESTIMATOR_MILLER_MADOW:
+            ha = a.MillerMadowEntropy();
+            hb = b.MillerMadowEntropy();
+            joint = SummedEntropy(a, b) + SummedEntropyBias(a, b);
+            break;
+        case ESTIMATOR_JACKKNIFE:
+            ha = JackknifeEntropy(a);
+            hb = JackknifeEntropy(b);
+            joint = JackknifeSummedEntropy(a, b);
+            break;
+        case ESTIMATOR_KDE:
+        {
+            std::vector<double> pa = KdeMasses(a), pb = KdeMasses(b), summed(kKdeGrid);
+            for(size_t g = 0; g < kKdeGrid; ++g)
+            {
+                summed[g] = pa[g] + pb[g];
+            }
+            ha = MassEntropy(pa);
+            hb = MassEntropy(pb);
+            joint = MassEntropy(summed);
+            break;
+        }
+        default:
+            ha = a.PlugInEntropy();
+            hb = b.PlugInEntropy();
+            joint = SummedEntropy(a, b);
+            break;
+    }
+
+    *entA = (float)ha;
+    *entB = (float)hb;
+    *jEnt = (float)joint;
+    *mI = (float)(ha + hb - joint);
+}
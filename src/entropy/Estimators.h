@@ -0,0 +1,63 @@
+#ifndef HEMELB_ESTIMATORS_H
+#define HEMELB_ESTIMATORS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// How the entropies behind the MI are estimated from the histograms. The plug-in
+// estimate is biased low by about (occupied bins - 1)/2N nats per histogram, which
+// is what makes the MI drift as BIN_COUNT changes.
+enum EntropyEstimator
+{
+    ESTIMATOR_PLUGIN,           // Straight from the frequencies, as Entropy::GetEntropy
+    ESTIMATOR_MILLER_MADOW,     // Plug-in plus its first order bias, by the delta method for the summed term
+    ESTIMATOR_JACKKNIFE,        // Leave-one-sample-out bias correction, O(bins)
+    ESTIMATOR_KDE,              // Gaussian kernel density over the binned samples, evaluated on a fixed grid
+    ESTIMATOR_COUNT
+};
+
+const char* EstimatorName(EntropyEstimator estimator);
+bool        ParseEstimator(const char* name, EntropyEstimator* estimator);
+
+// Counts of one histogram along with the running sums the estimators need, kept
+// up to date bin by bin. Catching up with a histogram that only grew a little -
+// another batch of rays, another refinement pass - costs the bins that changed,
+// and the single histogram entropies then cost O(1).
+class HistogramStream {
+
+    public:
+        explicit HistogramStream(size_t binCount = 0);
+
+        void    Reset(size_t binCount);
+        void    Add(size_t bin, double count);
+
+        // Become counts, through Add on just the bins that differ - Reset first if the bin count changed
+        void    Set(const unsigned int* counts, size_t binCount);
+
+        size_t  Bins() const                { return counts.size(); }
+        double  Count(size_t bin) const     { return counts[bin]; }
+        double  Total() const               { return total; }
+        size_t  Occupied() const            { return occupied; }
+        double  SumNLogN() const            { return sumNLogN; }    // Of count ln count, over the bins
+
+        // Of the samples' values, each taken as its bin's centre in [0, 1]
+        double  Mean() const;
+        double  Variance() const;
+
+        // Bits
+        double  PlugInEntropy() const;
+        double  MillerMadowEntropy() const;
+
+    private:
+        std::vector<double> counts;
+        double              total, sumNLogN, sumX, sumXX;
+        size_t              occupied;
+};
+
+// MI as Entropy::GetEntropy defines it, H(a) + H(b) - the entropy of a's and b's
+// distributions summed, with every term from the chosen estimator. a and b need
+// the same bin count.
+void EstimateMI(EntropyEstimator estimator, const HistogramStream& a, const HistogramStream& b,
+                float* entA, float* entB, float* jEnt, float* mI);
+#endif
@@ -0,0 +1,75 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "SubsampledMI.h"
+
+SubsampledMI::SubsampledMI(size_t binCount, uint* rawHist, size_t frameBatches, EntropyEstimator estimator)
+    : binCount(binCount), frameBatches(frameBatches), rawHist(rawHist), estimator(estimator), total(binCount, 0)
+{
+    if(estimator != ESTIMATOR_PLUGIN)
+    {
+        rawStream.Set(rawHist, binCount);
+    }
+}
+
+void SubsampledMI::AddCumulative(const uint* histogram)
+{
+    std::vector<uint> batch(binCount);
+    for(size_t bin = 0; bin < binCount; ++bin)
+    {
+        batch[bin] = histogram[bin] - total[bin];
+        total[bin] = histogram[bin];
+    }
+    batches.push_back(batch);
+}
+
+float SubsampledMI::MutualInformation(std::vector<uint>& histogram)
+{
+    float entropyA, entropyB, jointEntropy, mutualInformation = 0.f;
+    if(estimator == ESTIMATOR_PLUGIN)
+    {
+        Entropy::getInstance()->GetEntropy(histogram.data(), rawHist, binCount, &entropyA, &entropyB, &jointEntropy, &mutualInformation);
+    }
+    else
+    {
+        volumeStream.Set(histogram.data(), binCount);
+        EstimateMI(estimator, volumeStream, rawStream, &entropyA, &entropyB, &jointEntropy, &mutualInformation);
+    }
+    return mutualInformation;
+}
+
+void SubsampledMI::Estimate(float z, float* mutualInformation, float* halfWidth)
+{
+    *mutualInformation = MutualInformation(total);
+    size_t n = batches.size();
+    if(n < 2)
+    {
+        *halfWidth = std::numeric_limits<float>::infinity();
+        return;
+    }
+
+    std::vector<double> leftOut(n);
+    std::vector<uint> histogram(binCount);
+    double mean = 0.0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        for(size_t bin = 0; bin < binCount; ++bin)
+        {
+            histogram[bin] = total[bin] - batches[i][bin];
+        }
+        leftOut[i] = MutualInformation(histogram);
+        mean += leftOut[i] / n;
+    }
+
+    double variance = 0.0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        variance += (leftOut[i] - mean)*(leftOut[i] - mean);
+    }
+    variance *= (double)(n - 1) / n;
+
+    // Finite population correction - the rays not marched yet are all that is left to be unsure of
+    variance *= std::max(1.0 - (double)n / frameBatches, 0.0);
+    *halfWidth = (float)(z*std::sqrt(variance));
+}
@@ -0,0 +1,40 @@
+#ifndef HEMELB_SUBSAMPLEDMI_H
+#define HEMELB_SUBSAMPLEDMI_H
+
+#include <cstddef>
+#include <vector>
+
+#include "Entropy.h"
+#include "Estimators.h"
+
+// MI of a view from rays marched a batch at a time, each batch an independent
+// stratified subset of the image. The estimate is the plug-in MI of all the
+// batches' samples together, and its spread is the jackknife over batches -
+// the MI with each batch left out in turn - so it takes no assumptions about
+// the histogram's distribution, and tightens as batches are added. The
+// batches are drawn without replacement from a frame's worth of them, so the
+// interval also closes to nothing as the last ones come in.
+class SubsampledMI {
+
+    public:
+        // frameBatches is how many batches make up the whole frame
+        SubsampledMI(size_t binCount, uint* rawHist, size_t frameBatches, EntropyEstimator estimator = ESTIMATOR_PLUGIN);
+
+        // The volume histogram as it stands after one more batch, all batches so far summed
+        void    AddCumulative(const uint* histogram);
+        size_t  Batches() const { return batches.size(); }
+
+        // Half width of the interval at z standard errors (1.96 for 95%), infinite under two batches
+        void    Estimate(float z, float* mutualInformation, float* halfWidth);
+
+    private:
+        float   MutualInformation(std::vector<uint>& histogram);
+
+        size_t                          binCount, frameBatches;
+        uint*                           rawHist;
+        EntropyEstimator                estimator;
+        HistogramStream                 volumeStream, rawStream;    // Each left-out histogram is one batch from the last
+        std::vector<uint>               total;
+        std::vector<std::vector<uint> > batches;
+};
+#endif
@@ -0,0 +1,383 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "BrickedVolume.h"
+
+static const char   kMagic[4]   = {'B', 'V', 'L', '1'};
+static const size_t kHeaderSize = sizeof(kMagic) + 5 * sizeof(uint32_t);
+static const size_t kEntrySize  = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+
+// Runs body(0..count-1) over a few threads, false if any call failed
+static bool ParallelFor(size_t count, size_t threads, const std::function<bool(size_t)>& body)
+{
+    if(threads == 0)
+    {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    threads = std::min(threads, count);
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool>   ok(true);
+    auto worker = [&]()
+    {
+        for(size_t i = next++; i < count && ok; i = next++)
+        {
+            if(!body(i))
+            {
+                ok = false;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for(size_t t = 1; t < threads; ++t)
+    {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for(size_t t = 0; t < pool.size(); ++t)
+    {
+        pool[t].join();
+    }
+    return ok;
+}
+
+// PackBits: control byte c < 128 is c+1 literals, c > 128 repeats the next byte 257-c times
+static void EncodeRLE(const unsigned char* in, size_t size, std::vector<unsigned char>* out)
+{
+    out->clear();
+    size_t i = 0;
+    while(i < size)
+    {
+        size_t run = 1;
+        while(i + run < size && run < 128 && in[i + run] == in[i])
+        {
+            ++run;
+        }
+        if(run > 1)
+        {
+            out->push_back((unsigned char)(257 - run));
+            out->push_back(in[i]);
+            i += run;
+            continue;
+        }
+
+        size_t start = i;
+        while(i < size && i - start < 128 && !(i + 1 < size && in[i] == in[i + 1]))
+        {
+            ++i;
+        }
+        out->push_back((unsigned char)(i - start - 1));
+        out->insert(out->end(), in + start, in + i);
+    }
+}
+
+static bool DecodeRLE(const unsigned char* in, size_t size, unsigned char* out, size_t outSize)
+{
+    size_t i = 0, o = 0;
+    while(i < size)
+    {
+        unsigned char control = in[i++];
+        if(control < 128)
+        {
+            size_t count = control + 1;
+            if(i + count > size || o + count > outSize)
+            {
+                return false;
+            }
+            std::memcpy(out + o, in + i, count);
+            i += count;
+            o += count;
+        }
+        else if(control > 128)
+        {
+            size_t count = 257 - control;
+            if(i >= size || o + count > outSize)
+            {
+                return false;
+            }
+            std::memset(out + o, in[i++], count);
+            o += count;
+        }
+    }
+    return o == outSize;
+}
+
+static bool ReadFully(int fd, void* data, size_t size, uint64_t offset)
+{
+    char* bytes = (char*)data;
+    while(size > 0)
+    {
+        ssize_t got = pread(fd, bytes, size, (off_t)offset);
+        if(got <= 0)
+        {
+            return false;
+        }
+        bytes += got;
+        size -= got;
+        offset += got;
+    }
+    return true;
+}
+
+bool BrickedVolume::IsBricked(const char* filename)
+{
+    char magic[4];
+    FILE* fp = fopen(filename, "rb");
+    bool bricked = fp && fread(magic, sizeof(magic), 1, fp) == 1 && std::memcmp(magic, kMagic, sizeof(magic)) == 0;
+    if(fp)
+    {
+        fclose(fp);
+    }
+    return bricked;
+}
+
+bool BrickedVolume::Write(  const char* filename, const unsigned char* data,
+                            size_t width, size_t height, size_t depth,
+                            size_t brickSize, size_t threads)
+{
+    size_t bricksX = (width + brickSize - 1) / brickSize;
+    size_t bricksY = (height + brickSize - 1) / brickSize;
+    size_t bricksZ = (depth + brickSize - 1) / brickSize;
+    size_t brickCount = bricksX * bricksY * bricksZ;
+
+    std::vector<std::vector<unsigned char> > payloads(brickCount);
+    std::vector<uint32_t> codecs(brickCount);
+    ParallelFor(brickCount, threads, [&](size_t brick)
+    {
+        size_t x0 = (brick % bricksX) * brickSize;
+        size_t y0 = (brick / bricksX % bricksY) * brickSize;
+        size_t z0 = (brick / (bricksX * bricksY)) * brickSize;
+        size_t nx = std::min(brickSize, width - x0);
+        size_t ny = std::min(brickSize, height - y0);
+        size_t nz = std::min(brickSize, depth - z0);
+
+        std::vector<unsigned char> voxels;
+        voxels.reserve(nx * ny * nz);
+        for(size_t z = z0; z < z0 + nz; ++z)
+        {
+            for(size_t y = y0; y < y0 + ny; ++y)
+            {
+                const unsigned char* row = data + (z * height + y) * width + x0;
+                voxels.insert(voxels.end(), row, row + nx);
+            }
+        }
+
+        std::vector<unsigned char>& best = payloads[brick];
+        if(std::count(voxels.begin(), voxels.end(), voxels[0]) == (long)voxels.size())
+        {
+            best.assign(1, voxels[0]);
+            codecs[brick] = CONSTANT;
+            return true;
+        }
+
+        best = voxels;
+        codecs[brick] = RAW;
+
+        std::vector<unsigned char> encoded;
+        EncodeRLE(voxels.data(), voxels.size(), &encoded);
+        if(encoded.size() < best.size())
+        {
+            best.swap(encoded);
+            codecs[brick] = RLE;
+        }
+
+        // Smooth fields turn into runs once differenced
+        std::vector<unsigned char> deltas(voxels.size());
+        deltas[0] = voxels[0];
+        for(size_t i = 1; i < voxels.size(); ++i)
+        {
+            deltas[i] = (unsigned char)(voxels[i] - voxels[i - 1]);
+        }
+        EncodeRLE(deltas.data(), deltas.size(), &encoded);
+        if(encoded.size() < best.size())
+        {
+            best.swap(encoded);
+            codecs[brick] = DELTA_RLE;
+        }
+        return true;
+    });
+
+    FILE* fp = fopen(filename, "wb");
+    if(!fp)
+    {
+        fprintf(stderr, "BrickedVolume: could not write '%s'\n", filename);
+        return false;
+    }
+
+    uint32_t header[5] = { (uint32_t)width, (uint32_t)height, (uint32_t)depth, (uint32_t)brickSize, (uint32_t)brickCount };
+    bool ok = fwrite(kMagic, sizeof(kMagic), 1, fp) == 1 && fwrite(header, sizeof(header), 1, fp) == 1;
+
+    uint64_t offset = kHeaderSize + brickCount * kEntrySize;
+    for(size_t brick = 0; brick < brickCount && ok; ++brick)
+    {
+        uint32_t sizeAndCodec[2] = { (uint32_t)payloads[brick].size(), codecs[brick] };
+        ok = fwrite(&offset, sizeof(offset), 1, fp) == 1 && fwrite(sizeAndCodec, sizeof(sizeAndCodec), 1, fp) == 1;
+        offset += payloads[brick].size();
+    }
+    for(size_t brick = 0; brick < brickCount && ok; ++brick)
+    {
+        ok = fwrite(payloads[brick].data(), 1, payloads[brick].size(), fp) == payloads[brick].size();
+    }
+    return (fclose(fp) == 0) && ok;
+}
+
+BrickedVolume::BrickedVolume()
+    : fd(-1), width(0), height(0), depth(0), brickSize(0), bricksX(0), bricksY(0), bricksZ(0)
+{
+}
+
+BrickedVolume::~BrickedVolume()
+{
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+bool BrickedVolume::Open(const char* filename)
+{
+    this->filename = filename;
+    fd = open(filename, O_RDONLY);
+    if(fd < 0)
+    {
+        fprintf(stderr, "BrickedVolume: error opening '%s'\n", filename);
+        return false;
+    }
+
+    char magic[4];
+    uint32_t header[5];
+    struct stat info;
+    if(fstat(fd, &info) != 0 ||
+       !ReadFully(fd, magic, sizeof(magic), 0) || std::memcmp(magic, kMagic, sizeof(magic)) != 0 ||
+       !ReadFully(fd, header, sizeof(header), sizeof(magic)) || header[3] == 0)
+    {
+        fprintf(stderr, "BrickedVolume: '%s' is not a bricked volume\n", filename);
+        return false;
+    }
+
+    width = header[0];
+    height = header[1];
+    depth = header[2];
+    brickSize = header[3];
+    bricksX = (width + brickSize - 1) / brickSize;
+    bricksY = (height + brickSize - 1) / brickSize;
+    bricksZ = (depth + brickSize - 1) / brickSize;
+
+    std::vector<unsigned char> entries(header[4] * kEntrySize);
+    if(header[4] != bricksX * bricksY * bricksZ || !ReadFully(fd, entries.data(), entries.size(), kHeaderSize))
+    {
+        fprintf(stderr, "BrickedVolume: '%s' has a bad index\n", filename);
+        return false;
+    }
+
+    index.resize(header[4]);
+    for(size_t brick = 0; brick < index.size(); ++brick)
+    {
+        const unsigned char* entry = &entries[brick * kEntrySize];
+        std::memcpy(&index[brick].offset, entry, sizeof(uint64_t));
+        std::memcpy(&index[brick].size, entry + sizeof(uint64_t), sizeof(uint32_t));
+        std::memcpy(&index[brick].codec, entry + sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t));
+        if(index[brick].offset + index[brick].size > (uint64_t)info.st_size)
+        {
+            fprintf(stderr, "BrickedVolume: '%s' is truncated\n", filename);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BrickedVolume::ReadBrick(size_t brick, std::vector<unsigned char>* payload, std::vector<unsigned char>* voxels) const
+{
+    const IndexEntry& entry = index[brick];
+    payload->resize(entry.size);
+    if(!ReadFully(fd, payload->data(), entry.size, entry.offset))
+    {
+        return false;
+    }
+
+    switch(entry.codec)
+    {
+        case RAW:
+            if(payload->size() != voxels->size())
+            {
+                return false;
+            }
+            std::copy(payload->begin(), payload->end(), voxels->begin());
+            return true;
+        case CONSTANT:
+            if(payload->size() != 1)
+            {
+                return false;
+            }
+            std::fill(voxels->begin(), voxels->end(), (*payload)[0]);
+            return true;
+        case RLE:
+            return DecodeRLE(payload->data(), payload->size(), voxels->data(), voxels->size());
+        case DELTA_RLE:
+            if(!DecodeRLE(payload->data(), payload->size(), voxels->data(), voxels->size()))
+            {
+                return false;
+            }
+            for(size_t i = 1; i < voxels->size(); ++i)
+            {
+                (*voxels)[i] = (unsigned char)((*voxels)[i] + (*voxels)[i - 1]);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool BrickedVolume::Read(size_t z0, size_t z1, unsigned char* out, size_t threads) const
+{
+    if(fd < 0 || z0 >= z1 || z1 > depth)
+    {
+        return false;
+    }
+
+    size_t firstBrickZ = z0 / brickSize;
+    size_t layerBricks = bricksX * bricksY;
+    size_t count = ((z1 - 1) / brickSize - firstBrickZ + 1) * layerBricks;
+
+    bool ok = ParallelFor(count, threads, [&](size_t i)
+    {
+        size_t brick = firstBrickZ * layerBricks + i;
+        size_t bx0 = (brick % bricksX) * brickSize;
+        size_t by0 = (brick / bricksX % bricksY) * brickSize;
+        size_t bz0 = (brick / layerBricks) * brickSize;
+        size_t nx = std::min(brickSize, width - bx0);
+        size_t ny = std::min(brickSize, height - by0);
+        size_t nz = std::min(brickSize, depth - bz0);
+
+        // Decode the brick, then scatter the rows that fall inside [z0, z1)
+        std::vector<unsigned char> payload, voxels(nx * ny * nz);
+        if(!ReadBrick(brick, &payload, &voxels))
+        {
+            return false;
+        }
+
+        for(size_t z = std::max(bz0, z0); z < std::min(bz0 + nz, z1); ++z)
+        {
+            for(size_t y = 0; y < ny; ++y)
+            {
+                std::memcpy(out + ((z - z0) * height + by0 + y) * width + bx0,
+                            &voxels[((z - bz0) * ny + y) * nx], nx);
+            }
+        }
+        return true;
+    });
+
+    if(!ok)
+    {
+        fprintf(stderr, "BrickedVolume: '%s' has a corrupt brick\n", filename.c_str());
+    }
+    return ok;
+}
@@ -0,0 +1,60 @@
+#ifndef HEMELB_BRICKEDVOLUME_H
+#define HEMELB_BRICKEDVOLUME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Compressed 8 bit volume, cut into cubic bricks that are each compressed on
+// their own, with an index up front so any brick can be found without reading
+// the others. Layout:
+//      "BVL1", width, height, depth, brickSize, brickCount      (uint32)
+//      brickCount x { offset (uint64), size (uint32), codec (uint32) }
+//      brick payloads
+// Bricks run x fastest, then y, then z. Each brick uses whichever codec is
+// smallest for it - empty space is usually a single CONSTANT byte.
+class BrickedVolume {
+
+    public:
+        enum Codec { RAW = 0, CONSTANT = 1, RLE = 2, DELTA_RLE = 3 };
+
+        static const uint32_t DEFAULT_BRICK_SIZE = 64;
+
+        static bool IsBricked(const char* filename);
+        static bool Write(  const char* filename, const unsigned char* data,
+                            size_t width, size_t height, size_t depth,
+                            size_t brickSize = DEFAULT_BRICK_SIZE, size_t threads = 0);
+
+        BrickedVolume();
+        ~BrickedVolume();
+
+        bool    Open(const char* filename);
+        size_t  Width() const  { return width; }
+        size_t  Height() const { return height; }
+        size_t  Depth() const  { return depth; }
+
+        // Decodes slices [z0, z1) into out, which holds width*height*(z1-z0) voxels. Only the
+        // bricks those slices touch are read, spread over threads (0 = one per core).
+        bool    Read(size_t z0, size_t z1, unsigned char* out, size_t threads = 0) const;
+
+    private:
+        BrickedVolume(const BrickedVolume&);
+        BrickedVolume& operator=(const BrickedVolume&);
+
+        struct IndexEntry
+        {
+            uint64_t offset;
+            uint32_t size;
+            uint32_t codec;
+        };
+
+        bool    ReadBrick(size_t brick, std::vector<unsigned char>* payload, std::vector<unsigned char>* voxels) const;
+
+        int                     fd;
+        std::string             filename;
+        size_t                  width, height, depth, brickSize;
+        size_t                  bricksX, bricksY, bricksZ;
+        std::vector<IndexEntry> index;
+};
+#endif
@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <cstring>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include "FrameExporter.h"
+
+static bool EndsWith(const std::string& text, const char* suffix)
+{
+    size_t length = std::strlen(suffix);
+    return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+// Top-down RGB, the row order every format here wants
+static void ToRGB(const FrameExporter::Frame& frame, std::vector<unsigned char>* rgb)
+{
+    rgb->resize(frame.width*frame.height*3);
+    for(size_t y = 0; y < frame.height; ++y)
+    {
+        const unsigned char* in = (const unsigned char*)(frame.pixels + (frame.height - 1 - y)*frame.width);
+        unsigned char* out = rgb->data() + y*frame.width*3;
+        for(size_t x = 0; x < frame.width; ++x, in += 4, out += 3)
+        {
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
+        }
+    }
+}
+
+static unsigned char ClampByte(float value)
+{
+    return (unsigned char)std::min(std::max(value + 0.5f, 0.f), 255.f);
+}
+
+bool FrameExporter::ParseFormat(const char* path, FrameFormat* format)
+{
+    std::string name(path);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if(EndsWith(name, ".png"))
+    {
+        *format = FRAME_PNG;
+    }
+    else if(EndsWith(name, ".ppm"))
+    {
+        *format = FRAME_PPM;
+    }
+    else if(EndsWith(name, ".y4m"))
+    {
+        *format = FRAME_Y4M;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+FrameExporter::FrameExporter(const char* path, FrameFormat format, size_t threads, size_t buffers,
+                             Allocator allocate, Deallocator release)
+    : path(path), format(format), allocate(allocate), release(release),
+      nextIndex(0), written(0), failed(0), stalls(0), stopping(false),
+      stream(nullptr), streamWidth(0), streamHeight(0), nextStreamFrame(0)
+{
+    if(threads == 0)
+    {
+        threads = std::max(std::thread::hardware_concurrency()/2, 1u);
+    }
+    bufferCount = (buffers > 0) ? buffers : threads*2;
+
+    if(format == FRAME_Y4M)
+    {
+        stream = fopen(path, "wb");
+    }
+
+    for(size_t t = 0; t < threads; ++t)
+    {
+        workers.push_back(std::thread(&FrameExporter::Work, this));
+    }
+}
+
+FrameExporter::~FrameExporter()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for(size_t t = 0; t < workers.size(); ++t)
+    {
+        workers[t].join();
+    }
+
+    if(stream)
+    {
+        fclose(stream);
+    }
+
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+        if(release)
+        {
+            release(frames[i]->pixels);
+        }
+        else
+        {
+            delete[] frames[i]->pixels;
+        }
+        delete frames[i];
+    }
+}
+
+FrameExporter::Frame* FrameExporter::Acquire(size_t width, size_t height)
+{
+    Frame* frame = nullptr;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if(unused.empty() && frames.size() < bufferCount)
+        {
+            frame = new Frame();
+            frames.push_back(frame);
+        }
+        else
+        {
+            if(unused.empty())
+            {
+                ++stalls;
+                changed.wait(guard, [this]() { return !unused.empty(); });
+            }
+            frame = unused.back();
+            unused.pop_back();
+        }
+    }
+
+    // Buffers only grow, so resizing the window back and forth doesn't keep reallocating them
+    size_t pixels = width*height;
+    if(pixels > frame->capacity)
+    {
+        if(release && frame->pixels)
+        {
+            release(frame->pixels);
+        }
+        else
+        {
+            delete[] frame->pixels;
+        }
+        frame->pixels = allocate ? (uint32_t*)allocate(pixels*sizeof(uint32_t)) : new uint32_t[pixels];
+        frame->capacity = pixels;
+    }
+    frame->width = width;
+    frame->height = height;
+    return frame;
+}
+
+void FrameExporter::Submit(Frame* frame)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        frame->index = nextIndex++;
+        queue.push_back(frame);
+    }
+    changed.notify_all();
+}
+
+void FrameExporter::Discard(Frame* frame)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        unused.push_back(frame);
+    }
+    changed.notify_all();
+}
+
+void FrameExporter::Flush()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this]() { return queue.empty() && unused.size() == frames.size(); });
+}
+
+void FrameExporter::Work()
+{
+    std::vector<unsigned char> scratch;
+    for(;;)
+    {
+        Frame* frame;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [this]() { return stopping || !queue.empty(); });
+            if(queue.empty())
+            {
+                return;     // Stopping, and everything submitted is written
+            }
+            frame = queue.front();
+            queue.pop_front();
+        }
+
+        bool ok = Encode(*frame, &scratch);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ++(ok ? written : failed);
+            unused.push_back(frame);
+        }
+        changed.notify_all();
+    }
+}
+
+bool FrameExporter::Encode(const Frame& frame, std::vector<unsigned char>* scratch)
+{
+    return (format == FRAME_Y4M) ? WriteStreamFrame(frame, scratch) : WriteImage(frame, scratch);
+}
+
+bool FrameExporter::WriteImage(const Frame& frame, std::vector<unsigned char>* scratch) const
+{
+    char filename[1024];
+    snprintf(filename, sizeof(filename), path.c_str(), (int)frame.index);
+    ToRGB(frame, scratch);
+
+    if(format == FRAME_PNG)
+    {
+        return stbi_write_png(filename, (int)frame.width, (int)frame.height, 3, scratch->data(), (int)frame.width*3) != 0;
+    }
+
+    FILE* fp = fopen(filename, "wb");
+    if(!fp)
+    {
+        return false;
+    }
+    bool ok =   fprintf(fp, "P6\n%zu %zu\n255\n", frame.width, frame.height) > 0 &&
+                fwrite(scratch->data(), 1, scratch->size(), fp) == scratch->size();
+    return (fclose(fp) == 0) && ok;
+}
+
+// Converted to Y'CbCr 4:2:0 in parallel, then written in submission order
+bool FrameExporter::WriteStreamFrame(const Frame& frame, std::vector<unsigned char>* scratch)
+{
+    size_t chromaW = (frame.width + 1)/2, chromaH = (frame.height + 1)/2;
+    size_t lumaSize = frame.width*frame.height, chromaSize = chromaW*chromaH;
+    std::vector<unsigned char> rgb;
+    ToRGB(frame, &rgb);
+
+    // BT.601 full range, as C420jpeg says
+    scratch->resize(lumaSize + 2*chromaSize);
+    unsigned char *luma = scratch->data(), *cb = luma + lumaSize, *cr = cb + chromaSize;
+    for(size_t i = 0; i < lumaSize; ++i)
+    {
+        const unsigned char* p = &rgb[i*3];
+        luma[i] = ClampByte(0.299f*p[0] + 0.587f*p[1] + 0.114f*p[2]);
+    }
+    for(size_t cy = 0; cy < chromaH; ++cy)
+    {
+        for(size_t cx = 0; cx < chromaW; ++cx)
+        {
+            float r = 0.f, g = 0.f, b = 0.f, n = 0.f;
+            for(size_t y = cy*2; y < std::min(cy*2 + 2, frame.height); ++y)
+            {
+                for(size_t x = cx*2; x < std::min(cx*2 + 2, frame.width); ++x)
+                {
+                    const unsigned char* p = &rgb[(y*frame.width + x)*3];
+                    r += p[0];
+                    g += p[1];
+                    b += p[2];
+                    n += 1.f;
+                }
+            }
+            r /= n;
+            g /= n;
+            b /= n;
+            cb[cy*chromaW + cx] = ClampByte(128.f - 0.168736f*r - 0.331264f*g + 0.5f*b);
+            cr[cy*chromaW + cx] = ClampByte(128.f + 0.5f*r - 0.418688f*g - 0.081312f*b);
+        }
+    }
+
+    std::unique_lock<std::mutex> guard(streamLock);
+    streamTurn.wait(guard, [&]() { return nextStreamFrame == frame.index; });
+
+    // The stream's size is the first frame's, and a stream can't change it
+    bool ok = stream != nullptr;
+    if(ok && streamWidth == 0)
+    {
+        streamWidth = frame.width;
+        streamHeight = frame.height;
+        ok = fprintf(stream, "YUV4MPEG2 W%zu H%zu F30:1 Ip A1:1 C420jpeg\n", streamWidth, streamHeight) > 0;
+    }
+    ok = ok && frame.width == streamWidth && frame.height == streamHeight &&
+         fputs("FRAME\n", stream) >= 0 &&
+         fwrite(scratch->data(), 1, scratch->size(), stream) == scratch->size();
+
+    ++nextStreamFrame;
+    guard.unlock();
+    streamTurn.notify_all();
+    return ok;
+}
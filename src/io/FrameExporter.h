@@ -0,0 +1,95 @@
+#ifndef HEMELB_FRAMEEXPORTER_H
+#define HEMELB_FRAMEEXPORTER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum FrameFormat
+{
+    FRAME_PNG,          // One file per frame, path is a printf pattern of the frame number
+    FRAME_PPM,          // Likewise, binary P6
+    FRAME_Y4M           // One YUV4MPEG2 stream (4:2:0, full range) - a fifo pipes it to an encoder
+};
+
+// Writes rendered frames out on a pool of background threads. Frames are RGBA,
+// rows bottom-up as GL and the kernel lay them out, and go straight from the
+// buffer they were rendered or read back into to the encoder: Acquire() hands
+// out one of a fixed set of buffers, the caller fills it and Submit()s it, and
+// it comes back to the free list once written. The allocator lets the buffers
+// be pinned, so a device readback can land in them directly. Rendering only
+// waits when every buffer is still queued - the encoders can't keep up.
+class FrameExporter {
+
+    public:
+        typedef void* (*Allocator)(size_t bytes);
+        typedef void  (*Deallocator)(void* memory);
+
+        struct Frame
+        {
+            uint32_t*   pixels;
+            size_t      width, height, capacity;    // capacity in pixels
+            size_t      index;
+        };
+
+        // From path's extension - .png, .ppm or .y4m
+        static bool ParseFormat(const char* path, FrameFormat* format);
+
+        // threads 0 = half the cores, buffers 0 = two per thread
+        FrameExporter(const char* path, FrameFormat format, size_t threads = 0, size_t buffers = 0,
+                      Allocator allocate = nullptr, Deallocator release = nullptr);
+        ~FrameExporter();   // Writes everything submitted before returning
+
+        // False if the Y4M stream couldn't be opened
+        bool    Ok() const { return format != FRAME_Y4M || stream != nullptr; }
+
+        // A free buffer with room for width x height
+        Frame*  Acquire(size_t width, size_t height);
+        void    Submit(Frame* frame);
+        // Back to the free list unwritten, e.g. when the readback into it failed
+        void    Discard(Frame* frame);
+        // Waits until everything submitted is written, so every Acquire()d frame has to be submitted or discarded
+        void    Flush();
+
+        size_t  Written() const { return written; }
+        size_t  Failed() const  { return failed; }
+        size_t  Stalls() const  { return stalls; }      // Acquires that had to wait on the encoders
+
+    private:
+        FrameExporter(const FrameExporter&);
+        FrameExporter& operator=(const FrameExporter&);
+
+        void    Work();
+        bool    Encode(const Frame& frame, std::vector<unsigned char>* scratch);
+        bool    WriteImage(const Frame& frame, std::vector<unsigned char>* scratch) const;
+        bool    WriteStreamFrame(const Frame& frame, std::vector<unsigned char>* scratch);
+
+        std::string                 path;
+        FrameFormat                 format;
+        Allocator                   allocate;
+        Deallocator                 release;
+        size_t                      bufferCount;
+
+        std::vector<Frame*>         frames;     // Every buffer made so far
+        std::vector<Frame*>         unused;
+        std::deque<Frame*>          queue;
+        size_t                      nextIndex, written, failed, stalls;
+        bool                        stopping;
+        std::mutex                  lock;
+        std::condition_variable     changed;
+
+        // Y4M frames have to go out in order, whichever thread converted them
+        FILE*                       stream;
+        size_t                      streamWidth, streamHeight, nextStreamFrame;
+        std::mutex                  streamLock;
+        std::condition_variable     streamTurn;
+
+        std::vector<std::thread>    workers;
+};
+#endif
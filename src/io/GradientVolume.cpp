@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include "GradientVolume.h"
+
+static const char kMagic[4] = {'G', 'R', 'V', '1'};
+
+// Central differences, one sided at the faces, scaled to the box's axes
+static void GradientAt(const unsigned char* voxels, size_t width, size_t height, size_t depth, const float scale[3],
+                       size_t x, size_t y, size_t z, float* gradient)
+{
+    size_t slice = width*height;
+    size_t at[3] = { x, y, z }, size[3] = { width, height, depth }, stride[3] = { 1, width, slice };
+    const unsigned char* centre = voxels + z*slice + y*width + x;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        size_t lo = (at[axis] > 0) ? 1 : 0, hi = (at[axis] + 1 < size[axis]) ? 1 : 0;
+        float span = (float)(lo + hi);
+        float difference = (float)centre[hi*stride[axis]] - (float)*(centre - lo*stride[axis]);
+        gradient[axis] = (span > 0.f) ? difference / span * scale[axis] : 0.f;
+    }
+}
+
+// Runs body(z) for every slice, interleaved over threads so the work stays even when the volume isn't
+template<typename Body>
+static void ForEachSlice(size_t depth, size_t threads, const Body& body)
+{
+    if(threads == 0)
+    {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    threads = std::max((size_t)1, std::min(threads, depth));
+
+    std::vector<std::thread> pool;
+    for(size_t t = 1; t < threads; ++t)
+    {
+        pool.push_back(std::thread([&, t]()
+        {
+            for(size_t z = t; z < depth; z += threads)
+            {
+                body(t, z);
+            }
+        }));
+    }
+    for(size_t z = 0; z < depth; z += threads)
+    {
+        body(0, z);
+    }
+    for(size_t t = 0; t < pool.size(); ++t)
+    {
+        pool[t].join();
+    }
+}
+
+void BuildGradientVolume(const unsigned char* voxels, size_t width, size_t height, size_t depth,
+                         const float scale[3], std::vector<int8_t>* gradients, size_t threads)
+{
+    gradients->assign(width*height*depth*4, 0);
+    if(gradients->empty())
+    {
+        return;
+    }
+
+    // Two passes rather than keeping 12 bytes a voxel of floats about: the largest
+    // magnitude first, as the scale for the second
+    size_t threadCount = (threads == 0) ? std::max(std::thread::hardware_concurrency(), 1u) : threads;
+    std::vector<float> largest(threadCount, 0.f);
+    ForEachSlice(depth, threadCount, [&](size_t t, size_t z)
+    {
+        float g[3];
+        for(size_t y = 0; y < height; ++y)
+        {
+            for(size_t x = 0; x < width; ++x)
+            {
+                GradientAt(voxels, width, height, depth, scale, x, y, z, g);
+                largest[t] = std::max(largest[t], g[0]*g[0] + g[1]*g[1] + g[2]*g[2]);
+            }
+        }
+    });
+    float maxMagnitude = std::sqrt(*std::max_element(largest.begin(), largest.end()));
+    if(maxMagnitude <= 0.f)
+    {
+        return;
+    }
+
+    // Normals point down the gradient, out of the denser material
+    int8_t* out = gradients->data();
+    ForEachSlice(depth, threadCount, [&](size_t, size_t z)
+    {
+        float g[3];
+        for(size_t y = 0; y < height; ++y)
+        {
+            for(size_t x = 0; x < width; ++x)
+            {
+                GradientAt(voxels, width, height, depth, scale, x, y, z, g);
+                float magnitude = std::sqrt(g[0]*g[0] + g[1]*g[1] + g[2]*g[2]);
+                int8_t* voxel = out + ((z*height + y)*width + x)*4;
+                if(magnitude > 0.f)
+                {
+                    for(int axis = 0; axis < 3; ++axis)
+                    {
+                        voxel[axis] = (int8_t)std::lround(-g[axis] / magnitude * 127.f);
+                    }
+                    voxel[3] = (int8_t)std::lround(magnitude / maxMagnitude * 127.f);
+                }
+            }
+        }
+    });
+}
+
+bool ReadGradientVolume(const char* filename, uint64_t volumeHash, size_t width, size_t height, size_t depth,
+                        const float scale[3], std::vector<int8_t>* gradients)
+{
+    FILE* fp = fopen(filename, "rb");
+    if(!fp)
+    {
+        return false;
+    }
+
+    char magic[4];
+    uint64_t hash = 0;
+    uint32_t size[3];
+    float storedScale[3];
+    bool ok =   fread(magic, sizeof(magic), 1, fp) == 1 && std::memcmp(magic, kMagic, sizeof(magic)) == 0 &&
+                fread(&hash, sizeof(hash), 1, fp) == 1 && hash == volumeHash &&
+                fread(size, sizeof(size), 1, fp) == 1 &&
+                size[0] == width && size[1] == height && size[2] == depth &&
+                fread(storedScale, sizeof(storedScale), 1, fp) == 1 &&
+                std::memcmp(storedScale, scale, sizeof(storedScale)) == 0;
+
+    if(ok)
+    {
+        gradients->resize(width*height*depth*4);
+        ok = fread(gradients->data(), 1, gradients->size(), fp) == gradients->size();
+    }
+
+    fclose(fp);
+    return ok;
+}
+
+bool WriteGradientVolume(const char* filename, uint64_t volumeHash, size_t width, size_t height, size_t depth,
+                         const float scale[3], const std::vector<int8_t>& gradients)
+{
+    std::string temp = std::string(filename) + ".tmp." + std::to_string(getpid());
+    FILE* fp = fopen(temp.c_str(), "wb");
+    if(!fp)
+    {
+        return false;
+    }
+
+    uint32_t size[3] = { (uint32_t)width, (uint32_t)height, (uint32_t)depth };
+    bool ok =   fwrite(kMagic, sizeof(kMagic), 1, fp) == 1 &&
+                fwrite(&volumeHash, sizeof(volumeHash), 1, fp) == 1 &&
+                fwrite(size, sizeof(size), 1, fp) == 1 &&
+                fwrite(scale, sizeof(float), 3, fp) == 3 &&
+                fwrite(gradients.data(), 1, gradients.size(), fp) == gradients.size();
+    ok = (fclose(fp) == 0) && ok;
+
+    // As MICache: a reader, or a run that dies part way, never sees half a file under the real name
+    if(!ok || rename(temp.c_str(), filename) != 0)
+    {
+        std::remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
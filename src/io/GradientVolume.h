@@ -0,0 +1,35 @@
+#ifndef HEMELB_GRADIENTVOLUME_H
+#define HEMELB_GRADIENTVOLUME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Blinn-Phong with a headlight, shared by the CUDA and CPU renderers. Light and
+// eye are the same direction, so the half vector is the light vector. Shading is
+// faded in with the gradient magnitude - full from magnitudeGain^-1 of the
+// volume's largest gradient up - so homogeneous regions with noise for normals
+// keep their unshaded colour.
+struct ShadingParams
+{
+    float ambient, diffuse, specular, shininess, magnitudeGain;
+};
+
+const ShadingParams DEFAULT_SHADING = { 0.3f, 0.7f, 0.4f, 24.f, 8.f };
+
+// Per-voxel gradients from central differences, precomputed once instead of six
+// extra volume reads per sample. Each voxel is 4 signed bytes: the unit normal's
+// x, y, z and the gradient magnitude relative to the volume's largest, so as a
+// char4 texture with normalised reads it filters like the volume does. scale
+// multiplies each axis' voxel difference, making the normals world space for a
+// volume box that isn't a cube. Split over threads (0 = one per core).
+void BuildGradientVolume(const unsigned char* voxels, size_t width, size_t height, size_t depth,
+                         const float scale[3], std::vector<int8_t>* gradients, size_t threads = 0);
+
+// Disk copies, keyed on the volume's content hash and the scale - a read of
+// anything else fails, and the caller just builds and writes it again
+bool ReadGradientVolume(const char* filename, uint64_t volumeHash, size_t width, size_t height, size_t depth,
+                        const float scale[3], std::vector<int8_t>* gradients);
+bool WriteGradientVolume(const char* filename, uint64_t volumeHash, size_t width, size_t height, size_t depth,
+                         const float scale[3], const std::vector<int8_t>& gradients);
+#endif
@@ -0,0 +1,460 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "VolumeHeader.h"
+
+typedef std::map<std::string, std::string> Fields;
+
+static std::string Lower(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+    return text;
+}
+
+static std::string Trim(const std::string& text)
+{
+    size_t first = text.find_first_not_of(" \t\r\n");
+    size_t last = text.find_last_not_of(" \t\r\n");
+    return (first == std::string::npos) ? "" : text.substr(first, last - first + 1);
+}
+
+static bool EndsWith(const std::string& text, const std::string& suffix)
+{
+    return text.size() >= suffix.size() && Lower(text.substr(text.size() - suffix.size())) == suffix;
+}
+
+// Detached data files are relative to the header, not to wherever we were run from
+static std::string RelativeTo(const std::string& header, const std::string& file)
+{
+    size_t slash = header.rfind('/');
+    if(file.empty() || file[0] == '/' || slash == std::string::npos)
+    {
+        return file;
+    }
+    return header.substr(0, slash + 1) + file;
+}
+
+static bool Unsupported(const char* filename, const std::string& what)
+{
+    fprintf(stderr, "VolumeHeader: '%s': %s is not supported\n", filename, what.c_str());
+    return false;
+}
+
+static bool ParseSizes(const std::string& text, VolumeHeader* header)
+{
+    std::istringstream in(text);
+    long long w = 0, h = 0, d = 0;
+    in >> w >> h >> d;
+    header->width = (size_t)std::max(w, 0ll);
+    header->height = (size_t)std::max(h, 0ll);
+    header->depth = (size_t)std::max(d, 0ll);
+    return !in.fail() && w > 0 && h > 0 && d > 0;
+}
+
+static void ParseSpacing(const std::string& text, VolumeHeader* header)
+{
+    std::istringstream in(text);
+    float spacing[3];
+    if(in >> spacing[0] >> spacing[1] >> spacing[2])
+    {
+        for(int i = 0; i < 3; ++i)
+        {
+            header->spacing[i] = (std::isfinite(spacing[i]) && spacing[i] > 0.f) ? spacing[i] : 1.f;
+        }
+    }
+}
+
+// NRRD space directions, "(a,b,c) (d,e,f) (g,h,i)" - the spacing along each axis is a vector's length
+static void ParseSpaceDirections(const std::string& text, VolumeHeader* header)
+{
+    std::string numbers = text;
+    std::replace(numbers.begin(), numbers.end(), '(', ' ');
+    std::replace(numbers.begin(), numbers.end(), ')', ' ');
+    std::replace(numbers.begin(), numbers.end(), ',', ' ');
+
+    std::istringstream in(numbers);
+    float v[9];
+    for(int i = 0; i < 9; ++i)
+    {
+        if(!(in >> v[i]))
+        {
+            return;
+        }
+    }
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        float length = std::sqrt(v[axis*3]*v[axis*3] + v[axis*3 + 1]*v[axis*3 + 1] + v[axis*3 + 2]*v[axis*3 + 2]);
+        header->spacing[axis] = (length > 0.f) ? length : 1.f;
+    }
+}
+
+static bool NrrdType(const std::string& name, VolumeHeader::VoxelType* type)
+{
+    static const struct { const char* name; VolumeHeader::VoxelType type; } types[] =
+    {
+        { "uchar", VolumeHeader::UINT8 },   { "unsigned char", VolumeHeader::UINT8 },   { "uint8", VolumeHeader::UINT8 },   { "uint8_t", VolumeHeader::UINT8 },
+        { "signed char", VolumeHeader::INT8 }, { "int8", VolumeHeader::INT8 },          { "int8_t", VolumeHeader::INT8 },
+        { "ushort", VolumeHeader::UINT16 }, { "unsigned short", VolumeHeader::UINT16 }, { "unsigned short int", VolumeHeader::UINT16 },
+        { "uint16", VolumeHeader::UINT16 }, { "uint16_t", VolumeHeader::UINT16 },
+        { "short", VolumeHeader::INT16 },   { "short int", VolumeHeader::INT16 },       { "signed short", VolumeHeader::INT16 },
+        { "signed short int", VolumeHeader::INT16 }, { "int16", VolumeHeader::INT16 },  { "int16_t", VolumeHeader::INT16 },
+        { "uint", VolumeHeader::UINT32 },   { "unsigned int", VolumeHeader::UINT32 },   { "uint32", VolumeHeader::UINT32 },  { "uint32_t", VolumeHeader::UINT32 },
+        { "int", VolumeHeader::INT32 },     { "signed int", VolumeHeader::INT32 },      { "int32", VolumeHeader::INT32 },    { "int32_t", VolumeHeader::INT32 },
+        { "float", VolumeHeader::FLOAT32 }, { "double", VolumeHeader::FLOAT64 },
+    };
+    for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i)
+    {
+        if(name == types[i].name)
+        {
+            *type = types[i].type;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool MetaType(const std::string& name, VolumeHeader::VoxelType* type)
+{
+    static const struct { const char* name; VolumeHeader::VoxelType type; } types[] =
+    {
+        { "met_uchar", VolumeHeader::UINT8 },   { "met_char", VolumeHeader::INT8 },
+        { "met_ushort", VolumeHeader::UINT16 }, { "met_short", VolumeHeader::INT16 },
+        { "met_uint", VolumeHeader::UINT32 },   { "met_int", VolumeHeader::INT32 },
+        { "met_float", VolumeHeader::FLOAT32 }, { "met_double", VolumeHeader::FLOAT64 },
+    };
+    for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i)
+    {
+        if(name == types[i].name)
+        {
+            *type = types[i].type;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ReadNrrd(std::ifstream& in, const char* filename, VolumeHeader* header)
+{
+    // "key: value" lines up to a blank line, after which any attached data starts
+    Fields fields;
+    std::string line;
+    long long dataStart = -1;
+    while(std::getline(in, line))
+    {
+        line = Trim(line);
+        if(line.empty())
+        {
+            dataStart = (long long)in.tellg();
+            break;
+        }
+
+        size_t colon = line.find(": ");
+        if(line[0] != '#' && colon != std::string::npos && line.find(":=") == std::string::npos)
+        {
+            fields[Lower(Trim(line.substr(0, colon)))] = Trim(line.substr(colon + 2));
+        }
+    }
+
+    if(fields["dimension"] != "3")
+    {
+        return Unsupported(filename, "dimension '" + fields["dimension"] + "'");
+    }
+    if(!NrrdType(Lower(fields["type"]), &header->type))
+    {
+        return Unsupported(filename, "type '" + fields["type"] + "'");
+    }
+    if(!ParseSizes(fields["sizes"], header))
+    {
+        return Unsupported(filename, "sizes '" + fields["sizes"] + "'");
+    }
+    std::string encoding = Lower(fields["encoding"]);
+    if(encoding != "raw")
+    {
+        return Unsupported(filename, "encoding '" + encoding + "'");
+    }
+    if(!fields["line skip"].empty() && fields["line skip"] != "0")
+    {
+        return Unsupported(filename, "line skip");
+    }
+
+    header->bigEndian = Lower(fields["endian"]) == "big";
+    if(!fields["spacings"].empty())
+    {
+        ParseSpacing(fields["spacings"], header);
+    }
+    else if(!fields["space directions"].empty())
+    {
+        ParseSpaceDirections(fields["space directions"], header);
+    }
+
+    long long byteSkip = fields["byte skip"].empty() ? 0 : atoll(fields["byte skip"].c_str());
+    std::string dataFile = !fields["data file"].empty() ? fields["data file"] : fields["datafile"];
+    if(dataFile.empty())
+    {
+        if(dataStart < 0)
+        {
+            return Unsupported(filename, "a header with no data");
+        }
+        header->dataFile = filename;
+        header->byteOffset = (byteSkip < 0) ? -1 : dataStart + byteSkip;
+    }
+    else
+    {
+        if(dataFile.compare(0, 4, "LIST") == 0 || dataFile.find('%') != std::string::npos)
+        {
+            return Unsupported(filename, "a multi-file data file");
+        }
+        header->dataFile = RelativeTo(filename, dataFile);
+        header->byteOffset = (byteSkip < 0) ? -1 : byteSkip;
+    }
+    return true;
+}
+
+static bool ReadMeta(std::ifstream& in, const char* filename, VolumeHeader* header)
+{
+    // "Key = Value" lines, ElementDataFile always being the last one
+    Fields fields;
+    std::string line;
+    long long dataStart = -1;
+    while(std::getline(in, line))
+    {
+        size_t equals = line.find('=');
+        if(equals == std::string::npos)
+        {
+            continue;
+        }
+        std::string key = Lower(Trim(line.substr(0, equals)));
+        fields[key] = Trim(line.substr(equals + 1));
+        if(key == "elementdatafile")
+        {
+            dataStart = (long long)in.tellg();
+            break;
+        }
+    }
+
+    if(fields["ndims"] != "3")
+    {
+        return Unsupported(filename, "NDims '" + fields["ndims"] + "'");
+    }
+    if(!MetaType(Lower(fields["elementtype"]), &header->type))
+    {
+        return Unsupported(filename, "ElementType '" + fields["elementtype"] + "'");
+    }
+    if(!ParseSizes(fields["dimsize"], header))
+    {
+        return Unsupported(filename, "DimSize '" + fields["dimsize"] + "'");
+    }
+    if(Lower(fields["compresseddata"]) == "true")
+    {
+        return Unsupported(filename, "CompressedData");
+    }
+    if(!fields["elementnumberofchannels"].empty() && fields["elementnumberofchannels"] != "1")
+    {
+        return Unsupported(filename, "more than one channel");
+    }
+
+    header->bigEndian = Lower(fields["binarydatabyteordermsb"]) == "true" || Lower(fields["elementbyteordermsb"]) == "true";
+    ParseSpacing(!fields["elementspacing"].empty() ? fields["elementspacing"] : fields["elementsize"], header);
+
+    long long headerSize = fields["headersize"].empty() ? 0 : atoll(fields["headersize"].c_str());
+    std::string dataFile = fields["elementdatafile"];
+    if(Lower(dataFile) == "local")
+    {
+        if(dataStart < 0)
+        {
+            return Unsupported(filename, "a header with no data");
+        }
+        header->dataFile = filename;
+        header->byteOffset = (headerSize < 0) ? -1 : dataStart + headerSize;
+    }
+    else
+    {
+        if(dataFile.empty() || Lower(dataFile).compare(0, 4, "list") == 0 || dataFile.find('%') != std::string::npos)
+        {
+            return Unsupported(filename, "ElementDataFile '" + dataFile + "'");
+        }
+        header->dataFile = RelativeTo(filename, dataFile);
+        header->byteOffset = (headerSize < 0) ? -1 : headerSize;
+    }
+    return true;
+}
+
+size_t VolumeHeader::VoxelBytes() const
+{
+    switch(type)
+    {
+        case UINT8: case INT8:      return 1;
+        case UINT16: case INT16:    return 2;
+        case UINT32: case INT32:    return 4;
+        case FLOAT32:               return 4;
+        case FLOAT64:               return 8;
+    }
+    return 1;
+}
+
+bool VolumeHeader::IsHeader(const char* filename)
+{
+    char magic[4];
+    FILE* fp = fopen(filename, "rb");
+    bool nrrd = fp && fread(magic, sizeof(magic), 1, fp) == 1 && std::memcmp(magic, "NRRD", sizeof(magic)) == 0;
+    if(fp)
+    {
+        fclose(fp);
+    }
+    return nrrd || EndsWith(filename, ".mhd") || EndsWith(filename, ".mha");
+}
+
+bool VolumeHeader::Read(const char* filename, VolumeHeader* header)
+{
+    std::ifstream in(filename, std::ios::binary);
+    std::string first;
+    if(!in || !std::getline(in, first))
+    {
+        fprintf(stderr, "VolumeHeader: error opening '%s'\n", filename);
+        return false;
+    }
+
+    header->spacing[0] = header->spacing[1] = header->spacing[2] = 1.f;
+    header->bigEndian = false;
+    if(first.compare(0, 4, "NRRD") == 0)
+    {
+        return ReadNrrd(in, filename, header);
+    }
+
+    in.seekg(0);
+    return ReadMeta(in, filename, header);
+}
+
+template<typename T>
+static double VoxelValue(const unsigned char* bytes, bool swap)
+{
+    unsigned char ordered[sizeof(T)];
+    for(size_t b = 0; b < sizeof(T); ++b)
+    {
+        ordered[b] = swap ? bytes[sizeof(T) - 1 - b] : bytes[b];
+    }
+    T value;
+    std::memcpy(&value, ordered, sizeof(T));
+    return (double)value;
+}
+
+// Range over all of [data, data + count), then rescale [first, first + convertCount) to 0-255
+template<typename T>
+static void Rescale(const unsigned char* data, size_t count, bool swap,
+                    size_t first, size_t convertCount, unsigned char* out)
+{
+    double lowest = std::numeric_limits<double>::max(), highest = -lowest;
+    for(size_t i = 0; i < count; ++i)
+    {
+        double value = VoxelValue<T>(data + i * sizeof(T), swap);
+        if(std::isfinite(value))
+        {
+            lowest = std::min(lowest, value);
+            highest = std::max(highest, value);
+        }
+    }
+
+    double scale = (highest > lowest) ? 255.0 / (highest - lowest) : 0.0;
+    for(size_t i = 0; i < convertCount; ++i)
+    {
+        double value = VoxelValue<T>(data + (first + i) * sizeof(T), swap);
+        out[i] = std::isfinite(value) ? (unsigned char)std::lround(std::min(std::max((value - lowest) * scale, 0.0), 255.0)) : 0;
+    }
+}
+
+MappedVolume::MappedVolume()
+    : mapping(nullptr), mappingSize(0), voxels(nullptr)
+{
+}
+
+MappedVolume::~MappedVolume()
+{
+    if(mapping)
+    {
+        munmap(mapping, mappingSize);
+    }
+}
+
+bool MappedVolume::Open(const VolumeHeader& header, size_t z0, size_t z1)
+{
+    int fd = open(header.dataFile.c_str(), O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0)
+    {
+        fprintf(stderr, "MappedVolume: error opening '%s'\n", header.dataFile.c_str());
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    size_t sliceVoxels = header.width * header.height;
+    size_t voxelCount = sliceVoxels * header.depth;
+    size_t payload = voxelCount * header.VoxelBytes();
+    long long offset = (header.byteOffset < 0) ? (long long)info.st_size - (long long)payload : header.byteOffset;
+    if(offset < 0 || offset + (long long)payload > (long long)info.st_size || z0 >= z1 || z1 > header.depth)
+    {
+        fprintf(stderr, "MappedVolume: '%s' is too small for a %zux%zux%zu volume at offset %lld\n",
+                header.dataFile.c_str(), header.width, header.height, header.depth, offset);
+        close(fd);
+        return false;
+    }
+
+    // mmap wants a page aligned offset
+    long long page = sysconf(_SC_PAGESIZE);
+    long long aligned = offset / page * page;
+    mappingSize = (size_t)(offset - aligned) + payload;
+    mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, (off_t)aligned);
+    close(fd);
+    if(mapping == MAP_FAILED)
+    {
+        mapping = nullptr;
+        perror("MappedVolume: mmap");
+        return false;
+    }
+
+    const unsigned char* data = (const unsigned char*)mapping + (offset - aligned);
+    if(header.type == VolumeHeader::UINT8)
+    {
+        voxels = data + z0 * sliceVoxels;
+        return true;
+    }
+
+    // Wider types are read once front to back for the range, then the slices we want again
+    madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+    const uint16_t endianTest = 1;
+    bool swap = header.bigEndian == (*(const unsigned char*)&endianTest == 1);
+    size_t first = z0 * sliceVoxels, count = (z1 - z0) * sliceVoxels;
+    converted.resize(count);
+    switch(header.type)
+    {
+        case VolumeHeader::INT8:    Rescale<int8_t>(data, voxelCount, swap, first, count, converted.data()); break;
+        case VolumeHeader::UINT16:  Rescale<uint16_t>(data, voxelCount, swap, first, count, converted.data()); break;
+        case VolumeHeader::INT16:   Rescale<int16_t>(data, voxelCount, swap, first, count, converted.data()); break;
+        case VolumeHeader::UINT32:  Rescale<uint32_t>(data, voxelCount, swap, first, count, converted.data()); break;
+        case VolumeHeader::INT32:   Rescale<int32_t>(data, voxelCount, swap, first, count, converted.data()); break;
+        case VolumeHeader::FLOAT32: Rescale<float>(data, voxelCount, swap, first, count, converted.data()); break;
+        case VolumeHeader::FLOAT64: Rescale<double>(data, voxelCount, swap, first, count, converted.data()); break;
+        default: break;
+    }
+    voxels = converted.data();
+
+    // Nothing left to read from the file
+    munmap(mapping, mappingSize);
+    mapping = nullptr;
+    return true;
+}
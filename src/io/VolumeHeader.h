@@ -0,0 +1,50 @@
+#ifndef HEMELB_VOLUMEHEADER_H
+#define HEMELB_VOLUMEHEADER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// What a NRRD (.nrrd/.nhdr) or MetaImage (.mha/.mhd) header says about a
+// raw-encoded 3D scalar volume, with the payload either attached or detached.
+struct VolumeHeader
+{
+    enum VoxelType { UINT8, INT8, UINT16, INT16, UINT32, INT32, FLOAT32, FLOAT64 };
+
+    size_t      width, height, depth;
+    VoxelType   type;
+    bool        bigEndian;
+    float       spacing[3];
+    std::string dataFile;       // Absolute, or relative to the working directory
+    long long   byteOffset;     // Into dataFile, -1 for "the payload is the end of the file"
+
+    size_t      VoxelBytes() const;
+
+    // NRRD by its magic, MetaImage by its extension
+    static bool IsHeader(const char* filename);
+    static bool Read(const char* filename, VolumeHeader* header);
+};
+
+// A header's payload mapped into memory and made into the renderer's 8 bit voxels.
+// 8 bit data is used in place straight from the mapping, wider types are rescaled
+// from the range of the whole volume so every slice of it maps the same way.
+class MappedVolume {
+
+    public:
+        MappedVolume();
+        ~MappedVolume();
+
+        // Slices [z0, z1) only, though the range for wider types still covers every slice
+        bool                    Open(const VolumeHeader& header, size_t z0, size_t z1);
+        const unsigned char*    Voxels() const { return voxels; }
+
+    private:
+        MappedVolume(const MappedVolume&);
+        MappedVolume& operator=(const MappedVolume&);
+
+        void*                       mapping;
+        size_t                      mappingSize;
+        const unsigned char*        voxels;
+        std::vector<unsigned char>  converted;
+};
+#endif
@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+
+#include "BrickedVolume.h"
+#include "MICache.h"
+#include "VolumeSeries.h"
+#include "VoxelCounts.h"
+
+bool VolumeSeries::ListFiles(const char* spec, std::vector<std::string>* files)
+{
+    files->clear();
+    if(std::strchr(spec, '%'))
+    {
+        struct stat info;
+        char name[4096];
+        for(int step = 0; ; ++step)
+        {
+            snprintf(name, sizeof(name), spec, step);
+            if(stat(name, &info) != 0)
+            {
+                break;
+            }
+            files->push_back(name);
+        }
+    }
+    else
+    {
+        std::ifstream list(spec);
+        std::string line;
+        while(std::getline(list, line))
+        {
+            if(!line.empty() && line[0] != '#')
+            {
+                files->push_back(line);
+            }
+        }
+    }
+
+    if(files->empty())
+    {
+        fprintf(stderr, "VolumeSeries: no volumes found for '%s'\n", spec);
+        return false;
+    }
+    return true;
+}
+
+VolumeSeries::VolumeSeries(const std::vector<std::string>& files, size_t volumeBytes, size_t ringSize)
+    : files(files), volumeBytes(volumeBytes), slots(std::max(ringSize, (size_t)2)),
+      current(0), held(-1), stalls(0), stopping(false)
+{
+    for(size_t i = 0; i < slots.size(); ++i)
+    {
+        slots[i].state = EMPTY;
+    }
+    worker = std::thread(&VolumeSeries::Prefetch, this);
+}
+
+VolumeSeries::~VolumeSeries()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+const SeriesVolume* VolumeSeries::Acquire(size_t step)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    current = step % files.size();
+    changed.notify_all();
+
+    int slot = FindStep(current);
+    if(slot < 0 || slots[slot].state == LOADING)
+    {
+        ++stalls;
+        changed.wait(guard, [&] { slot = FindStep(current); return slot >= 0 && slots[slot].state != LOADING; });
+    }
+
+    if(slots[slot].state == FAILED)
+    {
+        // Let it be retried next time round
+        slots[slot].state = EMPTY;
+        changed.notify_all();
+        return nullptr;
+    }
+
+    held = slot;
+    return &slots[slot].volume;
+}
+
+void VolumeSeries::Release()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        held = -1;
+    }
+    changed.notify_all();
+}
+
+int VolumeSeries::FindStep(size_t step) const
+{
+    for(size_t i = 0; i < slots.size(); ++i)
+    {
+        if(slots[i].state != EMPTY && slots[i].volume.step == step)
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// The first step of the window [current, current + ring) that isn't loaded yet, and a slot it
+// can go in - empty, or holding a step that has dropped out of the window and isn't held
+bool VolumeSeries::FindWork(size_t* slot, size_t* step) const
+{
+    size_t window = std::min(slots.size(), files.size());
+    for(size_t ahead = 0; ahead < window; ++ahead)
+    {
+        size_t wanted = (current + ahead) % files.size();
+        if(FindStep(wanted) >= 0)
+        {
+            continue;
+        }
+
+        for(size_t i = 0; i < slots.size(); ++i)
+        {
+            if((int)i == held || slots[i].state == LOADING)
+            {
+                continue;
+            }
+
+            size_t distance = (slots[i].volume.step + files.size() - current) % files.size();
+            if(slots[i].state == EMPTY || distance >= window)
+            {
+                *slot = i;
+                *step = wanted;
+                return true;
+            }
+        }
+        return false;
+    }
+    return false;
+}
+
+void VolumeSeries::Prefetch()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while(true)
+    {
+        size_t slot, step;
+        changed.wait(guard, [&] { return stopping || FindWork(&slot, &step); });
+        if(stopping)
+        {
+            return;
+        }
+
+        // Nobody reads a LOADING slot, so the disk work can happen outside the lock
+        slots[slot].state = LOADING;
+        slots[slot].volume.step = step;
+        guard.unlock();
+        bool ok = Load(&slots[slot].volume);
+        guard.lock();
+
+        slots[slot].state = ok ? READY : FAILED;
+        changed.notify_all();
+    }
+}
+
+bool VolumeSeries::Load(SeriesVolume* volume) const
+{
+    const std::string& file = files[volume->step];
+    volume->data.resize(volumeBytes);
+
+    BrickedVolume bricked;
+    if(BrickedVolume::IsBricked(file.c_str()))
+    {
+        if(!bricked.Open(file.c_str()) || bricked.Width() * bricked.Height() * bricked.Depth() != volumeBytes ||
+           !bricked.Read(0, bricked.Depth(), volume->data.data()))
+        {
+            fprintf(stderr, "VolumeSeries: could not decode '%s' as a %zu byte volume\n", file.c_str(), volumeBytes);
+            return false;
+        }
+        return Count(volume);
+    }
+
+    FILE* fp = fopen(file.c_str(), "rb");
+    if(!fp)
+    {
+        fprintf(stderr, "VolumeSeries: error opening '%s'\n", file.c_str());
+        return false;
+    }
+
+    size_t read = fread(volume->data.data(), 1, volumeBytes, fp);
+    fclose(fp);
+    if(read != volumeBytes)
+    {
+        fprintf(stderr, "VolumeSeries: '%s' is %zu bytes, expected %zu\n", file.c_str(), read, volumeBytes);
+        return false;
+    }
+    return Count(volume);
+}
+
+// Everything the render loop would otherwise do per step on the CPU
+bool VolumeSeries::Count(SeriesVolume* volume) const
+{
+    volume->hash = MICache::HashBytes(volume->data.data(), volumeBytes);
+    CountVoxelValues(volume->data.data(), volumeBytes, volume->valueCounts);
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef HEMELB_VOLUMESERIES_H
+#define HEMELB_VOLUMESERIES_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One timestep as the I/O thread leaves it - read, hashed and counted, ready to upload
+struct SeriesVolume
+{
+    size_t                      step;
+    std::vector<unsigned char>  data;
+    uint64_t                    hash;
+    uint64_t                    valueCounts[256];   // 8 bit voxels, like the rest of the renderer
+};
+
+// A sequence of same-sized raw volumes played back in order, looping at the end.
+// A background thread keeps the next few timesteps loaded in a fixed ring of
+// buffers, so moving to the next step is normally just a GPU upload.
+class VolumeSeries {
+
+    public:
+        // spec is either a printf pattern ("run/step_%04d.raw", numbered from 0 until a
+        // file is missing) or a text file listing one volume per line
+        static bool ListFiles(const char* spec, std::vector<std::string>* files);
+
+        VolumeSeries(const std::vector<std::string>& files, size_t volumeBytes, size_t ringSize);
+        ~VolumeSeries();
+
+        size_t              Steps() const { return files.size(); }
+        const std::string&  File(size_t step) const { return files[step]; }
+
+        // Blocks only when the step hasn't been prefetched yet. Null if it couldn't be
+        // read. Valid until Release(), and only one step can be held at a time.
+        const SeriesVolume* Acquire(size_t step);
+        void                Release();
+
+        size_t              Stalls() const { return stalls; }   // Acquires that had to wait on disk
+
+    private:
+        VolumeSeries(const VolumeSeries&);
+        VolumeSeries& operator=(const VolumeSeries&);
+
+        enum SlotState { EMPTY, LOADING, READY, FAILED };
+        struct Slot
+        {
+            SlotState       state;
+            SeriesVolume    volume;
+        };
+
+        void    Prefetch();
+        bool    FindWork(size_t* slot, size_t* step) const;
+        int     FindStep(size_t step) const;
+        bool    Load(SeriesVolume* volume) const;
+        bool    Count(SeriesVolume* volume) const;
+
+        std::vector<std::string>    files;
+        size_t                      volumeBytes;
+        std::vector<Slot>           slots;
+        size_t                      current;    // Step being shown, prefetch runs ahead of it
+        int                         held;       // Slot handed out by Acquire, -1 if none
+        size_t                      stalls;
+        bool                        stopping;
+
+        std::mutex                  lock;
+        std::condition_variable     changed;
+        std::thread                 worker;
+};
+#endif
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "VoxelCounts.h"
+
+// 32 bit counters are plenty for this many voxels, and keep four tables in L1
+static const size_t kChunk = (size_t)1 << 30;
+
+// Below this a thread costs more than it saves
+static const size_t kMinPerThread = (size_t)1 << 22;
+
+static void CountRange(const unsigned char* data, size_t begin, size_t end, uint64_t* counts)
+{
+    // Four tables, so runs of one value (empty space, mostly) don't serialise every
+    // increment on the same counter
+    uint32_t tables[4][256];
+    for(size_t chunk = begin; chunk < end; chunk += kChunk)
+    {
+        std::memset(tables, 0, sizeof(tables));
+        size_t chunkEnd = std::min(end, chunk + kChunk);
+        size_t i = chunk;
+
+        // Eight voxels per load, unpacked from the word rather than fetched one at a time
+        for(; i + 8 <= chunkEnd; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            tables[0][word & 0xff]++;
+            tables[1][(word >> 8) & 0xff]++;
+            tables[2][(word >> 16) & 0xff]++;
+            tables[3][(word >> 24) & 0xff]++;
+            tables[0][(word >> 32) & 0xff]++;
+            tables[1][(word >> 40) & 0xff]++;
+            tables[2][(word >> 48) & 0xff]++;
+            tables[3][word >> 56]++;
+        }
+        for(; i < chunkEnd; ++i)
+        {
+            tables[0][data[i]]++;
+        }
+
+        for(int value = 0; value < 256; ++value)
+        {
+            counts[value] += (uint64_t)tables[0][value] + tables[1][value] + tables[2][value] + tables[3][value];
+        }
+    }
+}
+
+void CountVoxelValues(const unsigned char* data, size_t count, uint64_t* counts, size_t threads)
+{
+    if(threads == 0)
+    {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    threads = std::max((size_t)1, std::min(threads, count / kMinPerThread));
+
+    std::vector<uint64_t> partial(threads * 256, 0);
+    std::vector<std::thread> pool;
+    for(size_t t = 1; t < threads; ++t)
+    {
+        pool.push_back(std::thread(CountRange, data, count * t / threads, count * (t + 1) / threads, &partial[t * 256]));
+    }
+    CountRange(data, 0, count / threads, &partial[0]);
+    for(size_t t = 0; t < pool.size(); ++t)
+    {
+        pool[t].join();
+    }
+
+    std::memset(counts, 0, 256 * sizeof(uint64_t));
+    for(size_t t = 0; t < threads; ++t)
+    {
+        for(int value = 0; value < 256; ++value)
+        {
+            counts[value] += partial[t * 256 + value];
+        }
+    }
+}
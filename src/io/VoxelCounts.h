@@ -0,0 +1,12 @@
+#ifndef HEMELB_VOXELCOUNTS_H
+#define HEMELB_VOXELCOUNTS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// How many voxels hold each of the 256 values, in one pass over the data. The
+// min/max and any histogram binning fall out of the counts, so this is the only
+// time the volume itself needs reading. Split over threads (0 = one per core),
+// each with its own private counts so nothing is shared until the final sum.
+void CountVoxelValues(const unsigned char* data, size_t count, uint64_t* counts, size_t threads = 0);
+#endif
@@ -57,6 +57,22 @@
 #include <unsupported/Eigen/MatrixFunctions>
 
 #include "entropy/Entropy.h"
+#include "entropy/SubsampledMI.h"
+#include "entropy/Estimators.h"
+#include "cache/MICache.h"
+#include "sweep/SweepAggregator.h"
+#include "transfer/TransferFunction.h"
+#include "transfer/TransferOptimiser.h"
+#include "distributed/SlabCompositor.h"
+#include "distributed/ServerLink.h"
+#include "io/VolumeSeries.h"
+#include "io/BrickedVolume.h"
+#include "io/VolumeHeader.h"
+#include "io/VoxelCounts.h"
+#include "io/GradientVolume.h"
+#include "io/FrameExporter.h"
+#include "cpu/CpuRenderer.h"
+#include "cuda/HistogramReadback.h"
 
 // Socket and learning stuff
 #include "socket.h"
@@ -65,27 +81,48 @@
 using namespace serversock;
 struct serversock::objectData data;
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "util/stb_image_write.h"
-
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <deque>
 
 typedef unsigned int uint;
 typedef unsigned char uchar;
 
 unsigned int* pVolumeDataHist = nullptr;    // This is the data after transfer function - the ray marches 
 unsigned int* pRawDataHist = nullptr;       // The raw data
+unsigned int* pImageHist = nullptr;         // Rendered frame, per channel and luminance - gathered by the render pass itself
+float* pVisibilityHist = nullptr;           // Opacity reaching the eye, by sample value
+float* pBrickVisibility = nullptr;          // Opacity reaching the eye, by brick of the volume - only with -visibility
+size_t brickCount = 0;
+
+// The march adds into the device side of the frame's histograms, and they come back into the
+// pinned host side - pVolumeDataHist and the rest above - behind it on frameStats' stream
+enum FrameStatBuffer { VOLUME_HIST_BUFFER, IMAGE_HIST_BUFFER, VISIBILITY_BUFFER };
+HistogramReadback* frameStats = nullptr;    // Emulated for -cpu
+uint *d_volumeDataHist = nullptr, *d_imageHist = nullptr;
+float *d_visibilityHist = nullptr, *d_brickVisibility = nullptr;
+size_t brickVisibilityBuffer = 0;
+uint visibilityBrickSize = 0;
 
 float entropyA = 0.f, entropyB = 0.f, jointEntropy = 0.f;
 float mutualInformation = 0.f;
+float imageEntropy[IMAGE_HISTOGRAM_CHANNELS] = {};  // r, g, b, a, luminance
+float viewEntropy = 0.f;
+float brickViewEntropy = 0.f;               // View entropy over the bricks' visibility
 float scale = 0.0001f; // This is for scaling the histogram renders - there are many smarter ways to do this
 
-size_t BIN_COUNT = 32;              // This crashes at 512, has to be *2-1, I think
+size_t BIN_COUNT = 32;              // Any count in [MIN_BIN_COUNT, MAX_BIN_COUNT], -bins=N or 'q'/'w' in BIN_COUNT_STEPs
+const size_t MIN_BIN_COUNT = 2;
+const size_t MAX_BIN_COUNT = 65536;
+const size_t BIN_COUNT_STEP = 32;
 size_t histSize = sizeof(unsigned int) * BIN_COUNT;
-size_t histSizeCache = 0;
+size_t rawHistBinCount = 0;         // BIN_COUNT pRawDataHist was last binned at
 float DataRange[2] = {0.f,0.f}; 
-float highestMI = 0.0f;
+SweepAggregator sweepResults(10, 64, 0.f, 16.f);    // Best MI, top-10 poses and MI histogram for -l sweeps
+SweepAggregator::Shard* sweepShard = nullptr;       // This thread's slot in sweepResults
 bool LOG_FLAG = false;
 bool LOG_FILE_WRITTEN = false;
 char* exePath = nullptr;
@@ -93,6 +130,9 @@ char* exePath = nullptr;
 Entropy* Entropy::instance = 0;
 Entropy* entropyHelper = entropyHelper->getInstance(); // Static instance
 
+MICache* miCache = nullptr;         // Only set when -cache=<dir> is passed
+uint64_t volumeHash = 0;            // Content hash of the loaded volume, part of every cache key
+
 GLint *windowID = nullptr; 
 
 #define MAX_EPSILON_ERROR 5.00f
@@ -135,11 +175,142 @@ float brightness        = 1.0f;
 float transferOffset    = 0.0f;
 float transferScale     = 1.0f;
 bool linearFiltering    = true;
-
-// Socket stuff
-struct sockaddr_in server; 
-int sock;
-bool serverFailed = false;
+float tstep             = 0.01f;    // Ray march step, can go much coarser with pre-integration
+float opacityThreshold  = 0.95f;    // -opacity, early ray termination - must match the kernel's default
+bool preIntegrated      = false;
+
+// -shade: headlight Blinn-Phong from a gradient volume built at load ('l' toggles)
+bool shaded             = false;
+bool gradientsLoaded    = false;
+ShadingParams shading   = DEFAULT_SHADING;
+char *gradientCacheFile = NULL;             // -gradientcache=<file>, reused while it matches the volume
+
+// Raw ray samples per view, so transfer function/density/brightness changes only re-composite
+const int SAMPLE_CACHE_SLOTS = 4;           // Must match volumeRender_kernel.cu
+struct SampleCacheState
+{
+    bool    valid;
+    float   invViewMatrix[12];
+    float   tstep;
+    bool    linearFiltering;
+    uint    width, height;
+};
+bool useSampleCache = false;
+int sampleCacheSlot = 0;
+SampleCacheState sampleCacheState[SAMPLE_CACHE_SLOTS] = {};
+
+std::vector<std::string> transferFuncFiles; // -tf=a.txt,b.txt - 't' steps through them
+size_t transferFuncIndex = 0;
+uint64_t transferFuncHash = 0;              // 0 while the built-in table is in use
+
+// -slabs=N: sort-last rendering, the volume split along z over N worker processes
+SlabCompositor* slabCompositor = nullptr;   // Coordinator only
+int slabCount = 0;
+int slabIndex = -1;                         // This worker's slab, -1 in the coordinator or a normal run
+int slabWorkerSocket = -1;
+
+// -volume=<file.nrrd|.nhdr|.mha|.mhd>: size, type and spacing come from the header instead of the flags
+VolumeHeader volumeHeader;
+bool headerVolume = false;
+float3 volumeHalfExtent = make_float3(1.f, 1.f, 1.f);   // World box is +-this, the longest side spanning -1..1
+
+// Raw voxel counts behind pRawDataHist, kept so a bin count change is just a rebin
+std::vector<uint64_t> rawValueCounts;
+
+// -series=<pattern|list>: timesteps played back in order, read ahead by a background thread
+VolumeSeries* volumeSeries = nullptr;
+size_t seriesStep = 0;
+bool seriesPlaying = true;
+FILE* seriesCSV = nullptr;                  // MI per rendered frame of the series
+
+// -progressive[=N]: while the view keeps changing only every Nth pixel each way is marched, then the
+// idle frames refine at N/2, N/4 ... 1 into the full frame. Anything that changes the frame starts over.
+struct ProgressiveState
+{
+    float       invViewMatrix[12];
+    float       density, brightness, transferOffset, transferScale, tstep;
+    bool        linearFiltering, preIntegrated, shaded, transferFuncPending;
+    size_t      binCount, seriesStep;
+    uint        width, height;
+    uint64_t    transferFuncHash;
+};
+uint progressiveStep = 0;                   // Coarsest pixel step, a power of two, 0 when off
+uint progressivePass = 0;                   // Step of the last pass drawn, 1 once converged
+ProgressiveState progressiveState;
+uint *d_progressiveImage = nullptr;         // The frame being refined, the PBO is mapped write-discard
+size_t progressiveImageSize = 0;            // pixels
+
+// -subsample[=X]: march a frame's rays in stratified batches of one ray per NxN cell, stopping once
+// the MI's 95% interval is within +-X bits
+float subsampleTolerance = 0.f;             // 0 when off
+uint subsampleCell = 4;                     // -subsamplecell=N, a power of two - N^2 batches are the full frame
+const size_t SUBSAMPLE_MIN_BATCHES = 4;     // Fewer and the jackknife is too noisy to stop on
+float miHalfWidth = 0.f;                    // Of the last frame's MI, 0 when every ray was marched
+float raysMarched = 1.f;                    // Fraction of the last frame's rays its MI comes from
+
+// -estimator=<name>: how the MI's entropies are estimated from the histograms. Anything but the plug-in
+// keeps the histograms' running sums, so each frame only pays for the bins its march changed.
+EntropyEstimator miEstimator = ESTIMATOR_PLUGIN;
+HistogramStream volumeStream, rawStream;
+
+// -record=<frame_%05d.png|frame_%05d.ppm|out.y4m>: every displayed frame is copied from the PBO
+// into a pinned buffer and encoded on FrameExporter's threads. A copy is only waited on once
+// another frame's is queued behind it, so the render loop never waits on the readback or encoders.
+FrameExporter* frameExporter = nullptr;
+struct PendingExport
+{
+    FrameExporter::Frame*   frame;
+    cudaEvent_t             copied;
+};
+std::deque<PendingExport> pendingExports;
+
+// -pipeline[=N]: N (2) frames in flight on the GPU's direct march. Each frame marches on
+// pipelineStream into a slot of its own - image, histograms, and pinned copies of the histograms
+// landing behind it - and is only finished, its MI worked out, logged and sent, when its slot
+// comes round again. So the host's MI for one frame overlaps the device's march of the next, and
+// what's shown lags the view by N frames, every result with the pose it was marched at. Anything
+// besides the view changing finishes every frame in flight first.
+struct FrameSlot
+{
+    uint        *d_image;
+    size_t      imageSize;                      // pixels d_image has room for
+    HistogramReadback *stats;                   // On pipelineStream
+    bool        busy, cacheHit, cacheable;
+    MICacheKey  cacheKey;
+    MICacheEntry cached;
+    float3      rotation, translation;
+    size_t      seriesStep, generation;
+    size_t      binCount;                       // What it was marched with, for when it is retired
+    uint        width, height;
+};
+size_t pipelineDepth = 0;                   // 0 when off
+std::vector<FrameSlot> frameSlots;
+size_t nextFrameSlot = 0;                   // Also the oldest frame in flight, when it is busy
+cudaStream_t pipelineStream = 0;
+ProgressiveState pipelineState;             // Of the frames in flight, all but the view
+std::vector<uint> shownVolumeHist;          // The last finished frame's, for display()
+uint *d_shownImage = nullptr;               // The last finished frame's picture, on pipelineStream
+size_t shownImageSize = 0;
+uint shownWidth = 0, shownHeight = 0;       // 0 until a frame has finished
+cudaEvent_t pipelineShown = 0;              // The picture's copy into the PBO
+
+// -statsgrid=WxH|N: the histograms come from a stats-only pass over a ray grid of their own, and the
+// displayed frame is marched for colour alone - so the MI costs the same whatever the window size
+uint statsGridWidth = 0, statsGridHeight = 0;   // 0 when the stats ride along with the colour
+dim3 statsGridSize;
+
+// -cpu: march on the host instead, headless runs only (-regression, -file)
+CpuRenderer* cpuRenderer = nullptr;
+
+// Only created for -regression, timing renderFrame's two halves
+StopWatchInterface *marchTimer = 0;
+StopWatchInterface *miTimer = 0;
+
+// The RL server's steps, null with no server. A step's reply moves the view and starts a new
+// generation; only a frame marched in the current generation - at the pose the server asked
+// for - is sent back as the next step.
+ServerLink* serverLink = nullptr;
+size_t serverGeneration = 0;
 
 std::ofstream* outputFile = nullptr;
 
@@ -165,103 +336,34 @@ char **pArgv;
 
 extern "C" void setTextureFilterMode(bool bLinearFilter);
 extern "C" void initCuda(void *h_volume, cudaExtent volumeSize);
+extern "C" void updateVolume(void *h_volume, cudaExtent volumeSize);
 extern "C" void freeCudaBuffers();
 extern "C" void render_kernel(dim3 gridSize, dim3 blockSize, uint *d_output, uint imageW, uint imageH,
-                              float density, float brightness, float transferOffset, float transferScale, uint* pVolumeDataDist, size_t histSize);
-extern "C" void copyInvViewMatrix(float *invViewMatrix, size_t sizeofMatrix);
+                              float density, float brightness, float transferOffset, float transferScale, uint* pVolumeDataDist, size_t histSize,
+                              float tstep, bool preIntegrated, uint* pImageHist, float* pVisibilityHist, float* pBrickVisibility,
+                              uint pixelStep, bool refining, int batch, cudaStream_t stream);
+extern "C" void updatePreIntegration(float transferOffset, float transferScale, float density, float tstep);
+extern "C" void setTransferFunction(const float4 *entries, size_t count);
+extern "C" bool isTransferFunctionPending();
+extern "C" bool captureSampleCache(int slot, dim3 gridSize, dim3 blockSize, uint imageW, uint imageH, float tstep);
+extern "C" void render_from_sample_cache(int slot, dim3 gridSize, dim3 blockSize, uint *d_output, uint imageW, uint imageH,
+                                         float density, float brightness, float transferOffset, float transferScale,
+                                         uint* pVolumeDataHist, size_t histSize, bool preIntegrated,
+                                         uint* pImageHist, float* pVisibilityHist, float* pBrickVisibility, float tstep);
+extern "C" void copyInvViewMatrix(float *invViewMatrix, size_t sizeofMatrix, cudaStream_t stream);
+extern "C" void setVolumeBox(float3 boxMin, float3 boxMax, float3 texScale, float3 texOffset);
+extern "C" size_t setVisibilityGrid(cudaExtent volumeSize, uint brickSize);
+extern "C" void initGradients(const void *h_gradients, cudaExtent volumeSize);
+extern "C" void setShading(bool enabled, const ShadingParams *params);
+extern "C" void setOpacityThreshold(float threshold);
 
 void dirtyDrawBitmapString(int x, int y, const char* string, GLfloat* colour = nullptr, void* font = GLUT_BITMAP_TIMES_ROMAN_24);
 void dirtyDrawBitmapString(float x, float y, const char* string, GLfloat* colour = nullptr, void* font = GLUT_BITMAP_TIMES_ROMAN_24);
 void *loadRawFile(char *filename, size_t size);
+void *loadRawSlab(char *filename, size_t firstSlice, size_t sliceCount);
+void initHistgramBuffers();
 void initPixelBuffer();
-
-void SendToServer(char* message = nullptr);
-void ListenToServer();
-
-void SetupServerConnection(char* addr = "127.0.0.1", int port = 8888)
-{
-    close(sock);
-    //std::cout << "[CLIENT]: Connecting to server" << std::endl; 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if(sock == -1)
-    {
-        std::cout << "[CLIENT]: Could not create socket for some reason" << std::endl;
-    }
-    else
-    {
-        std::cout << "[CLIENT]: Socket created with code " << sock << std::endl;
-    }
-    
-    if(addr)
-        server.sin_addr.s_addr = inet_addr(addr);
-    else
-        server.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    server.sin_family = AF_INET;
-    server.sin_port = htons(port);
-
-    //Connect to remote server
-    if (connect(sock , (struct sockaddr *)&server , sizeof(server)) < 0)
-    {
-        perror("[CLIENT]: Connect failed. Error");
-        // This is a bit of a temp hack, if the server doesn't connect we will never listen for it again
-        serverFailed = true;
-        return; 
-    }
-
-    //SendToServer((char*)"[CLIENT]: Connected to server\n");
-}
-
-void SendToServer(char* message)
-{
-    int i=0;
-    
-    if(message == nullptr) //then well post the MI information
-    {
-        // for the sake of ease, ill just set the timestep to zero 
-        float MI_arr[5];
-        MI_arr[0] = 0;
-        MI_arr[1] = viewRotation.x;
-        MI_arr[2] = viewRotation.y;
-        MI_arr[3] = viewTranslation.z;
-        MI_arr[4] = mutualInformation;
-        char const * p = reinterpret_cast<char const *>(MI_arr); 
-        std::string s(p, p + sizeof MI_arr);
-        //std::cout << s << std::endl;
-        write(sock, &s[0], sizeof(MI_arr));
-        ListenToServer();
-    }
-    else
-    {
-        write(sock,message,strlen(message));
-    }
-    SetupServerConnection();
-}
-
-void ListenToServer()
-{
-    int i;
-    char server_reply[2000] = {0};
-    ssize_t len;
-    
-    //std::cout << "[CLIENT]: Waiting for reply\n" << std::endl; 
-    if( (len = recv(sock, server_reply, 2000, 0)) < 0 )
-    {
-        std::cout << "[CLIENT]: Recv Failed\n" << std::endl; 
-        close(sock);
-    }
-    
-    // This is crazy unsafe - look into using protobuffs
-    float* unpacked = (float*)server_reply; 
-    printf("[SERVER]: %f, %f, %f\n", unpacked[0], unpacked[1], unpacked[2]);
-    viewRotation.x = unpacked[0];
-    viewRotation.y = unpacked[1];
-    viewTranslation.z = unpacked[2];
-    for (i=0; i< strlen(server_reply); i++)
-    {
-      server_reply[i] = '\0';
-    }
-}
+bool DrainPipeline();
 
 void computeFPS()
 {
@@ -272,7 +374,14 @@ void computeFPS()
     {
         char fps[256];
         float ifps = 1.f / (sdkGetAverageTimerValue(&timer) / 1000.f);
-        sprintf(fps, "Volume Render: %3.1f fps", ifps);
+        char interval[64] = "";
+        if (miHalfWidth > 0.f)
+        {
+            sprintf(interval, " +- %.3f (%.0f%% of rays)", miHalfWidth, raysMarched*100.f);
+        }
+        sprintf(fps, "Volume Render: %3.1f fps | MI %.3f%s | image entropy %.3f | view entropy %.3f%s",
+                ifps, mutualInformation, interval, imageEntropy[IMAGE_HISTOGRAM_CHANNELS - 1], viewEntropy,
+                progressivePass > 1 ? " | refining" : "");
 
         glutSetWindowTitle(fps);
         fpsCount = 0;
@@ -315,215 +424,1055 @@ void dirtyDrawBitmapString(float x, float y, const char* string, GLfloat* colour
     }
 }
 
-// render image using CUDA
-void render()
+// Same matrix display() used to read back from GL - rotate about x, then y, then
+// translate - but built by hand so headless runs can use it too
+void buildInvViewMatrix()
 {
-    // Not really needed here, but if the bin count changes, we need to reallocate
-    histSize = sizeof(uint)*BIN_COUNT; 
-    if(histSizeCache != histSize)
+    const float degToRad = 3.14159265358979f / 180.f;
+    float cx = cosf(-viewRotation.x * degToRad), sx = sinf(-viewRotation.x * degToRad);
+    float cy = cosf(-viewRotation.y * degToRad), sy = sinf(-viewRotation.y * degToRad);
+
+    // Rx * Ry, row major
+    float r[3][3] =
+    {
+        {  cy,       0.f,  sy      },
+        {  sx*sy,    cx,  -sx*cy   },
+        { -cx*sy,    sx,   cx*cy   },
+    };
+
+    for(int row = 0; row < 3; ++row)
     {
-        printf("Allocating Volume Data Histogram of size %li\n", histSize);
-        checkCudaErrors(cudaFree(pVolumeDataHist));
-        checkCudaErrors(cudaMallocManaged(&pVolumeDataHist, histSize));
-        histSizeCache = histSize;
+        invViewMatrix[row*4 + 0] = r[row][0];
+        invViewMatrix[row*4 + 1] = r[row][1];
+        invViewMatrix[row*4 + 2] = r[row][2];
+        invViewMatrix[row*4 + 3] = -(r[row][0]*viewTranslation.x + r[row][1]*viewTranslation.y + r[row][2]*viewTranslation.z);
+    }
+}
 
-        char *path = sdkFindFilePath(volumeFilename, exePath);
+// The raw histogram from rawValueCounts - each value lands in the bin its position in DataRange puts it
+void BinRawValueCounts()
+{
+    delete[] pRawDataHist;
+    pRawDataHist = new unsigned int[BIN_COUNT]();
 
-        if (path == 0)
+    float range = std::max(DataRange[1] - DataRange[0], 1.f);
+    for(size_t value = 0; value < rawValueCounts.size(); ++value)
+    {
+        if(!rawValueCounts[value])
         {
-            printf("Error finding file '%s'\n", volumeFilename);
-            exit(EXIT_FAILURE);
+            continue;   // Includes everything outside DataRange
         }
-
-        size_t size = volumeSize.width*volumeSize.height*volumeSize.depth*sizeof(VolumeType);
-        void *h_volume = loadRawFile(path, size);
-        free(h_volume);
+        size_t idx = (size_t)((value - DataRange[0]) / range * BIN_COUNT);
+        pRawDataHist[std::min(idx, BIN_COUNT - 1)] += rawValueCounts[value];
     }
+}
 
-    copyInvViewMatrix(invViewMatrix, sizeof(float4)*3);
-
-    // map PBO to get CUDA device pointer
-    uint *d_output;
-    // map PBO to get CUDA device pointer
-    checkCudaErrors(cudaGraphicsMapResources(1, &cuda_pbo_resource, 0));
-    size_t num_bytes;
-    checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void **)&d_output, &num_bytes,
-                                                         cuda_pbo_resource));
-    //printf("CUDA mapped PBO: May access %ld bytes\n", num_bytes);
-
-    // clear image
-    checkCudaErrors(cudaMemset(d_output, 0, width*height*4));
+// Take on a new set of raw value counts, with DataRange over the values present
+void SetRawValueCounts(const uint64_t *counts)
+{
+    rawValueCounts.assign(counts, counts + 256);
 
-    // call CUDA kernel, writing results to PBO
-    for(int i = 0; i < BIN_COUNT + 1; i++)
+    bool seenValue = false;
+    for(size_t value = 0; value < rawValueCounts.size(); ++value)
     {
-        pVolumeDataHist[i] = 0;
+        if(rawValueCounts[value])
+        {
+            DataRange[0] = seenValue ? DataRange[0] : value;
+            DataRange[1] = value;
+            seenValue = true;
+        }
     }
-    render_kernel(gridSize, blockSize, d_output, width, height, density, brightness, transferOffset, transferScale, pVolumeDataHist, histSize);
-    cudaDeviceSynchronize();
-    getLastCudaError("kernel failed");
-    checkCudaErrors(cudaGraphicsUnmapResources(1, &cuda_pbo_resource, 0));
+    BinRawValueCounts();
+}
 
-    entropyHelper->GetEntropy(pVolumeDataHist, pRawDataHist, BIN_COUNT, &entropyA, &entropyB, &jointEntropy, &mutualInformation);
-    
-    //std::cout << "Bin Count = " << BIN_COUNT << " | Raw entropy = " << entropyA << " | Volume Entropy = " << entropyB << " | Joint Entropy = " << jointEntropy << " | MI = " << mutualInformation << std::endl;
+// Swap a timestep in. The I/O thread has normally read, hashed and counted it already,
+// so all that's left is the upload.
+void LoadSeriesStep(size_t step, bool initialise = false)
+{
+    DrainPipeline();    // The frames in flight sample the texture this overwrites
 
-    if(LOG_FLAG)
+    const SeriesVolume *volume = volumeSeries->Acquire(step);
+    if(!volume)
     {
-        if(mutualInformation > highestMI)
+        if(initialise)
         {
-            highestMI = mutualInformation;
+            exit(EXIT_FAILURE);
         }
+        return;     // Stay on the current step, the bad one is retried next time round
+    }
 
-        // Lets record the whole dump the frame to CSV too, we just need the rotation and MI for now
-        FILE* runCSV; 
-        if(!LOG_FILE_WRITTEN)
-        {
-            runCSV = std::fopen("./data/Sampling/FullRun.csv", "w+");
-            LOG_FILE_WRITTEN = true;
-        }
-        else
-        {
-            runCSV = std::fopen("./data/Sampling/FullRun.csv", "a+");
-        }
-        fprintf(runCSV, "%f,%f,%f,\n", viewRotation.x, viewRotation.y, mutualInformation);
-        std::fclose(runCSV); 
+    if(initialise)
+    {
+        initCuda((void *)volume->data.data(), volumeSize);
+    }
+    else
+    {
+        updateVolume((void *)volume->data.data(), volumeSize);
+    }
+    volumeHash = volume->hash;
+    SetRawValueCounts(volume->valueCounts);
+    seriesStep = volume->step;
+    volumeSeries->Release();
+
+    // Captured samples are of the old volume
+    for(int i = 0; i < SAMPLE_CACHE_SLOTS; ++i)
+    {
+        sampleCacheState[i].valid = false;
     }
 }
 
-// display results using OpenGL (called by GLUT)
-void display()
-{    
-    sdkStartTimer(&timer);
+// March slices [z0, z1) of the volume's world box, with the texture holding slices [first, last)
+void SetSlabBox(size_t z0, size_t z1, size_t first, size_t last)
+{
+    float3 e = volumeHalfExtent;
+    float depth = (float)volumeSize.depth, slabDepth = (float)(last - first);
+
+    // World -e..e to texture 0..1, then z on into the slices we actually hold
+    float3 boxMin = make_float3(-e.x, -e.y, e.z*(-1.f + 2.f*z0/depth));
+    float3 boxMax = make_float3(e.x, e.y, e.z*(-1.f + 2.f*z1/depth));
+    float3 texScale = make_float3(1.f/e.x, 1.f/e.y, depth/(slabDepth*e.z));
+    float3 texOffset = make_float3(0.5f - 0.5f/e.x, 0.5f - 0.5f/e.y, ((0.5f - 0.5f/e.z)*depth - first)/slabDepth);
+    if(cpuRenderer)
+    {
+        cpuRenderer->SetVolumeBox(boxMin, boxMax, texScale, texOffset);
+    }
+    else
+    {
+        setVolumeBox(boxMin, boxMax, texScale, texOffset);
+    }
+}
 
-    // use OpenGL to build view matrix
-    GLfloat modelView[16];
-    glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
-    glLoadIdentity();
-    glRotatef(-viewRotation.x, 1.0, 0.0, 0.0);
-    glRotatef(-viewRotation.y, 0.0, 1.0, 0.0);
-    glTranslatef(-viewTranslation.x, -viewTranslation.y, -viewTranslation.z);
-    glGetFloatv(GL_MODELVIEW_MATRIX, modelView);
-    glPopMatrix();
+// Hand the frame to the slab workers and composite what comes back
+void RenderSlabs(uint *d_output)
+{
+    SlabRequest request;
+    memset(&request, 0, sizeof(SlabRequest));
+    memcpy(request.invViewMatrix, invViewMatrix, sizeof(invViewMatrix));
+    request.density             = density;
+    request.transferOffset      = transferOffset;
+    request.transferScale       = transferScale;
+    request.tstep               = tstep;
+    request.opacityThreshold    = opacityThreshold;
+    request.width               = width;
+    request.height              = height;
+    request.binCount            = BIN_COUNT;
+    request.preIntegrated       = preIntegrated;
+    request.linearFiltering     = linearFiltering;
+    request.transferFuncIndex   = transferFuncIndex;
+
+    std::vector<uint32_t> image(width*height), histogram(BIN_COUNT);
+    if(!slabCompositor->Render(request, brightness, image.data(), histogram.data()))
+    {
+        fprintf(stderr, "Lost contact with a slab worker\n");
+        exit(EXIT_FAILURE);
+    }
+    checkCudaErrors(cudaMemcpy(d_output, image.data(), width*height*4, cudaMemcpyHostToDevice));
+    std::copy(histogram.begin(), histogram.end(), pVolumeDataHist);
+
+    // The composite is on the host already, so its stats go straight into the host side. Visibility
+    // isn't - each slab's is relative to its own front, not the eye - so slab runs leave it empty
+    // and report a view entropy of zero.
+    std::fill(pImageHist, pImageHist + IMAGE_HISTOGRAM_CHANNELS*IMAGE_HISTOGRAM_BINS, 0u);
+    std::fill(pVisibilityHist, pVisibilityHist + VISIBILITY_BINS, 0.f);
+    Entropy::BinImage(image.data(), image.size(), pImageHist);
+}
 
-    invViewMatrix[0] = modelView[0];
-    invViewMatrix[1] = modelView[4];
-    invViewMatrix[2] = modelView[8];
-    invViewMatrix[3] = modelView[12];
-    invViewMatrix[4] = modelView[1];
-    invViewMatrix[5] = modelView[5];
-    invViewMatrix[6] = modelView[9];
-    invViewMatrix[7] = modelView[13];
-    invViewMatrix[8] = modelView[2];
-    invViewMatrix[9] = modelView[6];
-    invViewMatrix[10] = modelView[10];
-    invViewMatrix[11] = modelView[14];
+// The histograms' buffers, in FrameStatBuffer order
+void AddFrameStatBuffers(HistogramReadback *stats)
+{
+    stats->Add(MAX_BIN_COUNT*sizeof(uint));
+    stats->Add(IMAGE_HISTOGRAM_CHANNELS*IMAGE_HISTOGRAM_BINS*sizeof(uint));
+    stats->Add(VISIBILITY_BINS*sizeof(float));
+}
 
-    render();
+void ClearFrameStats(HistogramReadback *stats)
+{
+    stats->Clear(VOLUME_HIST_BUFFER, BIN_COUNT*sizeof(uint));
+    stats->Clear(IMAGE_HIST_BUFFER, IMAGE_HISTOGRAM_CHANNELS*IMAGE_HISTOGRAM_BINS*sizeof(uint));
+    stats->Clear(VISIBILITY_BUFFER, VISIBILITY_BINS*sizeof(float));
+}
 
-    // display results
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// Queues the copies home, and marks them for Wait()
+void DownloadFrameStats(HistogramReadback *stats)
+{
+    stats->Download(VOLUME_HIST_BUFFER, BIN_COUNT*sizeof(uint));
+    stats->Download(IMAGE_HIST_BUFFER, IMAGE_HISTOGRAM_CHANNELS*IMAGE_HISTOGRAM_BINS*sizeof(uint));
+    stats->Download(VISIBILITY_BUFFER, VISIBILITY_BINS*sizeof(float));
+}
 
-    // draw image from PBO
-    glDisable(GL_DEPTH_TEST);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    // draw using texture
-    // copy from pbo to texture
-    glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pbo);
-    glBindTexture(GL_TEXTURE_2D, _tex);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-    glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+// Zero the device side of everything a march adds its samples to, queued ahead of the march
+void ClearFrameStats()
+{
+    ClearFrameStats(frameStats);
+    if(pBrickVisibility)
+    {
+        frameStats->Clear(brickVisibilityBuffer, brickCount*sizeof(float));
+    }
+}
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(0.0, 1.0, 0.0, 1.0, -100.0, 100.0);
+// The march's histograms into the host side. Only waits on the copies, which are queued behind
+// the march - not on the whole device.
+void ReadBackFrameStats()
+{
+    DownloadFrameStats(frameStats);
+    if(pBrickVisibility)
+    {
+        frameStats->Download(brickVisibilityBuffer, brickCount*sizeof(float));
+    }
+    frameStats->Record();
+    frameStats->Wait();
+    if(!frameStats->Emulated())
+    {
+        getLastCudaError("kernel failed");
+    }
+}
 
-    // draw textured quad
-    glEnable(GL_TEXTURE_2D);
-    glBegin(GL_TRIANGLE_STRIP);
-        glColor3f(1,1,1);
-        glTexCoord2f(0, 0);
-        glVertex2f(0, 0);
-        glTexCoord2f(1, 0);
-        glVertex2f(1, 0);
-        glTexCoord2f(0, 1);
-        glVertex2f(0, 1);
-        glTexCoord2f(1, 1);
-        glVertex2f(1, 1);
-    glEnd();
+// MI and the other entropies from a march's histograms of binCount bins, brickVisibility optional
+void ComputeFrameEntropies(uint *volumeHist, uint *imageHist, const float *visibility, const float *brickVisibility,
+                           size_t binCount)
+{
+    sdkStartTimer(&miTimer);
+    if (miEstimator == ESTIMATOR_PLUGIN)
+    {
+        entropyHelper->GetEntropy(volumeHist, pRawDataHist, binCount, &entropyA, &entropyB, &jointEntropy, &mutualInformation);
+    }
+    else
+    {
+        volumeStream.Set(volumeHist, binCount);
+        rawStream.Set(pRawDataHist, binCount);
+        EstimateMI(miEstimator, volumeStream, rawStream, &entropyA, &entropyB, &jointEntropy, &mutualInformation);
+    }
+    entropyHelper->ImageEntropy(imageHist, imageEntropy);
+    viewEntropy = entropyHelper->VisibilityEntropy(visibility, VISIBILITY_BINS);
+    if(brickVisibility)
+    {
+        brickViewEntropy = entropyHelper->VisibilityEntropy(brickVisibility, brickCount);
+    }
+    sdkStopTimer(&miTimer);
+}
 
-    glDisable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, 0);
+// From whatever the march left in the frame's histograms
+void ComputeFrameEntropies()
+{
+    ComputeFrameEntropies(pVolumeDataHist, pImageHist, pVisibilityHist, pBrickVisibility, BIN_COUNT);
+}
 
-    glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
-    glLoadIdentity();
-    glScalef(0.07, 0.5, 1.0);
-    glBegin(GL_TRIANGLE_STRIP);
-        glColor3f(1,0,0);
-        glVertex2f(0.1, ((0.9-0.1)/(6))*1);
-        glVertex2f(1,   ((0.9-0.1)/(6))*1);
-        
-        glColor3f(1,0.5,0);
-        glVertex2f(0.1, ((0.9-0.1)/(6))*2);
-        glVertex2f(1,   ((0.9-0.1)/(6))*2);
+// Unsure which table this frame will use, or want the per-brick visibility only a real march gives
+bool IsFrameCacheable()
+{
+    return miCache && !isTransferFunctionPending() && !pBrickVisibility;
+}
 
-        glColor3f(1,1,0);
-        glVertex2f(0.1, ((0.9-0.1)/(6))*3);
-        glVertex2f(1,   ((0.9-0.1)/(6))*3);
+// Only the GPU's direct march has the two passes
+bool HasStatsPass()
+{
+    return statsGridWidth && !cpuRenderer && !slabCompositor && !useSampleCache;
+}
 
-        glColor3f(0,1,0);
-        glVertex2f(0.1, ((0.9-0.1)/(6))*4);
-        glVertex2f(1,   ((0.9-0.1)/(6))*4);
+// The frame marched for colour alone, when its stats come from their own pass
+void RenderColour(uint *d_output)
+{
+    render_kernel(gridSize, blockSize, d_output, width, height, density, brightness, transferOffset, transferScale,
+                  nullptr, histSize, tstep, preIntegrated, nullptr, nullptr, nullptr, 1, false, -1, 0);
+}
 
-        glColor3f(0,1,1);
-        glVertex2f(0.1, ((0.9-0.1)/(6))*5);
-        glVertex2f(1,   ((0.9-0.1)/(6))*5);
+CpuRenderParams CurrentCpuRenderParams()
+{
+    CpuRenderParams params;
+    memcpy(params.invViewMatrix, invViewMatrix, sizeof(invViewMatrix));
+    params.density          = density;
+    params.brightness       = brightness;
+    params.transferOffset   = transferOffset;
+    params.transferScale    = transferScale;
+    params.tstep            = tstep;
+    params.opacityThreshold = opacityThreshold;
+    params.linearFiltering  = linearFiltering;
+    params.preIntegrated    = preIntegrated;
+    params.shaded           = shaded;
+    params.shading          = shading;
+    return params;
+}
 
-        glColor3f(0,0,1);
-        glVertex2f(0.1, ((0.9-0.1)/(6))*6);
-        glVertex2f(1,   ((0.9-0.1)/(6))*6);
+MICacheKey FrameCacheKey()
+{
+    bool statsPass = HasStatsPass();
+    float halfExtent[3] = { volumeHalfExtent.x, volumeHalfExtent.y, volumeHalfExtent.z };
+    return MICache::MakeKey(volumeHash, halfExtent, viewRotation.x, viewRotation.y,
+                            viewTranslation.x, viewTranslation.y, viewTranslation.z,
+                            transferOffset, transferScale, density, BIN_COUNT,
+                            statsPass ? statsGridWidth : width, statsPass ? statsGridHeight : height,
+                            linearFiltering, tstep, preIntegrated,
+                            shaded && gradientsLoaded, brightness, miEstimator, opacityThreshold, transferFuncHash);
+}
 
-        glColor3f(1,0,1);
-        glVertex2f(0.1, ((0.9-0.1)/(6))*7);
-        glVertex2f(1,   ((0.9-0.1)/(6))*7);
-    glEnd();
+void StoreFrameInCache(const MICacheKey& key, const uint *volumeHist, size_t binCount)
+{
+    MICacheEntry entry;
+    entry.entropyA          = entropyA;
+    entry.entropyB          = entropyB;
+    entry.jointEntropy      = jointEntropy;
+    entry.mutualInformation = mutualInformation;
+    std::copy(imageEntropy, imageEntropy + IMAGE_HISTOGRAM_CHANNELS, entry.imageEntropy);
+    entry.viewEntropy       = viewEntropy;
+    entry.histogram.assign(volumeHist, volumeHist + binCount);
+    miCache->Store(key, entry);
+}
 
+void TakeCachedEntropies(const MICacheEntry& cached)
+{
+    entropyA            = cached.entropyA;
+    entropyB            = cached.entropyB;
+    jointEntropy        = cached.jointEntropy;
+    mutualInformation   = cached.mutualInformation;
+    std::copy(cached.imageEntropy, cached.imageEntropy + IMAGE_HISTOGRAM_CHANNELS, imageEntropy);
+    viewEntropy         = cached.viewEntropy;
+}
 
-    if(pVolumeDataHist != nullptr)
-    {
-        // These shouldn't really be hardcoded but...
-        float bottom = 0.1f, top = 0.9f;
-        float difference = top - bottom;
-        float step = difference / BIN_COUNT;
-        for(size_t i = 0; i < BIN_COUNT + 1; ++i)
-        {
-            float barY = 0.137f + (step * i);
-            glLineWidth(4.0f);
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); 
-            glEnable( GL_BLEND ); 
+ProgressiveState CurrentProgressiveState()
+{
+    ProgressiveState state;
+    memset(&state, 0, sizeof(ProgressiveState));     // Padding takes part in the compare
+    memcpy(state.invViewMatrix, invViewMatrix, sizeof(invViewMatrix));
+    state.density               = density;
+    state.brightness            = brightness;
+    state.transferOffset        = transferOffset;
+    state.transferScale         = transferScale;
+    state.tstep                 = tstep;
+    state.linearFiltering       = linearFiltering;
+    state.preIntegrated         = preIntegrated;
+    state.shaded                = shaded;
+    state.transferFuncPending   = isTransferFunctionPending();
+    state.binCount              = BIN_COUNT;
+    state.seriesStep            = seriesStep;
+    state.width                 = width;
+    state.height                = height;
+    state.transferFuncHash      = transferFuncHash;
+    return state;
+}
 
-            glBegin(GL_LINES);
-                glColor4f(1.f, 1.f, 1.f, 1.f); 
-                glVertex2f(1.f, barY);
-                glVertex2f((float)pVolumeDataHist[i]*scale + 1.f, barY);
-            glEnd();
-        }
+// One pass of -progressive: the coarsest after any change, otherwise the next finer one until
+// converged. The histograms add up over the passes, so each pass's MI is over every ray marched
+// so far, and the converged one is exactly a full frame's.
+void RenderProgressive(uint *d_output)
+{
+    size_t pixels = (size_t)width*height;
+    if(progressiveImageSize < pixels)
+    {
+        checkCudaErrors(cudaFree(d_progressiveImage));
+        checkCudaErrors(cudaMalloc(&d_progressiveImage, pixels*sizeof(uint)));
+        progressiveImageSize = pixels;
     }
 
-    glPopMatrix();
-
-    glClearColor(.5f, .5, .5f, 1.0f);
-    glutSwapBuffers();
-    glutReportErrors();
+    ProgressiveState state = CurrentProgressiveState();
+    bool restart = progressivePass == 0 || memcmp(&state, &progressiveState, sizeof(ProgressiveState)) != 0;
+    if(restart || progressivePass > 1)
+    {
+        uint pass = restart ? progressiveStep : progressivePass/2;
+        progressiveState = state;
 
-    sdkStopTimer(&timer);
+        sdkStartTimer(&marchTimer);
+        if(restart)
+        {
+            ClearFrameStats();
+        }
+        if(preIntegrated)
+        {
+            updatePreIntegration(transferOffset, transferScale, density, tstep);
+        }
+        render_kernel(gridSize, blockSize, d_progressiveImage, width, height, density, brightness, transferOffset, transferScale,
+                      d_volumeDataHist, histSize, tstep, preIntegrated, d_imageHist, d_visibilityHist, d_brickVisibility,
+                      pass, !restart, -1, frameStats->Stream());
+        ReadBackFrameStats();
+        sdkStopTimer(&marchTimer);
+        progressivePass = pass;
+
+        ComputeFrameEntropies();
+        if(progressivePass == 1 && IsFrameCacheable())
+        {
+            StoreFrameInCache(FrameCacheKey(), pVolumeDataHist, BIN_COUNT);
+        }
+    }
 
-    computeFPS();
+    // Converged frames are only copied, there is nothing left to march
+    checkCudaErrors(cudaMemcpy(d_output, d_progressiveImage, pixels*sizeof(uint), cudaMemcpyDeviceToDevice));
 }
 
-void DisplayStatsWindow()
+// The march of a -subsample frame: batches until the MI's interval is tight enough, or until
+// every ray has been marched and the MI is exact. Only the first batch's rays fill the image,
+// if there is one.
+void RenderSubsampled(uint *d_output, uint imageW, uint imageH, dim3 grid)
+{
+    uint batchCount = subsampleCell*subsampleCell;
+    SubsampledMI estimate(BIN_COUNT, pRawDataHist, batchCount, miEstimator);
+    float estimatedMI = 0.f;
+    uint batch = 0;
+    while(batch < batchCount)
+    {
+        render_kernel(grid, blockSize, d_output, imageW, imageH, density, brightness, transferOffset, transferScale,
+                      d_volumeDataHist, histSize, tstep, preIntegrated, d_imageHist, d_visibilityHist, d_brickVisibility,
+                      subsampleCell, false, (int)batch++, frameStats->Stream());
+        ReadBackFrameStats();
+
+        estimate.AddCumulative(pVolumeDataHist);
+        if(batch >= SUBSAMPLE_MIN_BATCHES)
+        {
+            estimate.Estimate(1.96f, &estimatedMI, &miHalfWidth);
+            if(miHalfWidth <= subsampleTolerance)
+            {
+                break;
+            }
+        }
+    }
+
+    raysMarched = (float)batch / batchCount;
+    if(batch == batchCount)
+    {
+        miHalfWidth = 0.f;
+    }
+}
+
+// Render the current view into d_output and work out the MI, going through the
+// MI cache when there is one. d_output is left untouched on a cache hit.
+void renderFrame(uint *d_output)
+{
+    // The volume histogram has room for MAX_BIN_COUNT, so a new bin count is only a new histSize -
+    // nothing to free, and no cudaFree to wait on the device
+    histSize = sizeof(uint)*BIN_COUNT;
+    if(rawHistBinCount != BIN_COUNT)
+    {
+        // Rebinned from the value counts, no need to go back to the volume
+        BinRawValueCounts();
+        rawHistBinCount = BIN_COUNT;
+    }
+
+    if(!cpuRenderer)
+    {
+        copyInvViewMatrix(invViewMatrix, sizeof(float4)*3, 0);
+    }
+
+    // Only ever interactive, and the slabs have their own way of rendering
+    if(progressiveStep && !cpuRenderer && !slabCompositor)
+    {
+        RenderProgressive(d_output);
+        return;
+    }
+
+    // A cache hit skips the stats, but the view is still marched for its picture
+    MICacheKey cacheKey;
+    MICacheEntry cached;
+    bool cacheHit = false;
+    bool cacheable = IsFrameCacheable();
+    if(cacheable)
+    {
+        cacheKey = FrameCacheKey();
+        cacheHit = miCache->Lookup(cacheKey, &cached);
+    }
+
+    if(cacheHit)
+    {
+        // The slabs and the CPU bring their stats along regardless - they're replaced just below
+        if(slabCompositor)
+        {
+            RenderSlabs(d_output);
+        }
+        else if(cpuRenderer)
+        {
+            ClearFrameStats();
+            cpuRenderer->Render(CurrentCpuRenderParams(), width, height, d_output, d_volumeDataHist, BIN_COUNT, nullptr);
+        }
+        else
+        {
+            checkCudaErrors(cudaMemset(d_output, 0, width*height*4));
+            if(preIntegrated)
+            {
+                updatePreIntegration(transferOffset, transferScale, density, tstep);
+            }
+            RenderColour(d_output);
+            cudaDeviceSynchronize();
+            getLastCudaError("kernel failed");
+        }
+
+        std::copy(cached.histogram.begin(), cached.histogram.end(), pVolumeDataHist);
+        TakeCachedEntropies(cached);
+    }
+    else
+    {
+        sdkStartTimer(&marchTimer);
+        miHalfWidth = 0.f;
+        raysMarched = 1.f;
+
+        // clear image - the CPU path writes every pixel anyway
+        if(!cpuRenderer)
+        {
+            checkCudaErrors(cudaMemset(d_output, 0, width*height*4));
+        }
+
+        // call CUDA kernel, writing results to PBO
+        bool readBack = !slabCompositor;    // The slabs' stats are on the host already
+        ClearFrameStats();
+        if(preIntegrated && !slabCompositor && !cpuRenderer)
+        {
+            updatePreIntegration(transferOffset, transferScale, density, tstep);
+        }
+        if(slabCompositor)
+        {
+            RenderSlabs(d_output);
+        }
+        else if(cpuRenderer)
+        {
+            CpuFrameStats stats = { d_imageHist, d_visibilityHist, d_brickVisibility };
+            cpuRenderer->Render(CurrentCpuRenderParams(), width, height, d_output, d_volumeDataHist, BIN_COUNT, &stats);
+        }
+        else if(useSampleCache)
+        {
+            // Only re-march when the rays themselves have changed
+            SampleCacheState& state = sampleCacheState[sampleCacheSlot];
+            if(!state.valid || memcmp(state.invViewMatrix, invViewMatrix, sizeof(invViewMatrix)) != 0 ||
+               state.tstep != tstep || state.linearFiltering != linearFiltering ||
+               state.width != width || state.height != height)
+            {
+                state.valid = captureSampleCache(sampleCacheSlot, gridSize, blockSize, width, height, tstep);
+                memcpy(state.invViewMatrix, invViewMatrix, sizeof(invViewMatrix));
+                state.tstep = tstep;
+                state.linearFiltering = linearFiltering;
+                state.width = width;
+                state.height = height;
+            }
+            if(state.valid)
+            {
+                render_from_sample_cache(sampleCacheSlot, gridSize, blockSize, d_output, width, height,
+                                         density, brightness, transferOffset, transferScale,
+                                         d_volumeDataHist, histSize, preIntegrated, d_imageHist, d_visibilityHist, d_brickVisibility, tstep);
+            }
+            else
+            {
+                // No room on the device for this view's capture - march it directly, and from now on
+                fprintf(stderr, "Not enough device memory for a %ux%u sample cache, turning it off\n", width, height);
+                useSampleCache = false;
+                render_kernel(gridSize, blockSize, d_output, width, height, density, brightness, transferOffset, transferScale,
+                              d_volumeDataHist, histSize, tstep, preIntegrated, d_imageHist, d_visibilityHist, d_brickVisibility,
+                              1, false, -1, frameStats->Stream());
+            }
+        }
+        else
+        {
+            // Colour and stats from the one march, unless the stats have a grid of their own
+            uint *statsOutput = d_output;
+            uint statsW = width, statsH = height;
+            dim3 statsGrid = gridSize;
+            if(HasStatsPass())
+            {
+                RenderColour(d_output);
+                statsOutput = nullptr;
+                statsW = statsGridWidth;
+                statsH = statsGridHeight;
+                statsGrid = statsGridSize;
+            }
+
+            if(subsampleTolerance > 0.f)
+            {
+                RenderSubsampled(statsOutput, statsW, statsH, statsGrid);
+                readBack = false;   // Every batch was read back already
+            }
+            else
+            {
+                render_kernel(statsGrid, blockSize, statsOutput, statsW, statsH, density, brightness, transferOffset, transferScale,
+                              d_volumeDataHist, histSize, tstep, preIntegrated, d_imageHist, d_visibilityHist, d_brickVisibility,
+                              1, false, -1, frameStats->Stream());
+            }
+        }
+        if(readBack)
+        {
+            ReadBackFrameStats();
+        }
+        sdkStopTimer(&marchTimer);
+
+        ComputeFrameEntropies();
+        if(cacheable && raysMarched == 1.f)     // An estimate would stand in for the exact MI
+        {
+            StoreFrameInCache(cacheKey, pVolumeDataHist, BIN_COUNT);
+        }
+    }
+}
+
+// Everything kept of a finished frame, marched at the given view - the MI and the rest are
+// whatever ComputeFrameEntropies left
+void RecordFrame(float3 rotation, float3 translation, size_t step, size_t generation)
+{
+    if(seriesCSV)
+    {
+        fprintf(seriesCSV, "%zu,%f,%f,%f,%f\n", step, rotation.x, rotation.y, translation.z, mutualInformation);
+    }
+
+    if(LOG_FLAG)
+    {
+        if(!sweepShard)
+        {
+            sweepShard = sweepResults.AcquireShard();
+        }
+        SweepResult result = { rotation.x, rotation.y, translation.z, mutualInformation };
+        sweepResults.Submit(sweepShard, result);
+
+        // Lets record the whole dump the frame to CSV too, we just need the rotation and MI for now
+        FILE* runCSV; 
+        if(!LOG_FILE_WRITTEN)
+        {
+            runCSV = std::fopen("./data/Sampling/FullRun.csv", "w+");
+            LOG_FILE_WRITTEN = true;
+        }
+        else
+        {
+            runCSV = std::fopen("./data/Sampling/FullRun.csv", "a+");
+        }
+        if(subsampleTolerance > 0.f)
+        {
+            fprintf(runCSV, "%f,%f,%f,%f,%f,\n", rotation.x, rotation.y, mutualInformation, miHalfWidth, raysMarched);
+        }
+        else
+        {
+            fprintf(runCSV, "%f,%f,%f,\n", rotation.x, rotation.y, mutualInformation);
+        }
+        std::fclose(runCSV); 
+
+        if(outputFile && outputFile->is_open())
+        {
+            *outputFile << rotation.x << "," << rotation.y << "," << translation.z << "," << mutualInformation << "," << std::endl;
+        }
+    }
+
+    // for the sake of ease, the timestep is just zero. A coarse progressive pass's MI is only a
+    // preview, so the server waits for the pass that converges.
+    if(serverLink && generation == serverGeneration && progressivePass <= 1)
+    {
+        float message[5] = { 0.f, rotation.x, rotation.y, translation.z, mutualInformation };
+        serverLink->Send(message);
+    }
+}
+
+void InitFramePipeline()
+{
+    checkCudaErrors(cudaStreamCreateWithFlags(&pipelineStream, cudaStreamNonBlocking));
+    checkCudaErrors(cudaEventCreateWithFlags(&pipelineShown, cudaEventDisableTiming));
+    frameSlots.resize(pipelineDepth);
+    for(size_t i = 0; i < frameSlots.size(); ++i)
+    {
+        FrameSlot& slot = frameSlots[i];
+        slot.d_image = nullptr;
+        slot.imageSize = 0;
+        slot.busy = false;
+        slot.stats = new HistogramReadback(pipelineStream);
+        AddFrameStatBuffers(slot.stats);
+    }
+}
+
+void FreeFramePipeline()
+{
+    for(size_t i = 0; i < frameSlots.size(); ++i)
+    {
+        FrameSlot& slot = frameSlots[i];
+        cudaFree(slot.d_image);
+        delete slot.stats;
+    }
+    frameSlots.clear();
+    cudaFree(d_shownImage);
+    d_shownImage = nullptr;
+    shownImageSize = 0;
+    shownWidth = shownHeight = 0;
+    if(pipelineShown)
+    {
+        cudaEventDestroy(pipelineShown);
+        pipelineShown = 0;
+    }
+    if(pipelineStream)
+    {
+        cudaStreamDestroy(pipelineStream);
+        pipelineStream = 0;
+    }
+}
+
+// Finishes a frame in flight: waits for it, works out its MI and records it, and keeps its
+// picture as the one to show. Everything is at the slot's own bin count and size - the globals
+// may have moved on.
+void RetireFrame(FrameSlot& slot)
+{
+    slot.stats->Wait();
+    if(slot.cacheHit)
+    {
+        TakeCachedEntropies(slot.cached);
+        shownVolumeHist = slot.cached.histogram;
+    }
+    else
+    {
+        uint *volumeHist = (uint *)slot.stats->Host(VOLUME_HIST_BUFFER);
+        ComputeFrameEntropies(volumeHist, (uint *)slot.stats->Host(IMAGE_HIST_BUFFER),
+                              (const float *)slot.stats->Host(VISIBILITY_BUFFER), nullptr, slot.binCount);
+        if(slot.cacheable)
+        {
+            StoreFrameInCache(slot.cacheKey, volumeHist, slot.binCount);
+        }
+        shownVolumeHist.assign(volumeHist, volumeHist + slot.binCount);
+    }
+
+    // On pipelineStream, so the slot's next march is queued behind the copy
+    size_t pixels = (size_t)slot.width*slot.height;
+    if(shownImageSize < pixels)
+    {
+        checkCudaErrors(cudaFree(d_shownImage));
+        checkCudaErrors(cudaMalloc(&d_shownImage, pixels*sizeof(uint)));
+        shownImageSize = pixels;
+    }
+    checkCudaErrors(cudaMemcpyAsync(d_shownImage, slot.d_image, pixels*sizeof(uint), cudaMemcpyDeviceToDevice, pipelineStream));
+    shownWidth  = slot.width;
+    shownHeight = slot.height;
+
+    miHalfWidth = 0.f;
+    raysMarched = 1.f;
+    RecordFrame(slot.rotation, slot.translation, slot.seriesStep, slot.generation);
+    slot.busy = false;
+}
+
+// Finishes every frame in flight, oldest first. False if there were none.
+bool DrainPipeline()
+{
+    bool retired = false;
+    for(size_t i = 0; i < frameSlots.size(); ++i)
+    {
+        FrameSlot& slot = frameSlots[(nextFrameSlot + i) % frameSlots.size()];
+        if(slot.busy)
+        {
+            RetireFrame(slot);
+            retired = true;
+        }
+    }
+    return retired;
+}
+
+// The last finished frame into the PBO - or black, before there is one at this size, since the
+// PBO is mapped write-discard. Stream 0, which the unmap and any -record readback are on, waits.
+void ShowPipelined(uint *d_output)
+{
+    size_t bytes = (size_t)width*height*sizeof(uint);
+    if(shownWidth == width && shownHeight == height)
+    {
+        checkCudaErrors(cudaMemcpyAsync(d_output, d_shownImage, bytes, cudaMemcpyDeviceToDevice, pipelineStream));
+    }
+    else
+    {
+        checkCudaErrors(cudaMemsetAsync(d_output, 0, bytes, pipelineStream));
+    }
+    checkCudaErrors(cudaEventRecord(pipelineShown, pipelineStream));
+    checkCudaErrors(cudaStreamWaitEvent(0, pipelineShown, 0));
+}
+
+// Queues the current view's march into the slot, and the copies of its histograms behind it,
+// without waiting on any of it. A cache hit is still marched, for colour alone.
+void LaunchFrame(FrameSlot& slot)
+{
+    slot.rotation   = viewRotation;
+    slot.translation = viewTranslation;
+    slot.seriesStep = seriesStep;
+    slot.generation = serverGeneration;
+    slot.binCount   = BIN_COUNT;
+    slot.width      = width;
+    slot.height     = height;
+    slot.busy       = true;
+    slot.cacheable  = IsFrameCacheable();
+    if(slot.cacheable)
+    {
+        slot.cacheKey = FrameCacheKey();
+    }
+    slot.cacheHit = slot.cacheable && miCache->Lookup(slot.cacheKey, &slot.cached);
+
+    sdkStartTimer(&marchTimer);
+    size_t pixels = (size_t)width*height;
+    if(slot.imageSize < pixels)
+    {
+        checkCudaErrors(cudaFree(slot.d_image));
+        checkCudaErrors(cudaMalloc(&slot.d_image, pixels*sizeof(uint)));
+        slot.imageSize = pixels;
+    }
+
+    copyInvViewMatrix(invViewMatrix, sizeof(float4)*3, pipelineStream);
+    if(preIntegrated)
+    {
+        updatePreIntegration(transferOffset, transferScale, density, tstep);
+    }
+    checkCudaErrors(cudaMemsetAsync(slot.d_image, 0, pixels*sizeof(uint), pipelineStream));
+    if(slot.cacheHit)
+    {
+        render_kernel(gridSize, blockSize, slot.d_image, width, height, density, brightness, transferOffset, transferScale,
+                      nullptr, histSize, tstep, preIntegrated, nullptr, nullptr, nullptr, 1, false, -1, pipelineStream);
+        getLastCudaError("kernel failed");
+        slot.stats->Record();
+        sdkStopTimer(&marchTimer);
+        return;
+    }
+
+    ClearFrameStats(slot.stats);
+    uint *d_volumeHist = (uint *)slot.stats->Device(VOLUME_HIST_BUFFER);
+    uint *d_slotImageHist = (uint *)slot.stats->Device(IMAGE_HIST_BUFFER);
+    float *d_visibility = (float *)slot.stats->Device(VISIBILITY_BUFFER);
+
+    if(HasStatsPass())
+    {
+        render_kernel(gridSize, blockSize, slot.d_image, width, height, density, brightness, transferOffset, transferScale,
+                      nullptr, histSize, tstep, preIntegrated, nullptr, nullptr, nullptr, 1, false, -1, pipelineStream);
+        render_kernel(statsGridSize, blockSize, nullptr, statsGridWidth, statsGridHeight, density, brightness, transferOffset, transferScale,
+                      d_volumeHist, histSize, tstep, preIntegrated, d_slotImageHist, d_visibility, nullptr,
+                      1, false, -1, pipelineStream);
+    }
+    else
+    {
+        render_kernel(gridSize, blockSize, slot.d_image, width, height, density, brightness, transferOffset, transferScale,
+                      d_volumeHist, histSize, tstep, preIntegrated, d_slotImageHist, d_visibility, nullptr,
+                      1, false, -1, pipelineStream);
+    }
+    getLastCudaError("kernel failed");
+
+    DownloadFrameStats(slot.stats);
+    slot.stats->Record();
+    sdkStopTimer(&marchTimer);
+}
+
+// One frame of -pipeline: the oldest frame in flight is finished and shown in d_output, and the
+// current view launched into its slot. False when none finished, and d_output shows the last
+// one that did.
+bool RenderPipelined(uint *d_output)
+{
+    if(frameSlots.empty())
+    {
+        InitFramePipeline();
+    }
+
+    // The frames in flight need the raw histogram, tables and volume they were marched with
+    ProgressiveState state = CurrentProgressiveState();
+    memset(state.invViewMatrix, 0, sizeof(state.invViewMatrix));
+    bool shown = false;
+    if(memcmp(&state, &pipelineState, sizeof(ProgressiveState)) != 0)
+    {
+        shown = DrainPipeline();
+        pipelineState = state;
+    }
+
+    histSize = sizeof(uint)*BIN_COUNT;
+    if(rawHistBinCount != BIN_COUNT)
+    {
+        BinRawValueCounts();
+        rawHistBinCount = BIN_COUNT;
+    }
+
+    FrameSlot& slot = frameSlots[nextFrameSlot];
+    if(slot.busy)
+    {
+        RetireFrame(slot);
+        shown = true;
+    }
+    ShowPipelined(d_output);
+    LaunchFrame(slot);
+    nextFrameSlot = (nextFrameSlot + 1) % frameSlots.size();
+    return shown;
+}
+
+void* AllocatePinned(size_t bytes)
+{
+    void* memory = nullptr;
+    checkCudaErrors(cudaMallocHost(&memory, bytes));
+    return memory;
+}
+
+void FreePinned(void* memory)
+{
+    cudaFreeHost(memory);
+}
+
+// Hands the frames whose copies have landed to the exporter, waiting on the oldest while more
+// than inFlight are outstanding
+void SubmitExports(size_t inFlight)
+{
+    while(!pendingExports.empty())
+    {
+        PendingExport pending = pendingExports.front();
+        cudaError_t status = (pendingExports.size() > inFlight) ? cudaEventSynchronize(pending.copied)
+                                                                : cudaEventQuery(pending.copied);
+        if(status == cudaErrorNotReady)
+        {
+            break;
+        }
+
+        if(status == cudaSuccess)
+        {
+            frameExporter->Submit(pending.frame);
+        }
+        else
+        {
+            fprintf(stderr, "Frame readback failed: %s\n", cudaGetErrorString(status));
+            frameExporter->Discard(pending.frame);
+        }
+        cudaEventDestroy(pending.copied);
+        pendingExports.pop_front();
+    }
+}
+
+// Queues a copy of the frame just rendered, on the stream the PBO's unmap is ordered behind
+void ExportFrame(const uint *d_output)
+{
+    SubmitExports(1);
+
+    PendingExport pending;
+    pending.frame = frameExporter->Acquire(width, height);
+    checkCudaErrors(cudaEventCreateWithFlags(&pending.copied, cudaEventDisableTiming));
+    checkCudaErrors(cudaMemcpyAsync(pending.frame->pixels, d_output, width*height*sizeof(uint), cudaMemcpyDeviceToHost, 0));
+    checkCudaErrors(cudaEventRecord(pending.copied, 0));
+    pendingExports.push_back(pending);
+}
+
+// render image using CUDA
+void render()
+{
+    // map PBO to get CUDA device pointer
+    uint *d_output;
+    // map PBO to get CUDA device pointer
+    checkCudaErrors(cudaGraphicsMapResources(1, &cuda_pbo_resource, 0));
+    size_t num_bytes;
+    checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void **)&d_output, &num_bytes,
+                                                         cuda_pbo_resource));
+    //printf("CUDA mapped PBO: May access %ld bytes\n", num_bytes);
+
+    // Pipelined, what's shown is the oldest frame in flight - black until the first is through
+    bool shown = true;
+    if(pipelineDepth)
+    {
+        shown = RenderPipelined(d_output);
+    }
+    else
+    {
+        renderFrame(d_output);
+        RecordFrame(viewRotation, viewTranslation, seriesStep, serverGeneration);
+    }
+
+    if(frameExporter && shown)
+    {
+        ExportFrame(d_output);
+    }
+    checkCudaErrors(cudaGraphicsUnmapResources(1, &cuda_pbo_resource, 0));
+
+    //std::cout << "Bin Count = " << BIN_COUNT << " | Raw entropy = " << entropyA << " | Volume Entropy = " << entropyB << " | Joint Entropy = " << jointEntropy << " | MI = " << mutualInformation << std::endl;
+}
+
+// display results using OpenGL (called by GLUT)
+void display()
+{    
+    sdkStartTimer(&timer);
+
+    buildInvViewMatrix();
+
+    render();
+
+    // display results
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // draw image from PBO
+    glDisable(GL_DEPTH_TEST);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    // draw using texture
+    // copy from pbo to texture
+    glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pbo);
+    glBindTexture(GL_TEXTURE_2D, _tex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0.0, 1.0, 0.0, 1.0, -100.0, 100.0);
+
+    // draw textured quad
+    glEnable(GL_TEXTURE_2D);
+    glBegin(GL_TRIANGLE_STRIP);
+        glColor3f(1,1,1);
+        glTexCoord2f(0, 0);
+        glVertex2f(0, 0);
+        glTexCoord2f(1, 0);
+        glVertex2f(1, 0);
+        glTexCoord2f(0, 1);
+        glVertex2f(0, 1);
+        glTexCoord2f(1, 1);
+        glVertex2f(1, 1);
+    glEnd();
+
+    glDisable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glScalef(0.07, 0.5, 1.0);
+    glBegin(GL_TRIANGLE_STRIP);
+        glColor3f(1,0,0);
+        glVertex2f(0.1, ((0.9-0.1)/(6))*1);
+        glVertex2f(1,   ((0.9-0.1)/(6))*1);
+        
+        glColor3f(1,0.5,0);
+        glVertex2f(0.1, ((0.9-0.1)/(6))*2);
+        glVertex2f(1,   ((0.9-0.1)/(6))*2);
+
+        glColor3f(1,1,0);
+        glVertex2f(0.1, ((0.9-0.1)/(6))*3);
+        glVertex2f(1,   ((0.9-0.1)/(6))*3);
+
+        glColor3f(0,1,0);
+        glVertex2f(0.1, ((0.9-0.1)/(6))*4);
+        glVertex2f(1,   ((0.9-0.1)/(6))*4);
+
+        glColor3f(0,1,1);
+        glVertex2f(0.1, ((0.9-0.1)/(6))*5);
+        glVertex2f(1,   ((0.9-0.1)/(6))*5);
+
+        glColor3f(0,0,1);
+        glVertex2f(0.1, ((0.9-0.1)/(6))*6);
+        glVertex2f(1,   ((0.9-0.1)/(6))*6);
+
+        glColor3f(1,0,1);
+        glVertex2f(0.1, ((0.9-0.1)/(6))*7);
+        glVertex2f(1,   ((0.9-0.1)/(6))*7);
+    glEnd();
+
+
+    // Pipelined, the bars are the shown frame's, not the one just launched
+    const uint *bars = pipelineDepth ? shownVolumeHist.data() : pVolumeDataHist;
+    size_t barCount = pipelineDepth ? shownVolumeHist.size() : BIN_COUNT;
+    if(bars != nullptr && barCount > 0)
+    {
+        // These shouldn't really be hardcoded but...
+        float bottom = 0.1f, top = 0.9f;
+        float difference = top - bottom;
+        float step = difference / barCount;
+        for(size_t i = 0; i < barCount; ++i)
+        {
+            float barY = 0.137f + (step * i);
+            glLineWidth(4.0f);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); 
+            glEnable( GL_BLEND ); 
+
+            glBegin(GL_LINES);
+                glColor4f(1.f, 1.f, 1.f, 1.f); 
+                glVertex2f(1.f, barY);
+                glVertex2f((float)bars[i]*scale + 1.f, barY);
+            glEnd();
+        }
+    }
+
+    glPopMatrix();
+
+    glClearColor(.5f, .5, .5f, 1.0f);
+    glutSwapBuffers();
+    glutReportErrors();
+
+    sdkStopTimer(&timer);
+
+    computeFPS();
+}
+
+void DisplayStatsWindow()
 {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	//glClear(GL_COLOR_BUFFER_BIT);
@@ -570,16 +1519,11 @@ void DisplayStatsWindow()
 
 void idle()
 {
-    entropyHelper->GetEntropy(pVolumeDataHist, pRawDataHist, BIN_COUNT, &entropyA, &entropyB, &jointEntropy, &mutualInformation);
+    // The MI is already worked out by renderFrame, along with the frame it belongs to
    // std::cout << "Raw entropy = " << entropyA << " | Volume Entropy = " << entropyB << " | Joint Entropy = " << jointEntropy << " | MI = " << mutualInformation << std::endl;
     //std::cout << viewRotation.x << "," << viewRotation.y << "," << viewTranslation.z << "," << mutualInformation << "," << std::endl;
     if(LOG_FLAG)
     {
-        if(outputFile->is_open())
-        {
-            *outputFile << viewRotation.x << "," << viewRotation.y << "," << viewTranslation.z << "," << mutualInformation << "," << std::endl;
-        }
-
         if(viewRotation.y++ > 360.f)
         {
             viewRotation.x++;
@@ -589,15 +1533,43 @@ void idle()
 
         if(viewRotation.x > 360.f)
         {
+            // The last few views are still in flight
+            DrainPipeline();
+
             // sanity check
             if(outputFile->is_open())
                 outputFile->close();
+
+            SweepSummary summary = sweepResults.Snapshot();
+            summary.Save("./data/Sampling/SweepSummary.csv");
+            if(summary.count > 0)
+            {
+                printf("Sweep done: %llu views, best MI = %f\n", (unsigned long long)summary.count, sweepResults.BestMI());
+            }
+            else
+            {
+                printf("Sweep done: no views\n");
+            }
             exit(EXIT_SUCCESS);
         }
     }
 
-    if(!serverFailed)
-        SendToServer();
+    // The pose the server wants next, once it has answered the last frame
+    float pose[3];
+    if(serverLink && serverLink->TakeReply(pose))
+    {
+        viewRotation.x = pose[0];
+        viewRotation.y = pose[1];
+        viewTranslation.z = pose[2];
+        ++serverGeneration;
+    }
+
+    // Next timestep for the next frame - normally already sitting in memory
+    if(volumeSeries && seriesPlaying)
+    {
+        LoadSeriesStep(seriesStep + 1);
+    }
+
     for(GLint i = 0; i < 2; ++i)
     {
         glutSetWindow(windowID[i]);
@@ -605,6 +1577,395 @@ void idle()
     }
 }
 
+// Batch search over offset/scale/density maximising the mean MI over a few views.
+// Views come from a "rotX,rotY,zoom" per line file, or default to the current view.
+void RunTransferOptimisation(const char *viewsFile, size_t maxEvaluations)
+{
+    std::vector<float3> views;
+    if(viewsFile)
+    {
+        FILE* fp = std::fopen(viewsFile, "r");
+        float3 view;
+        while(fp && fscanf(fp, " %f,%f,%f", &view.x, &view.y, &view.z) == 3)
+        {
+            views.push_back(view);
+        }
+        if(fp)
+        {
+            std::fclose(fp);
+        }
+    }
+    if(views.empty())
+    {
+        views.push_back(make_float3(viewRotation.x, viewRotation.y, viewTranslation.z));
+    }
+
+    uint *d_output;
+    checkCudaErrors(cudaMalloc(&d_output, width*height*4));
+    FILE* runCSV = std::fopen("TransferOptimisation.csv", "w");
+
+    // The views never move, so after the first evaluation each one is just a re-composite of its
+    // sample capture. Every evaluation also lands in the MI cache, so -cache makes reruns free.
+    bool sampleCacheWasOn = useSampleCache;
+    useSampleCache = true;
+
+    TransferOptimiser::Objective objective = [&](const TransferParams& params)
+    {
+        transferOffset  = params.transferOffset;
+        transferScale   = params.transferScale;
+        density         = params.density;
+
+        float total = 0.f;
+        for(size_t i = 0; i < views.size(); ++i)
+        {
+            viewRotation.x = views[i].x;
+            viewRotation.y = views[i].y;
+            viewTranslation.z = views[i].z;
+            buildInvViewMatrix();
+            sampleCacheSlot = i % SAMPLE_CACHE_SLOTS;
+            renderFrame(d_output);
+            total += mutualInformation;
+        }
+
+        float meanMI = total / views.size();
+        if(runCSV)
+        {
+            fprintf(runCSV, "%f,%f,%f,%f\n", transferOffset, transferScale, density, meanMI);
+        }
+        return meanMI;
+    };
+
+    TransferParams lower = { -1.f, 0.1f, 0.001f };
+    TransferParams upper = { 1.f, 10.f, 1.f };
+    TransferParams step  = { 0.1f, 0.25f, 0.02f };
+    TransferParams start = { transferOffset, transferScale, density };
+    TransferOptimiser optimiser(lower, upper, step);
+
+    float bestMI = 0.f;
+    TransferParams best = optimiser.Optimise(start, objective, maxEvaluations, 1.f/64.f, &bestMI);
+    printf("Best transfer function over %zu view(s): offset %f, scale %f, density %f -> mean MI %f (%zu renders, %zu revisits)\n",
+           views.size(), best.transferOffset, best.transferScale, best.density, bestMI,
+           optimiser.Evaluations(), optimiser.MemoHits());
+
+    if(runCSV)
+    {
+        std::fclose(runCSV);
+    }
+    checkCudaErrors(cudaFree(d_output));
+    useSampleCache  = sampleCacheWasOn;
+    sampleCacheSlot = 0;
+    transferOffset  = best.transferOffset;
+    transferScale   = best.transferScale;
+    density         = best.density;
+}
+
+// Headless check of a fixed set of views against reference images and MI values, with the time
+// spent in each stage. Poses are "rotX,rotY,zoom[,MI[,reference.ppm]]" per line ('#' comments),
+// and the run writes the same format back out as <name>.csv next to its <name>_NNN.ppm images,
+// so one run's output is the next one's reference. With no poses file it checks just the current
+// view against singleReference (-file). Returns how many views failed.
+int RunRegression(const char *posesFile, const char *singleReference, const char *name,
+                  float miTolerance, int repeats, float loadTime)
+{
+    struct RegressionPose
+    {
+        float3      view;
+        bool        hasMI;
+        float       mutualInformation;
+        std::string reference;
+    };
+
+    std::vector<RegressionPose> poses;
+    if(posesFile)
+    {
+        FILE* fp = std::fopen(posesFile, "r");
+        if(!fp)
+        {
+            fprintf(stderr, "Error opening regression poses '%s'\n", posesFile);
+            return 1;
+        }
+
+        char line[1024];
+        while(fgets(line, sizeof(line), fp))
+        {
+            RegressionPose pose;
+            char reference[512] = "";
+            int fields = sscanf(line, " %f,%f,%f,%f,%511[^,\r\n]", &pose.view.x, &pose.view.y, &pose.view.z,
+                                &pose.mutualInformation, reference);
+            if(line[0] == '#' || fields < 3)
+            {
+                continue;
+            }
+            pose.hasMI = fields >= 4;
+            pose.reference = reference;
+            poses.push_back(pose);
+        }
+        std::fclose(fp);
+    }
+    else
+    {
+        RegressionPose pose = { make_float3(viewRotation.x, viewRotation.y, viewTranslation.z), false, 0.f, singleReference };
+        poses.push_back(pose);
+    }
+
+    std::vector<uint> image(width*height);
+    uint *d_output = image.data();
+    if(!cpuRenderer)
+    {
+        checkCudaErrors(cudaMalloc(&d_output, width*height*4));
+    }
+
+    // A cache hit would leave the image from the previous view in place
+    MICache *cache = miCache;
+    miCache = nullptr;
+
+    StopWatchInterface *readbackTimer = 0, *compareTimer = 0;
+    sdkCreateTimer(&marchTimer);
+    sdkCreateTimer(&miTimer);
+    sdkCreateTimer(&readbackTimer);
+    sdkCreateTimer(&compareTimer);
+
+    std::string csvName = std::string(name) + ".csv";
+    FILE* runCSV = std::fopen(csvName.c_str(), "w");
+    int failures = 0;
+    for(size_t i = 0; i < poses.size(); ++i)
+    {
+        viewRotation.x = poses[i].view.x;
+        viewRotation.y = poses[i].view.y;
+        viewTranslation.z = poses[i].view.z;
+        buildInvViewMatrix();
+        for(int r = 0; r < repeats; ++r)
+        {
+            renderFrame(d_output);
+        }
+
+        sdkStartTimer(&readbackTimer);
+        if(!cpuRenderer)
+        {
+            checkCudaErrors(cudaMemcpy(image.data(), d_output, width*height*4, cudaMemcpyDeviceToHost));
+        }
+        sdkStopTimer(&readbackTimer);
+
+        // The single view check keeps the sample's file names
+        char imageFile[512];
+        if(posesFile)
+        {
+            snprintf(imageFile, sizeof(imageFile), "%s_%03zu.ppm", name, i);
+        }
+        else
+        {
+            snprintf(imageFile, sizeof(imageFile), "%s", sOriginal[0]);
+        }
+
+        sdkStartTimer(&compareTimer);
+        sdkSavePPM4ub(imageFile, (unsigned char *)image.data(), width, height);
+        bool imagePassed = poses[i].reference.empty() ||
+                           sdkComparePPM(imageFile, poses[i].reference.c_str(), MAX_EPSILON_ERROR, THRESHOLD, false);
+        sdkStopTimer(&compareTimer);
+        bool miPassed = !poses[i].hasMI || std::fabs(mutualInformation - poses[i].mutualInformation) <= miTolerance;
+
+        printf("View %zu (%g, %g, %g): MI %f", i, poses[i].view.x, poses[i].view.y, poses[i].view.z, mutualInformation);
+        if(poses[i].hasMI)
+        {
+            printf(" vs %f", poses[i].mutualInformation);
+        }
+        if(!poses[i].reference.empty())
+        {
+            printf(", image vs '%s'", poses[i].reference.c_str());
+        }
+        printf(", image entropy %f, view entropy %f", imageEntropy[IMAGE_HISTOGRAM_CHANNELS - 1], viewEntropy);
+        if(pBrickVisibility)
+        {
+            printf(", brick view entropy %f", brickViewEntropy);
+        }
+        printf(" -> %s\n", (imagePassed && miPassed) ? "PASS" : "FAIL");
+        failures += (imagePassed && miPassed) ? 0 : 1;
+
+        if(runCSV)
+        {
+            fprintf(runCSV, "%f,%f,%f,%f,%s\n", poses[i].view.x, poses[i].view.y, poses[i].view.z, mutualInformation, imageFile);
+        }
+    }
+
+    float frames = (float)(poses.size()*repeats);
+    printf("%s regression: %zu view(s), %d failed (MI tolerance %g, image epsilon %g, threshold %g%%)\n",
+           cpuRenderer ? "CPU" : "CUDA", poses.size(), failures, miTolerance, MAX_EPSILON_ERROR, THRESHOLD*100.f);
+    printf("Timings (ms): load %.2f | march %.2f (%.3f/frame) | MI %.2f (%.3f/frame) | readback %.2f | write+compare %.2f\n",
+           loadTime, sdkGetTimerValue(&marchTimer), sdkGetTimerValue(&marchTimer)/frames,
+           sdkGetTimerValue(&miTimer), sdkGetTimerValue(&miTimer)/frames,
+           sdkGetTimerValue(&readbackTimer), sdkGetTimerValue(&compareTimer));
+
+    if(runCSV)
+    {
+        std::fclose(runCSV);
+    }
+    sdkDeleteTimer(&marchTimer);
+    sdkDeleteTimer(&miTimer);
+    sdkDeleteTimer(&readbackTimer);
+    sdkDeleteTimer(&compareTimer);
+    if(!cpuRenderer)
+    {
+        checkCudaErrors(cudaFree(d_output));
+    }
+    miCache = cache;
+    return failures;
+}
+
+// Plug-in MI of two histograms in doubles, as GetEntropy works it out
+double ReferenceMI(const uint *a, const uint *b, size_t bins)
+{
+    double totalA = std::accumulate(a, a + bins, 0.0), totalB = std::accumulate(b, b + bins, 0.0);
+    double ha = 0.0, hb = 0.0, joint = 0.0;
+    for(size_t i = 0; i < bins; ++i)
+    {
+        double pa = (totalA > 0.0) ? a[i]/totalA : 0.0, pb = (totalB > 0.0) ? b[i]/totalB : 0.0;
+        ha -= (pa > 0.0) ? pa*std::log2(pa) : 0.0;
+        hb -= (pb > 0.0) ? pb*std::log2(pb) : 0.0;
+        joint -= (pa + pb > 0.0) ? (pa + pb)*std::log2(pa + pb) : 0.0;
+    }
+    return ha + hb - joint;
+}
+
+// Checks the frame just rendered at this bin count against the same view at MAX_BIN_COUNT:
+// every sample binned exactly once, the raw histogram holding every voxel, the finest histogram
+// folding down onto this one when the bin count divides it, and the MI agreeing with ReferenceMI.
+// Prints what's wrong, returns how many checks failed.
+int CheckBinning(const std::vector<uint>& finest, uint64_t voxels)
+{
+    int failures = 0;
+    double samples = std::accumulate(pVolumeDataHist, pVolumeDataHist + BIN_COUNT, 0.0);
+    double expected = std::accumulate(finest.begin(), finest.end(), 0.0);
+    bool everyRay = raysMarched == 1.f;     // -subsample can stop on a different batch at each count
+    if(everyRay && samples != expected)
+    {
+        printf("%8zu FAIL: %.0f samples binned, %.0f at %zu bins\n", BIN_COUNT, samples, expected, MAX_BIN_COUNT);
+        ++failures;
+    }
+
+    double raw = std::accumulate(pRawDataHist, pRawDataHist + BIN_COUNT, 0.0);
+    if(raw != (double)voxels)
+    {
+        printf("%8zu FAIL: raw histogram holds %.0f of %llu voxels\n", BIN_COUNT, raw, (unsigned long long)voxels);
+        ++failures;
+    }
+
+    // Binning is floor(sample*bins), so with a power of two ratio the fine bins nest exactly
+    if(everyRay && MAX_BIN_COUNT % BIN_COUNT == 0)
+    {
+        size_t ratio = MAX_BIN_COUNT / BIN_COUNT;
+        for(size_t bin = 0; bin < BIN_COUNT; ++bin)
+        {
+            uint folded = std::accumulate(finest.begin() + bin*ratio, finest.begin() + (bin + 1)*ratio, 0u);
+            if(folded != pVolumeDataHist[bin])
+            {
+                printf("%8zu FAIL: bin %zu holds %u, the finest histogram folds to %u\n", BIN_COUNT, bin, pVolumeDataHist[bin], folded);
+                ++failures;
+                break;
+            }
+        }
+    }
+
+    if(!std::isfinite(mutualInformation))
+    {
+        printf("%8zu FAIL: MI is %f\n", BIN_COUNT, mutualInformation);
+        ++failures;
+    }
+    else if(miEstimator == ESTIMATOR_PLUGIN)
+    {
+        double reference = ReferenceMI(pVolumeDataHist, pRawDataHist, BIN_COUNT);
+        if(std::fabs(mutualInformation - reference) > 1e-3)
+        {
+            printf("%8zu FAIL: MI %f, reference %f\n", BIN_COUNT, mutualInformation, reference);
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+// Headless throughput of the current view's march and MI at each of a comma separated list of
+// bin counts. The samples are those binned, so the rate is the march's with its histogram atomics
+// included - more bins spread the atomics out, fewer make them collide.
+// Each count's frame is checked with CheckBinning first. Returns the failures.
+int RunBinBenchmark(const char *binCounts, int repeats)
+{
+    std::vector<uint> image(width*height);
+    uint *d_output = image.data();
+    if(!cpuRenderer)
+    {
+        checkCudaErrors(cudaMalloc(&d_output, width*height*4));
+    }
+
+    // Every frame has to march
+    MICache *cache = miCache;
+    miCache = nullptr;
+
+    // The view at the finest bin count, for CheckBinning
+    BIN_COUNT = MAX_BIN_COUNT;
+    renderFrame(d_output);
+    std::vector<uint> finest(pVolumeDataHist, pVolumeDataHist + MAX_BIN_COUNT);
+    uint64_t voxels = std::accumulate(rawValueCounts.begin(), rawValueCounts.end(), (uint64_t)0);
+    int failures = 0;
+
+    printf("%8s %14s %12s %12s %10s\n", "bins", "march ms/frame", "MI ms/frame", "Msamples/s", "MI");
+    std::string list(binCounts);
+    for(size_t start = 0, end; start < list.size(); start = end + 1)
+    {
+        end = std::min(list.find(',', start), list.size());
+        size_t bins = strtoul(list.substr(start, end - start).c_str(), nullptr, 10);
+        if(bins < MIN_BIN_COUNT || bins > MAX_BIN_COUNT)
+        {
+            printf("%8zu skipped, outside %zu-%zu\n", bins, MIN_BIN_COUNT, MAX_BIN_COUNT);
+            continue;
+        }
+
+        // One untimed frame takes the raw histogram's rebin out of the timings, and is the one checked
+        BIN_COUNT = bins;
+        renderFrame(d_output);
+        failures += CheckBinning(finest, voxels);
+
+        sdkCreateTimer(&marchTimer);
+        sdkCreateTimer(&miTimer);
+        double samples = 0.0;
+        for(int r = 0; r < repeats; ++r)
+        {
+            renderFrame(d_output);
+            samples = std::accumulate(pVolumeDataHist, pVolumeDataHist + BIN_COUNT, samples);
+        }
+        float march = sdkGetTimerValue(&marchTimer);
+        printf("%8zu %14.3f %12.3f %12.1f %10f\n", bins, march/repeats, sdkGetTimerValue(&miTimer)/repeats,
+               (march > 0.f) ? samples/(march*1e3) : 0.0, mutualInformation);
+        sdkDeleteTimer(&marchTimer);
+        sdkDeleteTimer(&miTimer);
+    }
+
+    if(!cpuRenderer)
+    {
+        checkCudaErrors(cudaFree(d_output));
+    }
+    miCache = cache;
+    printf("%s\n", failures ? "Bin count checks FAILED" : "Bin count checks passed");
+    return failures;
+}
+
+// Reads the file from disk each time, so edits show up on the next 't'
+void LoadTransferFunction(size_t index)
+{
+    TransferFunction transferFunc;
+    if(transferFunc.Load(transferFuncFiles[index].c_str()))
+    {
+        if(cpuRenderer)
+        {
+            cpuRenderer->SetTransferFunction(transferFunc.Data(), transferFunc.Size());
+        }
+        else
+        {
+            setTransferFunction(transferFunc.Data(), transferFunc.Size());
+        }
+        transferFuncHash = MICache::HashBytes(transferFunc.Data(), transferFunc.Size()*sizeof(float4));
+        printf("Transfer function '%s', %zu entries\n", transferFuncFiles[index].c_str(), transferFunc.Size());
+    }
+}
+
 void keyboard(unsigned char key, int x, int y)
 {
     switch (key)
@@ -623,6 +1984,7 @@ void keyboard(unsigned char key, int x, int y)
             break;
 
         case 'f':
+            DrainPipeline();    // The frames in flight are sampling with the old mode
             linearFiltering = !linearFiltering;
             setTextureFilterMode(linearFiltering);
             break;
@@ -659,11 +2021,59 @@ void keyboard(unsigned char key, int x, int y)
             transferScale -= 0.01f;
             break;
         case 'q':
-            BIN_COUNT -= 32; 
+            DrainPipeline();    // The frames in flight are binned at the old count
+            // Unsigned, so clamped before subtracting
+            BIN_COUNT = std::max(BIN_COUNT, MIN_BIN_COUNT + BIN_COUNT_STEP) - BIN_COUNT_STEP;
             break;
         case 'w':
-            BIN_COUNT += 32;
-            break;  
+            DrainPipeline();
+            BIN_COUNT = std::min(BIN_COUNT + BIN_COUNT_STEP, MAX_BIN_COUNT);
+            break;
+        case 't':
+            if(!transferFuncFiles.empty())
+            {
+                transferFuncIndex = (transferFuncIndex + 1) % transferFuncFiles.size();
+                LoadTransferFunction(transferFuncIndex);
+            }
+            break;
+        case 'c':
+            useSampleCache = !useSampleCache && !pipelineDepth;
+            printf("Sample cache %s\n", useSampleCache ? "on" : "off");
+            break;
+        case 'p':
+            preIntegrated = !preIntegrated;
+            printf("Pre-integration %s, step %f\n", preIntegrated ? "on" : "off", tstep);
+            break;
+        case 'l':
+            if(gradientsLoaded)
+            {
+                DrainPipeline();
+                shaded = !shaded;
+                if(!cpuRenderer)
+                {
+                    setShading(shaded, &shading);
+                }
+            }
+            printf("Shading %s\n", (shaded && gradientsLoaded) ? "on" : "off (start with -shade)");
+            break;
+        case 's':
+            tstep = std::min(tstep * 2.f, 0.16f);
+            printf("Step %f\n", tstep);
+            break;
+        case 'a':
+            tstep = std::max(tstep * 0.5f, 0.0025f);
+            printf("Step %f\n", tstep);
+            break;
+        case 'n':
+            seriesPlaying = !seriesPlaying;
+            break;
+        case 'm':
+            if(volumeSeries)
+            {
+                LoadSeriesStep(seriesStep + 1);
+                printf("Timestep %zu '%s'\n", seriesStep, volumeSeries->File(seriesStep).c_str());
+            }
+            break;
         default:
             break;
     }
@@ -742,6 +2152,7 @@ void reshape(int w, int h)
 {
     if(glutGetWindow() == windowID[0])
     {
+        DrainPipeline();    // The frames in flight are at the old size
         width = w;
         height = h;
         initPixelBuffer();
@@ -764,7 +2175,25 @@ void cleanup()
 {
     sdkDeleteTimer(&timer);
 
-    freeCudaBuffers();
+    if(frameExporter)
+    {
+        SubmitExports(0);
+        frameExporter->Flush();
+        printf("Recorded %zu frame(s), %zu failed, %zu stalls waiting on the encoders\n",
+               frameExporter->Written(), frameExporter->Failed(), frameExporter->Stalls());
+        delete frameExporter;
+        frameExporter = nullptr;
+    }
+
+    delete serverLink;
+    serverLink = nullptr;
+
+    if(!cpuRenderer)
+    {
+        DrainPipeline();
+        FreeFramePipeline();
+        freeCudaBuffers();
+    }
 
     if (pbo)
     {
@@ -773,13 +2202,48 @@ void cleanup()
         glDeleteTextures(1, &_tex);
     }
 
-    checkCudaErrors(cudaFree(pVolumeDataHist));
+    delete frameStats;
+    frameStats = nullptr;
+    if(!cpuRenderer)
+    {
+        checkCudaErrors(cudaFree(d_progressiveImage));
+    }
     free(windowID);
-    delete pRawDataHist;
+    if(miCache)
+    {
+        printf("MI cache: %zu hits, %zu misses\n", miCache->Hits(), miCache->Misses());
+        delete miCache;
+    }
+    delete[] pRawDataHist;
+    pRawDataHist = nullptr;
+
+    if(slabCompositor)
+    {
+        slabCompositor->Shutdown();
+        delete slabCompositor;
+    }
+
+    if(volumeSeries)
+    {
+        printf("Volume series: %zu steps, waited on disk %zu times\n", volumeSeries->Steps(), volumeSeries->Stalls());
+        delete volumeSeries;
+    }
+    if(seriesCSV)
+    {
+        std::fclose(seriesCSV);
+    }
 
     if(LOG_FLAG || outputFile)
         delete outputFile; 
-    cudaDeviceReset();
+    if(cpuRenderer)
+    {
+        delete cpuRenderer;
+        cpuRenderer = nullptr;
+    }
+    else
+    {
+        cudaDeviceReset();
+    }
 }
 
 void initGL(int *argc, char **argv)
@@ -835,40 +2299,75 @@ void initPixelBuffer()
 void initHistgramBuffers()
 {
     // The raw data hist never needs to be sent to a kernel - we can just normally allocate it.
-    pRawDataHist = (unsigned int*)malloc(BIN_COUNT*sizeof(unsigned int));
-    pRawDataHist = new unsigned int[BIN_COUNT];
-    for(int i = 0; i < BIN_COUNT; ++i)
+    pRawDataHist = new unsigned int[BIN_COUNT]();
+
+    // Device memory the march adds into and pinned memory it is read back into - managed memory
+    // migrated its pages both ways every frame. The volume histogram is allocated for the largest
+    // bin count up front, 256KB, so changing the bin count never reallocates. The frame statistics
+    // are a fixed size, whatever it is.
+    frameStats = new HistogramReadback(cpuRenderer != nullptr);
+    AddFrameStatBuffers(frameStats);
+    pVolumeDataHist     = (uint *)frameStats->Host(VOLUME_HIST_BUFFER);
+    pImageHist          = (uint *)frameStats->Host(IMAGE_HIST_BUFFER);
+    pVisibilityHist     = (float *)frameStats->Host(VISIBILITY_BUFFER);
+    d_volumeDataHist    = (uint *)frameStats->Device(VOLUME_HIST_BUFFER);
+    d_imageHist         = (uint *)frameStats->Device(IMAGE_HIST_BUFFER);
+    d_visibilityHist    = (float *)frameStats->Device(VISIBILITY_BUFFER);
+}
+
+// Per-brick visibility for -visibility, over whichever renderer holds the whole volume
+void initBrickVisibility()
+{
+    if(cpuRenderer)
     {
-        pRawDataHist[i] = 0; 
+        brickCount = cpuRenderer->SetVisibilityBricks(visibilityBrickSize);
     }
-
-    // We need to allocate this as cuda shared memory - good balance of accessibility and speed
-    checkCudaErrors(cudaMallocManaged(&pVolumeDataHist, histSize));
+    else
+    {
+        brickCount = setVisibilityGrid(volumeSize, visibilityBrickSize);
+    }
+    brickVisibilityBuffer = frameStats->Add(brickCount*sizeof(float));
+    pBrickVisibility = (float *)frameStats->Host(brickVisibilityBuffer);
+    d_brickVisibility = (float *)frameStats->Device(brickVisibilityBuffer);
+    printf("Visibility over %zu bricks of %u^3 voxels\n", brickCount, visibilityBrickSize);
 }
 
-void NormaliseAndBin(void* data, size_t dataSize)
+// Gradients for -shade, from -gradientcache when it holds this volume's, otherwise built and written there
+void LoadGradients(const VolumeType *voxels)
 {
-    // We will use the histogram and ranges stored in local scope
-    //      just pass in the data that needs to be binned
-    // FIRST - we need to normalize (0,1) the whole dataset based on the ranges
-    float normalizedData[dataSize] = {0.0f}; 
+    size_t w = volumeSize.width, h = volumeSize.height, d = volumeSize.depth;
+    float scale[3] = { w/(2.f*volumeHalfExtent.x), h/(2.f*volumeHalfExtent.y), d/(2.f*volumeHalfExtent.z) };
+    uint64_t hash = gradientCacheFile ? MICache::HashBytes(voxels, w*h*d*sizeof(VolumeType)) : 0;
 
-    for(int i = 0; i < dataSize; i++)
-    {
-        // Dodgy as hell casting, not safe but okay since we know its type
-        normalizedData[i] = ( ((float)((unsigned char*)data)[i])-DataRange[0] ) / ( DataRange[1]-DataRange[0] );
-        // Now we need to bin the value
-        float step = 1.f/BIN_COUNT;
-        int idx = (int)(normalizedData[i]/step);
+    StopWatchInterface *gradientTimer = 0;
+    sdkCreateTimer(&gradientTimer);
+    sdkStartTimer(&gradientTimer);
 
-        pRawDataHist[idx] += 1;
+    std::vector<int8_t> gradients;
+    bool cached = gradientCacheFile && ReadGradientVolume(gradientCacheFile, hash, w, h, d, scale, &gradients);
+    if (!cached)
+    {
+        BuildGradientVolume(voxels, w, h, d, scale, &gradients);
+        if (gradientCacheFile && !WriteGradientVolume(gradientCacheFile, hash, w, h, d, scale, gradients))
+        {
+            printf("Could not write gradient cache '%s'\n", gradientCacheFile);
+        }
     }
 
-    for(int i = 0; i < BIN_COUNT; i++)
+    if (cpuRenderer)
+    {
+        cpuRenderer->SetGradients(gradients.data());
+    }
+    else
     {
-        std::cout << pRawDataHist[i] << " ";
+        initGradients(gradients.data(), volumeSize);
+        setShading(shaded, &shading);
     }
-    std::cout << std::endl;
+    gradientsLoaded = true;
+
+    sdkStopTimer(&gradientTimer);
+    printf("Gradients %s in %.1f ms (%zu MB)\n", cached ? "read" : "built", sdkGetTimerValue(&gradientTimer), gradients.size() >> 20);
+    sdkDeleteTimer(&gradientTimer);
 }
 
 // Load raw data from disk
@@ -877,36 +2376,98 @@ void *loadRawFile(char *filename, size_t size)
     // First we want to allocate the histograms 
     initHistgramBuffers();
 
-    int lowest = std::numeric_limits<int>::max();
-    int highest = std::numeric_limits<int>::min();
+    FILE *fp = fopen(filename, "rb");
+
+    if (!fp)
+    {
+        fprintf(stderr, "Error opening file '%s'\n", filename);
+        return 0;
+    }
+
+    void *data = malloc(size);
+    size_t read = 0;
+    BrickedVolume bricked;
+    if (BrickedVolume::IsBricked(filename))
+    {
+        // Bricks decompress in parallel straight into the volume
+        if (!bricked.Open(filename) || bricked.Width()*bricked.Height()*bricked.Depth()*sizeof(VolumeType) != size ||
+            !bricked.Read(0, bricked.Depth(), (unsigned char *)data))
+        {
+            fprintf(stderr, "Error reading bricked volume '%s', or it isn't the size given\n", filename);
+            fclose(fp);
+            free(data);
+            return 0;
+        }
+        read = size;
+    }
+    else
+    {
+        read = fread(data, 1, size, fp);
+    }
+
+    // One pass gives the range for normalisation and the raw histogram both
+    uint64_t valueCounts[256];
+    CountVoxelValues((const unsigned char *)data, read, valueCounts);
+    SetRawValueCounts(valueCounts);
+    fclose(fp);
+
+#if defined(_MSC_VER_)
+    printf("Read '%s', %Iu bytes\n", filename, read);
+#else
+    printf("Read '%s', %zu bytes\n", filename, read);
+#endif
+
+    return data;
+}
+
+// Load slices [firstSlice, firstSlice + sliceCount) of a volume, nothing else - the histograms are the
+// caller's problem. Bricked volumes only decompress the bricks those slices touch.
+void *loadRawSlab(char *filename, size_t firstSlice, size_t sliceCount)
+{
+    size_t sliceBytes = volumeSize.width*volumeSize.height*sizeof(VolumeType);
+    size_t size = sliceCount*sliceBytes;
+    void *data = malloc(size);
+
+    BrickedVolume bricked;
+    if (BrickedVolume::IsBricked(filename))
+    {
+        if (!bricked.Open(filename) || !bricked.Read(firstSlice, firstSlice + sliceCount, (unsigned char *)data))
+        {
+            free(data);
+            return 0;
+        }
+        return data;
+    }
+
+    MappedVolume mapped;
+    if (headerVolume)
+    {
+        if (!mapped.Open(volumeHeader, firstSlice, firstSlice + sliceCount))
+        {
+            free(data);
+            return 0;
+        }
+        memcpy(data, mapped.Voxels(), size);
+        return data;
+    }
 
     FILE *fp = fopen(filename, "rb");
 
     if (!fp)
     {
         fprintf(stderr, "Error opening file '%s'\n", filename);
+        free(data);
         return 0;
     }
 
-    void *data = malloc(size);
-    size_t read = fread(data, 1, size, fp);
-
-    // We need to get the highest and lowest value for normalisation - I figured this was easier than using high-level vectors
-    for(int i = 0; i < (size); i++)
+    if (fseeko(fp, (off_t)(firstSlice*sliceBytes), SEEK_SET) != 0 || fread(data, 1, size, fp) != size)
     {
-        int val = ((int)((unsigned char*)data)[i]);
-        (val < lowest) ? DataRange[0] = val, lowest = val : (val > highest) ? DataRange[1] = val, highest = val:  NULL;
+        fprintf(stderr, "Error reading slices %zu-%zu from '%s'\n", firstSlice, firstSlice + sliceCount, filename);
+        free(data);
+        data = 0;
     }
-    
-    NormaliseAndBin(data, size);
     fclose(fp);
 
-#if defined(_MSC_VER_)
-    printf("Read '%s', %Iu bytes\n", filename, read);
-#else
-    printf("Read '%s', %zu bytes\n", filename, read);
-#endif
-
     return data;
 }
 
@@ -926,6 +2487,136 @@ int chooseCudaDevice(int argc, const char **argv, bool bUseOpenGL)
 
     return result;
 }
+// Worker side of -slabs: load one slab, then render it for the coordinator until told to stop
+void RunSlabWorker(char *path)
+{
+    // Spread the slabs over the GPUs unless told which one to use
+    int deviceCount = 0;
+    checkCudaErrors(cudaGetDeviceCount(&deviceCount));
+    if (deviceCount > 1 && !checkCmdLineFlag(*pArgc, (const char **)pArgv, "device"))
+    {
+        checkCudaErrors(cudaSetDevice(slabIndex % deviceCount));
+    }
+
+    size_t z0, z1;
+    SlabRange(volumeSize.depth, slabIndex, slabCount, &z0, &z1);
+
+    // One extra slice either side, so linear filtering across the cut matches the whole volume
+    size_t first = (z0 > 0) ? z0 - 1 : 0;
+    size_t last = std::min(z1 + 1, volumeSize.depth);
+    size_t sliceVoxels = volumeSize.width*volumeSize.height;
+    VolumeType *h_slab = (VolumeType*)loadRawSlab(path, first, last - first);
+    if (!h_slab)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // The coordinator builds the raw histogram and volume hash from these, so they cover this slab's own slices only
+    SlabVolumeInfo info;
+    memset(&info, 0, sizeof(SlabVolumeInfo));
+    const VolumeType *core = h_slab + (z0 - first)*sliceVoxels;
+    size_t coreVoxels = (z1 - z0)*sliceVoxels;
+    info.hash = MICache::HashBytes(core, coreVoxels*sizeof(VolumeType));
+    CountVoxelValues(core, coreVoxels, info.valueCounts);
+
+    initCuda(h_slab, make_cudaExtent(volumeSize.width, volumeSize.height, last - first));
+    free(h_slab);
+
+    // March only the slab's part of the box
+    SetSlabBox(z0, z1, first, last);
+
+    if (!transferFuncFiles.empty())
+    {
+        LoadTransferFunction(0);
+    }
+
+    if (!SlabCompositor::SendVolumeInfo(slabWorkerSocket, info))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Room for any bin count the coordinator asks for, as initHistgramBuffers does
+    HistogramReadback *slabStats = new HistogramReadback();
+    size_t slabHistBuffer = slabStats->Add(MAX_BIN_COUNT*sizeof(uint));
+
+    uint *d_output = nullptr;
+    std::vector<uint> image;
+    SlabRequest request;
+    while (SlabCompositor::ReceiveRequest(slabWorkerSocket, &request) && !request.quit)
+    {
+        memcpy(invViewMatrix, request.invViewMatrix, sizeof(invViewMatrix));
+        density         = request.density;
+        transferOffset  = request.transferOffset;
+        transferScale   = request.transferScale;
+        tstep           = request.tstep;
+        if (request.opacityThreshold != opacityThreshold)
+        {
+            opacityThreshold = request.opacityThreshold;
+            setOpacityThreshold(opacityThreshold);
+        }
+        preIntegrated   = request.preIntegrated != 0;
+
+        if ((request.linearFiltering != 0) != linearFiltering)
+        {
+            linearFiltering = !linearFiltering;
+            setTextureFilterMode(linearFiltering);
+        }
+
+        if (request.transferFuncIndex != transferFuncIndex && request.transferFuncIndex < transferFuncFiles.size())
+        {
+            transferFuncIndex = request.transferFuncIndex;
+            LoadTransferFunction(transferFuncIndex);
+        }
+
+        if (!d_output || request.width != width || request.height != height)
+        {
+            width = request.width;
+            height = request.height;
+            gridSize = dim3(iDivUp(width, blockSize.x), iDivUp(height, blockSize.y));
+            checkCudaErrors(cudaFree(d_output));
+            checkCudaErrors(cudaMalloc(&d_output, width*height*4));
+            image.resize(width*height);
+        }
+
+        if (request.binCount < MIN_BIN_COUNT || request.binCount > MAX_BIN_COUNT)
+        {
+            fprintf(stderr, "Slab %d: bin count %u is out of range\n", slabIndex, (unsigned)request.binCount);
+            break;
+        }
+        BIN_COUNT = request.binCount;
+        histSize = sizeof(uint)*BIN_COUNT;
+
+        copyInvViewMatrix(invViewMatrix, sizeof(float4)*3, 0);
+        checkCudaErrors(cudaMemset(d_output, 0, width*height*4));
+        slabStats->Clear(slabHistBuffer, histSize);
+        if (preIntegrated)
+        {
+            updatePreIntegration(transferOffset, transferScale, density, tstep);
+        }
+
+        // Brightness goes on the composite, not the partials
+        render_kernel(gridSize, blockSize, d_output, width, height, density, 1.f, transferOffset, transferScale,
+                      (uint *)slabStats->Device(slabHistBuffer), histSize, tstep, preIntegrated, nullptr, nullptr, nullptr,
+                      1, false, -1, slabStats->Stream());
+        slabStats->Download(slabHistBuffer, histSize);
+        slabStats->Record();
+        checkCudaErrors(cudaMemcpy(image.data(), d_output, width*height*4, cudaMemcpyDeviceToHost));
+        slabStats->Wait();
+        getLastCudaError("kernel failed");
+
+        if (!SlabCompositor::SendReply(slabWorkerSocket, image.data(), image.size(), (uint *)slabStats->Host(slabHistBuffer), BIN_COUNT))
+        {
+            break;
+        }
+    }
+
+    checkCudaErrors(cudaFree(d_output));
+    delete slabStats;
+    close(slabWorkerSocket);
+    freeCudaBuffers();
+    cudaDeviceReset();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Program main
 ////////////////////////////////////////////////////////////////////////////////
@@ -938,6 +2629,7 @@ main(int argc, char **argv)
     pArgv = argv;
 
     char *ref_file = NULL;
+    bool optimiseTF = checkCmdLineFlag(argc, (const char **)argv, "optimisetf");
 
 #if defined(__linux__)
     setenv ("DISPLAY", ":0", 0);
@@ -946,13 +2638,80 @@ main(int argc, char **argv)
     //start logs
     printf("%s Starting...\n\n", sSDKsample);
 
+    // Combine sweep summaries from several processes, no rendering needed
+    char *sweepFiles = NULL;
+    if (getCmdLineArgumentString(argc, (const char **)argv, "mergesweeps", &sweepFiles))
+    {
+        std::string files(sweepFiles);
+        SweepSummary merged;
+        bool first = true;
+        for (size_t start = 0, end; start <= files.size(); start = end + 1)
+        {
+            end = std::min(files.find(',', start), files.size());
+            SweepSummary part;
+            if (!part.Load(files.substr(start, end - start).c_str()))
+            {
+                exit(EXIT_FAILURE);
+            }
+            merged = first ? part : SweepSummary::Merge(merged, part, 10);
+            first = false;
+        }
+
+        for (size_t i = 0; i < merged.topK.size(); ++i)
+        {
+            printf("%f,%f,%f,%f\n", merged.topK[i].rotX, merged.topK[i].rotY, merged.topK[i].zoom, merged.topK[i].mutualInformation);
+        }
+        exit(merged.Save("MergedSweepSummary.csv") ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Workers have to be forked before anything touches CUDA or GL. They then carry on
+    // through the same argument parsing, and split off where the volume gets loaded.
+    if (checkCmdLineFlag(argc, (const char **)argv, "slabs"))
+    {
+        slabCount = getCmdLineArgumentInt(argc, (const char **)argv, "slabs");
+        if (slabCount > 0)
+        {
+            slabCompositor = new SlabCompositor();
+            slabIndex = slabCompositor->Launch(slabCount);
+            if (slabIndex >= 0)
+            {
+                slabWorkerSocket = slabCompositor->WorkerSocket();
+                delete slabCompositor;
+                slabCompositor = nullptr;
+            }
+        }
+    }
+
     if (checkCmdLineFlag(argc, (const char **)argv, "file"))
     {
-        getCmdLineArgumentString(argc, (const char **)argv, "file", &ref_file);
+        if (!getCmdLineArgumentString(argc, (const char **)argv, "file", &ref_file))
+        {
+            ref_file = (char *)sReference[0];
+        }
         fpsLimit = frameCheckNumber;
     }
 
-    if (ref_file)
+    char *regressionFile = NULL;
+    getCmdLineArgumentString(argc, (const char **)argv, "regression", &regressionFile);
+
+    char *binBench = NULL;
+    getCmdLineArgumentString(argc, (const char **)argv, "binbench", &binBench);
+    if (!binBench && checkCmdLineFlag(argc, (const char **)argv, "bincheck"))
+    {
+        binBench = (char *)"2,1000,65536";     // Both extremes and a count that isn't a power of two
+    }
+
+    // The host renderer has no GL interop, so only the headless checks can use it
+    if ((regressionFile || ref_file || binBench) && slabCount == 0 && checkCmdLineFlag(argc, (const char **)argv, "cpu"))
+    {
+        cpuRenderer = new CpuRenderer();
+    }
+
+    if (cpuRenderer)
+    {
+        // No device needed at all
+    }
+    else if (ref_file || regressionFile || binBench || optimiseTF || slabIndex >= 0)
     {
         // use command-line specified CUDA device, otherwise use device with highest Gflops/s
         chooseCudaDevice(argc, (const char **)argv, false);
@@ -1001,13 +2760,169 @@ main(int argc, char **argv)
         volumeSize.depth = n;
     }
 
-    if (checkCmdLineFlag(argc, (const char **) argv, "-l"))
+    if (slabIndex < 0 && checkCmdLineFlag(argc, (const char **) argv, "-l"))
     {
         LOG_FLAG = true;
         outputFile = new std::ofstream();
         outputFile->open("ValidationData.csv", std::ios::out | std::ios::trunc);
     }
 
+    char *transferFuncList;
+
+    if (getCmdLineArgumentString(argc, (const char **) argv, "tf", &transferFuncList))
+    {
+        std::string files(transferFuncList);
+        for (size_t start = 0, end; start <= files.size(); start = end + 1)
+        {
+            end = std::min(files.find(',', start), files.size());
+            transferFuncFiles.push_back(files.substr(start, end - start));
+        }
+    }
+
+    if (checkCmdLineFlag(argc, (const char **) argv, "samplecache"))
+    {
+        useSampleCache = true;
+    }
+
+    // Rays stop once this opaque - 1 keeps marching, so the histograms see everything behind
+    if (checkCmdLineFlag(argc, (const char **) argv, "opacity"))
+    {
+        float threshold = getCmdLineArgumentFloat(argc, (const char **) argv, "opacity");
+        if (!(threshold > 0.f && threshold <= 1.f))
+        {
+            printf("-opacity wants a threshold above 0 and up to 1, not %g\n", threshold);
+            exit(EXIT_FAILURE);
+        }
+        opacityThreshold = threshold;
+        setOpacityThreshold(opacityThreshold);
+    }
+
+    // Trades a frame's MI accuracy for fewer rays, on the GPU's direct march
+    if (checkCmdLineFlag(argc, (const char **) argv, "subsample") && slabCount == 0 && !cpuRenderer)
+    {
+        float tolerance = getCmdLineArgumentFloat(argc, (const char **) argv, "subsample");
+        subsampleTolerance = (tolerance > 0.f) ? tolerance : 0.01f;
+        n = checkCmdLineFlag(argc, (const char **) argv, "subsamplecell") ?
+            getCmdLineArgumentInt(argc, (const char **) argv, "subsamplecell") : 4;
+        for (subsampleCell = 1; (int)subsampleCell*2 <= n; subsampleCell *= 2) {}
+    }
+
+    if (checkCmdLineFlag(argc, (const char **) argv, "bins"))
+    {
+        n = getCmdLineArgumentInt(argc, (const char **) argv, "bins");
+        if (n < (int)MIN_BIN_COUNT || n > (int)MAX_BIN_COUNT)
+        {
+            printf("-bins wants %zu to %zu, not %d\n", MIN_BIN_COUNT, MAX_BIN_COUNT, n);
+            exit(EXIT_FAILURE);
+        }
+        BIN_COUNT = n;
+        histSize = sizeof(uint)*BIN_COUNT;
+    }
+
+    char *estimatorName = NULL;
+
+    if (getCmdLineArgumentString(argc, (const char **) argv, "estimator", &estimatorName) &&
+        !ParseEstimator(estimatorName, &miEstimator))
+    {
+        printf("-estimator wants plugin, mm, jackknife or kde, not '%s'\n", estimatorName);
+        exit(EXIT_FAILURE);
+    }
+
+    char *statsGrid = NULL;
+
+    if (getCmdLineArgumentString(argc, (const char **) argv, "statsgrid", &statsGrid) && slabCount == 0 && !cpuRenderer)
+    {
+        if (sscanf(statsGrid, "%ux%u", &statsGridWidth, &statsGridHeight) != 2)
+        {
+            statsGridWidth = statsGridHeight = (uint)atoi(statsGrid);
+        }
+        if (statsGridWidth == 0 || statsGridHeight == 0)
+        {
+            printf("-statsgrid wants WxH or N, not '%s'\n", statsGrid);
+            exit(EXIT_FAILURE);
+        }
+        statsGridSize = dim3(iDivUp(statsGridWidth, blockSize.x), iDivUp(statsGridHeight, blockSize.y));
+    }
+
+    // Headless runs and sweeps want every view's exact MI, not a preview of it
+    if (checkCmdLineFlag(argc, (const char **) argv, "progressive") && subsampleTolerance == 0.f && statsGridWidth == 0 &&
+        !(ref_file || regressionFile || binBench || optimiseTF || LOG_FLAG || slabCount > 0))
+    {
+        n = getCmdLineArgumentInt(argc, (const char **) argv, "progressive");
+        uint coarsest = (n > 0) ? n : 8;
+        for (progressiveStep = 1; progressiveStep*2 <= coarsest; progressiveStep *= 2) {}
+    }
+
+    if (checkCmdLineFlag(argc, (const char **) argv, "visibility"))
+    {
+        n = getCmdLineArgumentInt(argc, (const char **) argv, "visibility");
+        visibilityBrickSize = (n > 0) ? n : 16;
+    }
+
+    // Interactive and -l sweeps only: the rest either need each frame's MI before the next
+    // or change more than the view between frames
+    if (checkCmdLineFlag(argc, (const char **) argv, "pipeline") && !cpuRenderer && slabCount == 0 &&
+        progressiveStep == 0 && subsampleTolerance == 0.f && !useSampleCache && visibilityBrickSize == 0 &&
+        !(ref_file || regressionFile || binBench || optimiseTF))
+    {
+        n = getCmdLineArgumentInt(argc, (const char **) argv, "pipeline");
+        pipelineDepth = (size_t)std::min(std::max((n > 0) ? n : 2, 2), 3);
+    }
+
+    char *seriesSpec = NULL;
+
+    if (slabCount == 0)     // Slab workers read their own slabs, so the two don't mix
+    {
+        getCmdLineArgumentString(argc, (const char **) argv, "series", &seriesSpec);
+    }
+
+    if (seriesSpec && cpuRenderer)
+    {
+        printf("-cpu only renders single volumes, not -series\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (checkCmdLineFlag(argc, (const char **) argv, "shade"))
+    {
+        // Timesteps would each need their own, and slabs a gradient volume per slab
+        if (seriesSpec || slabCount > 0)
+        {
+            printf("-shade only lights single volumes, not -series or -slabs\n");
+            exit(EXIT_FAILURE);
+        }
+        shaded = true;
+        getCmdLineArgumentString(argc, (const char **) argv, "gradientcache", &gradientCacheFile);
+    }
+
+    char *cacheDir;
+
+    if (slabIndex < 0 && getCmdLineArgumentString(argc, (const char **) argv, "cache", &cacheDir))
+    {
+        miCache = new MICache(cacheDir);
+    }
+
+    char *recordPath = NULL;
+
+    // Only the windowed GPU path has a PBO to read back - headless runs write their own images
+    if (getCmdLineArgumentString(argc, (const char **) argv, "record", &recordPath) && !cpuRenderer &&
+        !(ref_file || regressionFile || binBench || optimiseTF || slabIndex >= 0))
+    {
+        FrameFormat format;
+        if (!FrameExporter::ParseFormat(recordPath, &format))
+        {
+            printf("-record wants a .png, .ppm or .y4m path, not '%s'\n", recordPath);
+            exit(EXIT_FAILURE);
+        }
+        n = checkCmdLineFlag(argc, (const char **) argv, "recordthreads") ?
+            getCmdLineArgumentInt(argc, (const char **) argv, "recordthreads") : 0;
+        frameExporter = new FrameExporter(recordPath, format, (size_t)std::max(n, 0), 0, AllocatePinned, FreePinned);
+        if (!frameExporter->Ok())
+        {
+            printf("Couldn't open '%s' to record to\n", recordPath);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if (checkCmdLineFlag(argc, (const char **) argv, "-h"))
     {
         std::cout << "================= Mutual Information Volume Renderer =================" << std::endl;
@@ -1015,25 +2930,248 @@ main(int argc, char **argv)
         std::cout << "Flags: " << std::endl;
         std::cout << "  -h     = Help (display this)" << std::endl; 
         std::cout << "  -l     = Logger mode, sample MI around the volume" << std::endl;
+        std::cout << "  -cache=<dir> = Reuse MI/histograms for revisited poses, shared between processes" << std::endl;
+        std::cout << "  -mergesweeps=<a.csv,b.csv,...> = Merge SweepSummary files from several -l runs" << std::endl;
+        std::cout << "  -tf=<a.txt,b.txt,...> = Transfer functions ('r g b a' per line), 't' cycles/reloads" << std::endl;
+        std::cout << "  -progressive[=N] = Only march every Nth (8) pixel while the view changes, refining to the full frame when it stops (instead of -samplecache)" << std::endl;
+        std::cout << "  -subsample[=X] [-subsamplecell=N] = March rays in batches of one per NxN (4x4) pixel cell until the MI's 95% interval" << std::endl;
+        std::cout << "                   is within +-X (0.01) bits, GPU only - sweeps log the interval and fraction of rays used" << std::endl;
+        std::cout << "  -statsgrid=<WxH|N> = Gather the histograms/MI from their own WxH rays over the view, leaving the window's march" << std::endl;
+        std::cout << "                   colour only - the MI no longer depends on the window size (not with -progressive/-samplecache)" << std::endl;
+        std::cout << "  -bins=N = Histogram bin count, 2 to 65536 (32) - 'q'/'w' step it by 32" << std::endl;
+        std::cout << "  -binbench=<a,b,...> [-repeats=N] [-cpu] = Headless march/MI timings of the starting view at each bin count (10 frames each)," << std::endl;
+        std::cout << "                each checked against the same view at 65536 bins - fails the run if any check does" << std::endl;
+        std::cout << "  -bincheck [-cpu] = -binbench=2,1000,65536" << std::endl;
+        std::cout << "  -estimator=<plugin|mm|jackknife|kde> = Entropy estimator behind the MI: plug-in (default), Miller-Madow or" << std::endl;
+        std::cout << "                   jackknife bias corrected, or a Gaussian KDE - the last three drift less with the bin count" << std::endl;
+        std::cout << "  -samplecache = Keep each view's ray samples so transfer function changes skip the march ('c' toggles)" << std::endl;
+        std::cout << "  -optimisetf [-tfviews=<views.csv>] [-tfevals=N] = Headless search for the offset/scale/density with the best mean MI" << std::endl;
+        std::cout << "  -volume=<file> = .raw, a bricked volume from data/volumecompressor, or a raw NRRD/MetaImage (.nrrd/.nhdr/.mha/.mhd)" << std::endl;
+        std::cout << "                   - the last three carry their own size (and header spacing) so the size flags are ignored" << std::endl;
+        std::cout << "  -series=<step_%04d.raw|list.txt> [-seriesring=N] = Play a timestep series, N (4) steps read ahead ('n' pauses, 'm' steps)" << std::endl;
+        std::cout << "  -shade [-gradientcache=<file>] = Blinn-Phong lighting from a gradient volume built at load, or read from/written to <file> ('l' toggles)" << std::endl;
+        std::cout << "  -record=<f_%05d.png|f_%05d.ppm|out.y4m> [-recordthreads=N] = Write every displayed frame out on background threads" << std::endl;
+        std::cout << "                   (half the cores) - a .y4m can be a fifo into an encoder, e.g. ffmpeg -i out.y4m" << std::endl;
+        std::cout << "  -pipeline[=N] = Keep N (2-3) frames in flight, the display and MI trailing by N-1" << std::endl;
+        std::cout << "  -opacity=X = Stop rays once this opaque (0.95), 1 marches every ray through" << std::endl;
+        std::cout << "  -visibility[=N] = Gather how much opacity each N^3 (16) voxel brick contributes, for the brick view entropy" << std::endl;
+        std::cout << "  -slabs=N = Split the volume along z over N worker processes, each only loading its own slab" << std::endl;
+        std::cout << "  -regression=<poses.csv> [-regressionname=<name>] [-mitolerance=X] [-repeats=N] [-cpu]" << std::endl;
+        std::cout << "                 = Headless check of 'rotX,rotY,zoom[,MI[,ref.ppm]]' views against reference images/MI, with" << std::endl;
+        std::cout << "                   stage timings. Writes <name>.csv + <name>_NNN.ppm in the same format, to use as the next reference" << std::endl;
+        std::cout << "  -file[=<ref.ppm>] [-cpu] = Headless check of the starting view against one reference image (ref_volume.ppm)" << std::endl;
+        std::cout << "  -cpu   = March on the host instead of the GPU, for -regression and -file" << std::endl;
         std::cout << "======================================================================" << std::endl;
         exit(EXIT_WAIVED);
     }
 
     exePath = argv[0];
     // load volume data
-    char *path = sdkFindFilePath(volumeFilename, exePath);
+    char *path = seriesSpec ? NULL : sdkFindFilePath(volumeFilename, exePath);
 
-    if (path == 0)
+    if (path == 0 && !seriesSpec)
     {
         printf("Error finding file '%s'\n", volumeFilename);
         exit(EXIT_FAILURE);
     }
 
-    size_t size = volumeSize.width*volumeSize.height*volumeSize.depth*sizeof(VolumeType);
-    void *h_volume = loadRawFile(path, size);
+    // Header files say what the volume is, instead of trusting the size flags
+    if (path && VolumeHeader::IsHeader(path))
+    {
+        if (!VolumeHeader::Read(path, &volumeHeader))
+        {
+            exit(EXIT_FAILURE);
+        }
+        headerVolume = true;
+        volumeSize = make_cudaExtent(volumeHeader.width, volumeHeader.height, volumeHeader.depth);
+
+        float extent[3] = { volumeHeader.width*volumeHeader.spacing[0], volumeHeader.height*volumeHeader.spacing[1], volumeHeader.depth*volumeHeader.spacing[2] };
+        float longest = std::max(extent[0], std::max(extent[1], extent[2]));
+        volumeHalfExtent = make_float3(extent[0]/longest, extent[1]/longest, extent[2]/longest);
+        printf("'%s': %zux%zux%zu, %zu byte voxels, spacing %g %g %g, data in '%s'\n", path,
+               volumeHeader.width, volumeHeader.height, volumeHeader.depth, volumeHeader.VoxelBytes(),
+               volumeHeader.spacing[0], volumeHeader.spacing[1], volumeHeader.spacing[2], volumeHeader.dataFile.c_str());
+    }
+
+    // Bricked volumes carry their own dimensions
+    BrickedVolume bricked;
+    if (path && BrickedVolume::IsBricked(path) && bricked.Open(path))
+    {
+        volumeSize = make_cudaExtent(bricked.Width(), bricked.Height(), bricked.Depth());
+    }
+
+    if (slabIndex >= 0)
+    {
+        RunSlabWorker(path);
+        exit(EXIT_SUCCESS);
+    }
+
+    StopWatchInterface *loadTimer = 0;
+    sdkCreateTimer(&loadTimer);
+    sdkStartTimer(&loadTimer);
+
+    if (slabCompositor)
+    {
+        // Only the workers read the volume, all we need is its raw histogram and a hash for the MI cache
+        std::vector<SlabVolumeInfo> infos;
+        if (!slabCompositor->ReceiveVolumeInfo(volumeSize.depth, volumeHalfExtent.z, &infos))
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        uint64_t valueCounts[256] = {};
+        std::vector<uint64_t> slabHashes;
+        for (size_t slab = 0; slab < infos.size(); ++slab)
+        {
+            for (size_t value = 0; value < 256; ++value)
+            {
+                valueCounts[value] += infos[slab].valueCounts[value];
+            }
+            slabHashes.push_back(infos[slab].hash);
+        }
+        volumeHash = MICache::HashBytes(slabHashes.data(), slabHashes.size()*sizeof(uint64_t));
+
+        initHistgramBuffers();
+        SetRawValueCounts(valueCounts);
+
+        // Nothing is marched here, but the transfer function and filter mode calls still want a texture to talk to
+        VolumeType empty = 0;
+        initCuda(&empty, make_cudaExtent(1, 1, 1));
+    }
+    else if (headerVolume)
+    {
+        // 8 bit payloads go to the GPU straight from the mapping, no copy
+        MappedVolume mapped;
+        if (!mapped.Open(volumeHeader, 0, volumeSize.depth))
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        size_t voxelCount = volumeSize.width*volumeSize.height*volumeSize.depth;
+        const VolumeType *voxels = mapped.Voxels();
+        uint64_t valueCounts[256];
+        CountVoxelValues(voxels, voxelCount, valueCounts);
+        if (miCache)
+        {
+            volumeHash = MICache::HashBytes(voxels, voxelCount*sizeof(VolumeType));
+        }
+
+        initHistgramBuffers();
+        SetRawValueCounts(valueCounts);
+        if (cpuRenderer)
+        {
+            cpuRenderer->SetVolume(voxels, volumeSize.width, volumeSize.height, volumeSize.depth);
+        }
+        else
+        {
+            initCuda((void *)voxels, volumeSize);
+        }
+        if (shaded)
+        {
+            LoadGradients(voxels);
+        }
+        SetSlabBox(0, volumeSize.depth, 0, volumeSize.depth);
+    }
+    else if (seriesSpec)
+    {
+        std::vector<std::string> files;
+        if (!VolumeSeries::ListFiles(seriesSpec, &files))
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        int ringSize = checkCmdLineFlag(argc, (const char **) argv, "seriesring") ?
+                       getCmdLineArgumentInt(argc, (const char **) argv, "seriesring") : 4;
+        ringSize = (ringSize > 0) ? ringSize : 4;
+        size_t size = volumeSize.width*volumeSize.height*volumeSize.depth*sizeof(VolumeType);
+        volumeSeries = new VolumeSeries(files, size, ringSize);
+        printf("Volume series '%s', %zu steps\n", seriesSpec, files.size());
+
+        initHistgramBuffers();
+        LoadSeriesStep(0, true);
+        seriesCSV = std::fopen("SeriesMI.csv", "w");
+    }
+    else
+    {
+        size_t size = volumeSize.width*volumeSize.height*volumeSize.depth*sizeof(VolumeType);
+        void *h_volume = loadRawFile(path, size);
+        if (!h_volume)
+        {
+            exit(EXIT_FAILURE);
+        }
+        if (miCache)
+        {
+            volumeHash = MICache::HashBytes(h_volume, size);
+        }
+
+        if (cpuRenderer)
+        {
+            cpuRenderer->SetVolume((const VolumeType *)h_volume, volumeSize.width, volumeSize.height, volumeSize.depth);
+        }
+        else
+        {
+            initCuda(h_volume, volumeSize);
+        }
+        if (shaded)
+        {
+            LoadGradients((const VolumeType *)h_volume);
+        }
+        free(h_volume);
+    }
+
+    sdkStopTimer(&loadTimer);
+    float loadTime = sdkGetTimerValue(&loadTimer);
+    sdkDeleteTimer(&loadTimer);
+
+    // The coordinator never marches, and no one slab sees what reaches the eye
+    if (visibilityBrickSize && !slabCompositor)
+    {
+        initBrickVisibility();
+    }
+
+    if (!transferFuncFiles.empty())
+    {
+        LoadTransferFunction(0);
+    }
+
+    if (regressionFile || ref_file)
+    {
+        char *name = NULL;
+        getCmdLineArgumentString(argc, (const char **)argv, "regressionname", &name);
+        float miTolerance = checkCmdLineFlag(argc, (const char **)argv, "mitolerance") ?
+                            getCmdLineArgumentFloat(argc, (const char **)argv, "mitolerance") : 1e-3f;
+        int repeats = checkCmdLineFlag(argc, (const char **)argv, "repeats") ?
+                      std::max(getCmdLineArgumentInt(argc, (const char **)argv, "repeats"), 1) : 1;
+
+        gridSize = dim3(iDivUp(width, blockSize.x), iDivUp(height, blockSize.y));
+        int failures = RunRegression(regressionFile, ref_file, name ? name : "regression", miTolerance, repeats, loadTime);
+        cleanup();
+        exit(failures ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (binBench)
+    {
+        int repeats = checkCmdLineFlag(argc, (const char **)argv, "repeats") ?
+                      std::max(getCmdLineArgumentInt(argc, (const char **)argv, "repeats"), 1) : 10;
+
+        gridSize = dim3(iDivUp(width, blockSize.x), iDivUp(height, blockSize.y));
+        int failures = RunBinBenchmark(binBench, repeats);
+        cleanup();
+        exit(failures ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (optimiseTF)
+    {
+        char *viewsFile = NULL;
+        getCmdLineArgumentString(argc, (const char **)argv, "tfviews", &viewsFile);
+        int maxEvaluations = checkCmdLineFlag(argc, (const char **)argv, "tfevals") ?
+                             getCmdLineArgumentInt(argc, (const char **)argv, "tfevals") : 200;
 
-    initCuda(h_volume, volumeSize);
-    free(h_volume);
+        gridSize = dim3(iDivUp(width, blockSize.x), iDivUp(height, blockSize.y));
+        RunTransferOptimisation(viewsFile, maxEvaluations);
+        cleanup();
+        exit(EXIT_SUCCESS);
+    }
 
     sdkCreateTimer(&timer);
 
@@ -1048,7 +3186,6 @@ main(int argc, char **argv)
     glutMotionFunc(motion);
     glutReshapeFunc(reshape);
     glutIdleFunc(idle);
-    stbi_flip_vertically_on_write(1);
 
     glutSetWindow(windowID[1]);
     glutReshapeWindow(statsWidth, statsHeight);
@@ -1058,7 +3195,7 @@ main(int argc, char **argv)
     glutReshapeFunc(reshape);
     glutSetWindow(windowID[0]); //Change back to the main window once we've handled
 
-    SetupServerConnection();
+    serverLink = new ServerLink("127.0.0.1", 8888);
 
     for(GLint i = 0; i < 2; i++)
     {
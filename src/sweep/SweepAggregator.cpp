@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#include "SweepAggregator.h"
+
+class SweepAggregator::Shard
+{
+    public:
+        struct Entry
+        {
+            std::atomic<float> rotX, rotY, zoom, mutualInformation;
+        };
+
+        Shard(size_t topK, size_t histBins)
+            : sequence(0), filled(0), count(0), next(nullptr),
+              entries(new Entry[topK]), histogram(new std::atomic<uint64_t>[histBins]),
+              worstIndex(0), worstMI(0.f)
+        {
+            for(size_t i = 0; i < histBins; ++i)
+            {
+                histogram[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<uint32_t>                   sequence;   // Odd while the owner is rewriting entries
+        std::atomic<size_t>                     filled;
+        std::atomic<uint64_t>                   count;
+        Shard*                                  next;
+        std::unique_ptr<Entry[]>                entries;
+        std::unique_ptr<std::atomic<uint64_t>[]> histogram;
+
+        // Owner only
+        size_t                                  worstIndex;
+        float                                   worstMI;
+};
+
+static size_t BinFor(float value, float histMin, float histMax, size_t bins)
+{
+    float t = (value - histMin) / (histMax - histMin);
+    if(!(t > 0.f))
+    {
+        return 0;   // Also catches NaN
+    }
+    return std::min((size_t)(t * bins), bins - 1);
+}
+
+static void AddHistogram(std::vector<uint64_t>& dst, float dstMin, float dstMax,
+                         const std::vector<uint64_t>& src, float srcMin, float srcMax)
+{
+    if(dst.size() == src.size() && dstMin == srcMin && dstMax == srcMax)
+    {
+        for(size_t i = 0; i < dst.size(); ++i)
+        {
+            dst[i] += src[i];
+        }
+        return;
+    }
+
+    // Different layouts - put each source bin's count where its centre lands
+    if(dst.empty())
+    {
+        return;
+    }
+    float srcStep = (srcMax - srcMin) / src.size();
+    for(size_t i = 0; i < src.size(); ++i)
+    {
+        dst[BinFor(srcMin + srcStep * (i + 0.5f), dstMin, dstMax, dst.size())] += src[i];
+    }
+}
+
+static bool BetterThan(const SweepResult& a, const SweepResult& b)
+{
+    return a.mutualInformation > b.mutualInformation;
+}
+
+SweepAggregator::SweepAggregator(size_t topK, size_t histBins, float histMin, float histMax)
+    : topK(std::max<size_t>(topK, 1)), histBins(std::max<size_t>(histBins, 1)),
+      histMin(histMin), histMax(histMax), best(-std::numeric_limits<float>::infinity()), shards(nullptr)
+{
+}
+
+SweepAggregator::~SweepAggregator()
+{
+    Shard* shard = shards.load(std::memory_order_acquire);
+    while(shard)
+    {
+        Shard* next = shard->next;
+        delete shard;
+        shard = next;
+    }
+}
+
+SweepAggregator::Shard* SweepAggregator::AcquireShard()
+{
+    Shard* shard = new Shard(topK, histBins);
+    shard->next = shards.load(std::memory_order_relaxed);
+    while(!shards.compare_exchange_weak(shard->next, shard, std::memory_order_release, std::memory_order_relaxed)) {}
+    return shard;
+}
+
+static void InsertTop(SweepAggregator::Shard* shard, size_t topK, const SweepResult& result);
+
+void SweepAggregator::Submit(Shard* shard, const SweepResult& result)
+{
+    // Histogram and count only ever have this one writer, so plain load/store is enough
+    size_t bin = BinFor(result.mutualInformation, histMin, histMax, histBins);
+    shard->histogram[bin].store(shard->histogram[bin].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    shard->count.store(shard->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    float current = best.load(std::memory_order_relaxed);
+    while(result.mutualInformation > current &&
+          !best.compare_exchange_weak(current, result.mutualInformation, std::memory_order_relaxed)) {}
+
+    InsertTop(shard, topK, result);
+}
+
+static void InsertTop(SweepAggregator::Shard* shard, size_t topK, const SweepResult& result)
+{
+    size_t filled = shard->filled.load(std::memory_order_relaxed);
+    if(filled == topK && !(result.mutualInformation > shard->worstMI))
+    {
+        return;     // The common case, nothing for readers to see
+    }
+
+    size_t slot = (filled < topK) ? filled : shard->worstIndex;
+    uint32_t sequence = shard->sequence.load(std::memory_order_relaxed);
+    shard->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    SweepAggregator::Shard::Entry& entry = shard->entries[slot];
+    entry.rotX.store(result.rotX, std::memory_order_relaxed);
+    entry.rotY.store(result.rotY, std::memory_order_relaxed);
+    entry.zoom.store(result.zoom, std::memory_order_relaxed);
+    entry.mutualInformation.store(result.mutualInformation, std::memory_order_relaxed);
+    if(filled < topK)
+    {
+        shard->filled.store(++filled, std::memory_order_relaxed);
+    }
+
+    shard->sequence.store(sequence + 2, std::memory_order_release);
+
+    if(filled == topK)
+    {
+        shard->worstIndex = 0;
+        shard->worstMI = shard->entries[0].mutualInformation.load(std::memory_order_relaxed);
+        for(size_t i = 1; i < topK; ++i)
+        {
+            float mi = shard->entries[i].mutualInformation.load(std::memory_order_relaxed);
+            if(mi < shard->worstMI)
+            {
+                shard->worstMI = mi;
+                shard->worstIndex = i;
+            }
+        }
+    }
+}
+
+SweepSummary SweepAggregator::Snapshot() const
+{
+    SweepSummary summary;
+    summary.count = 0;
+    summary.histMin = histMin;
+    summary.histMax = histMax;
+    summary.histogram.assign(histBins, 0);
+
+    std::vector<SweepResult> local(topK);
+    for(Shard* shard = shards.load(std::memory_order_acquire); shard; shard = shard->next)
+    {
+        summary.count += shard->count.load(std::memory_order_relaxed);
+        for(size_t i = 0; i < histBins; ++i)
+        {
+            summary.histogram[i] += shard->histogram[i].load(std::memory_order_relaxed);
+        }
+
+        // Sequence lock read - retry if the owner was mid-update
+        size_t filled;
+        uint32_t before, after;
+        do
+        {
+            before = shard->sequence.load(std::memory_order_acquire);
+            filled = shard->filled.load(std::memory_order_relaxed);
+            for(size_t i = 0; i < filled; ++i)
+            {
+                local[i].rotX               = shard->entries[i].rotX.load(std::memory_order_relaxed);
+                local[i].rotY               = shard->entries[i].rotY.load(std::memory_order_relaxed);
+                local[i].zoom               = shard->entries[i].zoom.load(std::memory_order_relaxed);
+                local[i].mutualInformation  = shard->entries[i].mutualInformation.load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = shard->sequence.load(std::memory_order_relaxed);
+        } while((before & 1) || before != after);
+
+        summary.topK.insert(summary.topK.end(), local.begin(), local.begin() + filled);
+    }
+
+    std::sort(summary.topK.begin(), summary.topK.end(), BetterThan);
+    if(summary.topK.size() > topK)
+    {
+        summary.topK.resize(topK);
+    }
+    return summary;
+}
+
+void SweepAggregator::Merge(const SweepSummary& other)
+{
+    if(other.count == 0)
+    {
+        return;     // Nothing to fold in, and its histogram may not even have a layout
+    }
+
+    // Imported results get a shard of their own, so the merge is just another writer
+    Shard* shard = AcquireShard();
+
+    std::vector<uint64_t> histogram(histBins, 0);
+    AddHistogram(histogram, histMin, histMax, other.histogram, other.histMin, other.histMax);
+    for(size_t i = 0; i < histBins; ++i)
+    {
+        shard->histogram[i].store(histogram[i], std::memory_order_relaxed);
+    }
+    shard->count.store(other.count, std::memory_order_relaxed);
+
+    for(size_t i = 0; i < other.topK.size(); ++i)
+    {
+        float current = best.load(std::memory_order_relaxed);
+        while(other.topK[i].mutualInformation > current &&
+              !best.compare_exchange_weak(current, other.topK[i].mutualInformation, std::memory_order_relaxed)) {}
+        InsertTop(shard, topK, other.topK[i]);
+    }
+}
+
+SweepSummary SweepSummary::Merge(const SweepSummary& a, const SweepSummary& b, size_t k)
+{
+    // An empty side adds nothing, and its histogram layout mustn't be the one kept
+    SweepSummary merged = (a.count == 0) ? b : a;
+    const SweepSummary& other = (a.count == 0) ? a : b;
+    merged.count += other.count;
+    AddHistogram(merged.histogram, merged.histMin, merged.histMax, other.histogram, other.histMin, other.histMax);
+
+    merged.topK.insert(merged.topK.end(), other.topK.begin(), other.topK.end());
+    std::sort(merged.topK.begin(), merged.topK.end(), BetterThan);
+    if(merged.topK.size() > k)
+    {
+        merged.topK.resize(k);
+    }
+    return merged;
+}
+
+bool SweepSummary::Save(const char* filename) const
+{
+    FILE* fp = std::fopen(filename, "w");
+    if(!fp)
+    {
+        std::cout << "SweepSummary: could not open '" << filename << "' for writing" << std::endl;
+        return false;
+    }
+
+    fprintf(fp, "count,%llu\n", (unsigned long long)count);
+    fprintf(fp, "range,%f,%f,%zu\n", histMin, histMax, histogram.size());
+    fprintf(fp, "hist");
+    for(size_t i = 0; i < histogram.size(); ++i)
+    {
+        fprintf(fp, ",%llu", (unsigned long long)histogram[i]);
+    }
+    fprintf(fp, "\n");
+    for(size_t i = 0; i < topK.size(); ++i)
+    {
+        fprintf(fp, "top,%f,%f,%f,%f\n", topK[i].rotX, topK[i].rotY, topK[i].zoom, topK[i].mutualInformation);
+    }
+
+    return std::fclose(fp) == 0;
+}
+
+bool SweepSummary::Load(const char* filename)
+{
+    FILE* fp = std::fopen(filename, "r");
+    if(!fp)
+    {
+        std::cout << "SweepSummary: could not open '" << filename << "'" << std::endl;
+        return false;
+    }
+
+    unsigned long long total = 0;
+    size_t bins = 0;
+    char tag[5] = "";
+    bool ok =   fscanf(fp, "count,%llu\n", &total) == 1 &&
+                fscanf(fp, "range,%f,%f,%zu\n", &histMin, &histMax, &bins) == 3 &&
+                fscanf(fp, "%4s", tag) == 1 && std::strcmp(tag, "hist") == 0;
+
+    count = total;
+    histogram.assign(bins, 0);
+    for(size_t i = 0; ok && i < bins; ++i)
+    {
+        unsigned long long value;
+        ok = fscanf(fp, ",%llu", &value) == 1;
+        histogram[i] = value;
+    }
+
+    topK.clear();
+    SweepResult result;
+    while(ok && fscanf(fp, " top,%f,%f,%f,%f", &result.rotX, &result.rotY, &result.zoom, &result.mutualInformation) == 4)
+    {
+        topK.push_back(result);
+    }
+
+    std::fclose(fp);
+    return ok;
+}
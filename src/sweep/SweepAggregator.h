@@ -0,0 +1,64 @@
+#ifndef HEMELB_SWEEPAGGREGATOR_H
+#define HEMELB_SWEEPAGGREGATOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct SweepResult
+{
+    float rotX, rotY, zoom;
+    float mutualInformation;
+};
+
+// Plain copy of an aggregator's state - this is what gets saved, loaded and
+// merged when several processes sweep different parts of the pose space.
+struct SweepSummary
+{
+    uint64_t                 count;
+    float                    histMin, histMax;
+    std::vector<SweepResult> topK;          // Best first
+    std::vector<uint64_t>    histogram;     // MI histogram over [histMin, histMax]
+
+    static SweepSummary Merge(const SweepSummary& a, const SweepSummary& b, size_t k);
+    bool Save(const char* filename) const;
+    bool Load(const char* filename);
+};
+
+// Global best MI, top-k poses and a running MI histogram without a mutex on the
+// frame path. Every worker thread owns a shard that only it writes to, so a
+// submit is a handful of relaxed stores and never contends with other threads.
+// Readers fold the shards together, and pick up the owner's top-k through a
+// per-shard sequence lock so they never block the writer.
+class SweepAggregator {
+
+    public:
+        class Shard;
+
+        SweepAggregator(size_t topK, size_t histBins, float histMin, float histMax);
+        ~SweepAggregator();
+
+        // Lock-free, call once per worker thread and keep the pointer
+        Shard*          AcquireShard();
+        void            Submit(Shard* shard, const SweepResult& result);
+
+        // -infinity until there is a result - the bias corrected estimators' MI can go below 0
+        float           BestMI() const { return best.load(std::memory_order_relaxed); }
+        SweepSummary    Snapshot() const;
+
+        // Fold in another process' results (e.g. loaded with SweepSummary::Load)
+        void            Merge(const SweepSummary& other);
+
+    private:
+        SweepAggregator(const SweepAggregator&);
+        SweepAggregator& operator=(const SweepAggregator&);
+
+        size_t              topK;
+        size_t              histBins;
+        float               histMin, histMax;
+        std::atomic<float>  best;
+        std::atomic<Shard*> shards;     // Intrusive lock-free list, shards are never removed
+};
+#endif
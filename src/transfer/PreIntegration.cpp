@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <cmath>
+
+#include "PreIntegration.h"
+
+// Per sample opacity can't reach 1 or the extinction blows up
+static const float kMaxOpacity = 0.9999f;
+
+static float4 LookupTransfer(const float4* transferFunc, size_t transferSize,
+                             float sample, float transferOffset, float transferScale)
+{
+    // Mirrors tex1D with normalised coordinates, clamp addressing and point filtering
+    float u = (sample - transferOffset) * transferScale;
+    long idx = (long)std::floor(u * transferSize);
+    idx = std::max(0l, std::min(idx, (long)transferSize - 1));
+    return transferFunc[idx];
+}
+
+// Linear interpolation into a cumulative table sampled at fineCount evenly spaced points over [0,1]
+static float Cumulative(const std::vector<float>& integral, float s)
+{
+    float x = s * (integral.size() - 1);
+    size_t i = std::min((size_t)x, integral.size() - 2);
+    float f = x - i;
+    return integral[i] * (1.f - f) + integral[i + 1] * f;
+}
+
+void BuildPreIntegrationTable(  const float4* transferFunc, size_t transferSize,
+                                float transferOffset, float transferScale, float density,
+                                float tstep, size_t tableSize, std::vector<float4>& table)
+{
+    // The fine grid has to resolve every transfer function entry, not just every table entry,
+    // since the transfer function is point sampled and the steps are what we want to integrate
+    size_t fineCount = std::min(std::max(tableSize, transferSize * 4 * (size_t)std::max(1.f, std::fabs(transferScale))), (size_t)1 << 16) + 1;
+    std::vector<float> extinction(fineCount), emission[3];
+    std::vector<float> extinctionIntegral(fineCount, 0.f), emissionIntegral[3];
+    for(int c = 0; c < 3; ++c)
+    {
+        emissionIntegral[c].assign(fineCount, 0.f);
+        emission[c].resize(fineCount);
+    }
+
+    // Extinction per reference step from the opacity of one reference sample, then the colour weighted by it
+    for(size_t i = 0; i < fineCount; ++i)
+    {
+        float4 col = LookupTransfer(transferFunc, transferSize, (float)i / (fineCount - 1), transferOffset, transferScale);
+        float alpha = std::min(std::max(col.w * density, 0.f), kMaxOpacity);
+        extinction[i] = -std::log(1.f - alpha);
+        emission[0][i] = col.x * extinction[i];
+        emission[1][i] = col.y * extinction[i];
+        emission[2][i] = col.z * extinction[i];
+    }
+
+    // Trapezoid cumulative integrals over the scalar
+    float ds = 1.f / (fineCount - 1);
+    for(size_t i = 1; i < fineCount; ++i)
+    {
+        extinctionIntegral[i] = extinctionIntegral[i - 1] + 0.5f * (extinction[i] + extinction[i - 1]) * ds;
+        for(int c = 0; c < 3; ++c)
+        {
+            emissionIntegral[c][i] = emissionIntegral[c][i - 1] + 0.5f * (emission[c][i] + emission[c][i - 1]) * ds;
+        }
+    }
+
+    float stepRatio = tstep / PREINTEGRATION_REFERENCE_STEP;
+    table.resize(tableSize * tableSize);
+    for(size_t back = 0; back < tableSize; ++back)
+    {
+        float sb = (float)back / (tableSize - 1);
+        for(size_t front = 0; front < tableSize; ++front)
+        {
+            float sf = (float)front / (tableSize - 1);
+
+            // Average extinction and emission over the segment - the plain lookup when the ends coincide
+            float avgTau, avgEmission[3];
+            if(std::fabs(sb - sf) < ds)
+            {
+                size_t i = (size_t)std::lround(0.5f * (sf + sb) * (fineCount - 1));
+                avgTau = extinction[i];
+                for(int c = 0; c < 3; ++c)
+                {
+                    avgEmission[c] = emission[c][i];
+                }
+            }
+            else
+            {
+                float span = sb - sf;
+                avgTau = (Cumulative(extinctionIntegral, sb) - Cumulative(extinctionIntegral, sf)) / span;
+                for(int c = 0; c < 3; ++c)
+                {
+                    avgEmission[c] = (Cumulative(emissionIntegral[c], sb) - Cumulative(emissionIntegral[c], sf)) / span;
+                }
+            }
+
+            // Opacity over the whole segment, colour is the extinction weighted mean scaled by it
+            float4& entry = table[back * tableSize + front];
+            entry.w = 1.f - std::exp(-avgTau * stepRatio);
+            float weight = (avgTau > 0.f) ? entry.w / avgTau : 0.f;
+            entry.x = avgEmission[0] * weight;
+            entry.y = avgEmission[1] * weight;
+            entry.z = avgEmission[2] * weight;
+        }
+    }
+}
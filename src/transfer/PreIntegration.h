@@ -0,0 +1,21 @@
+#ifndef HEMELB_PREINTEGRATION_H
+#define HEMELB_PREINTEGRATION_H
+
+#include <cstddef>
+#include <vector>
+#include <vector_types.h>
+
+// Reference step the point-sampled transfer function was tuned at. Opacities in
+// the table are corrected from this length to the actual step.
+const float PREINTEGRATION_REFERENCE_STEP = 0.01f;
+
+// Builds a tableSize x tableSize table of premultiplied RGBA, entry (front, back)
+// being the colour and opacity of one ray segment whose scalar runs linearly
+// from front to back. Row major with the back sample as the row. Follows the
+// same lookup the renderer does per sample - clamped, point sampled, with the
+// (sample - offset) * scale remap and density applied - so a table built at the
+// reference step matches the unintegrated image, and larger steps don't alias.
+void BuildPreIntegrationTable(  const float4* transferFunc, size_t transferSize,
+                                float transferOffset, float transferScale, float density,
+                                float tstep, size_t tableSize, std::vector<float4>& table);
+#endif
@@ -0,0 +1,67 @@
+#include <cstdio>
+#include <iostream>
+
+#include "TransferFunction.h"
+
+TransferFunction::TransferFunction()
+{
+    const float4 rainbow[] =
+    {
+        {  1.0, 0.0, 0.0, 1.0, },
+        {  1.0, 0.5, 0.0, 1.0, },
+        {  1.0, 1.0, 0.0, 1.0, },
+        {  0.0, 1.0, 0.0, 1.0, },
+        {  0.0, 1.0, 1.0, 1.0, },
+        {  0.0, 0.0, 1.0, 1.0, },
+        {  1.0, 0.0, 1.0, 1.0, },
+    };
+    entries.assign(rainbow, rainbow + sizeof(rainbow)/sizeof(float4));
+}
+
+bool TransferFunction::Load(const char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    if(!fp)
+    {
+        std::cout << "TransferFunction: could not open '" << filename << "'" << std::endl;
+        return false;
+    }
+
+    std::vector<float4> loaded;
+    char line[256];
+    int lineNumber = 0;
+    bool ok = true;
+    while(ok && fgets(line, sizeof(line), fp))
+    {
+        ++lineNumber;
+        char* c = line;
+        while(*c == ' ' || *c == '\t') ++c;
+        if(*c == '#' || *c == '\n' || *c == '\r' || *c == '\0')
+        {
+            continue;
+        }
+
+        float4 entry;
+        if(sscanf(c, "%f %f %f %f", &entry.x, &entry.y, &entry.z, &entry.w) != 4)
+        {
+            std::cout << "TransferFunction: " << filename << ":" << lineNumber << " expected 'r g b a'" << std::endl;
+            ok = false;
+        }
+        loaded.push_back(entry);
+    }
+    fclose(fp);
+
+    if(ok && (loaded.empty() || loaded.size() > MAX_ENTRIES))
+    {
+        std::cout << "TransferFunction: '" << filename << "' has " << loaded.size()
+                  << " entries, expected 1 to " << MAX_ENTRIES << std::endl;
+        ok = false;
+    }
+
+    // Leave the current table alone on any failure
+    if(ok)
+    {
+        entries.swap(loaded);
+    }
+    return ok;
+}
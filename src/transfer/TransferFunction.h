@@ -0,0 +1,28 @@
+#ifndef HEMELB_TRANSFERFUNCTION_H
+#define HEMELB_TRANSFERFUNCTION_H
+
+#include <cstddef>
+#include <vector>
+#include <vector_types.h>
+
+// Host side RGBA lookup table. Files are plain text, one "r g b a" entry per
+// line in [0,1], with '#' starting a comment, e.g.
+//      # red to blue
+//      1.0 0.0 0.0 0.0
+//      0.0 0.0 1.0 1.0
+class TransferFunction {
+
+    public:
+        static const size_t MAX_ENTRIES = 65536;    // Widest 1D cudaArray we'll ask for
+
+        TransferFunction();                         // The original 7 entry rainbow
+
+        bool            Load(const char* filename);
+
+        const float4*   Data() const { return &entries[0]; }
+        size_t          Size() const { return entries.size(); }
+
+    private:
+        std::vector<float4> entries;
+};
+#endif
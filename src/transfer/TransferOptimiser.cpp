@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <cmath>
+
+#include "TransferOptimiser.h"
+
+static float& Param(TransferParams& params, int i)
+{
+    return (i == 0) ? params.transferOffset : (i == 1) ? params.transferScale : params.density;
+}
+
+static float Param(const TransferParams& params, int i)
+{
+    return (i == 0) ? params.transferOffset : (i == 1) ? params.transferScale : params.density;
+}
+
+TransferOptimiser::TransferOptimiser(const TransferParams& lower, const TransferParams& upper, const TransferParams& initialStep)
+    : lower(lower), upper(upper), initialStep(initialStep), evaluations(0), memoHits(0)
+{
+}
+
+TransferParams TransferOptimiser::Clamp(TransferParams params) const
+{
+    for(int i = 0; i < 3; ++i)
+    {
+        Param(params, i) = std::min(std::max(Param(params, i), Param(lower, i)), Param(upper, i));
+    }
+    return params;
+}
+
+float TransferOptimiser::Evaluate(const TransferParams& params, Objective& objective)
+{
+    // Quantised to well below the smallest step we'll ever take
+    std::vector<long> key(3);
+    for(int i = 0; i < 3; ++i)
+    {
+        key[i] = std::lround(Param(params, i) / (Param(initialStep, i) * 1e-4f));
+    }
+
+    std::map<std::vector<long>, float>::iterator found = memo.find(key);
+    if(found != memo.end())
+    {
+        ++memoHits;
+        return found->second;
+    }
+
+    ++evaluations;
+    float value = objective(params);
+    memo[key] = value;
+    return value;
+}
+
+TransferParams TransferOptimiser::Optimise(const TransferParams& start, Objective objective,
+                                           size_t maxEvaluations, float minStepFraction, float* bestValue)
+{
+    TransferParams best = Clamp(start);
+    float bestScore = Evaluate(best, objective);
+    TransferParams step = initialStep;
+
+    bool converged = false;
+    while(!converged && evaluations < maxEvaluations)
+    {
+        bool improved = false;
+        for(int i = 0; i < 3 && evaluations < maxEvaluations; ++i)
+        {
+            for(int direction = -1; direction <= 1; direction += 2)
+            {
+                TransferParams candidate = best;
+                Param(candidate, i) += direction * Param(step, i);
+                candidate = Clamp(candidate);
+                if(Param(candidate, i) == Param(best, i))
+                {
+                    continue;   // Pinned against a bound
+                }
+
+                float score = Evaluate(candidate, objective);
+                if(score > bestScore)
+                {
+                    bestScore = score;
+                    best = candidate;
+                    improved = true;
+                    break;
+                }
+            }
+        }
+
+        if(!improved)
+        {
+            converged = true;
+            for(int i = 0; i < 3; ++i)
+            {
+                Param(step, i) *= 0.5f;
+                converged = converged && Param(step, i) < Param(initialStep, i) * minStepFraction;
+            }
+        }
+    }
+
+    if(bestValue)
+    {
+        *bestValue = bestScore;
+    }
+    return best;
+}
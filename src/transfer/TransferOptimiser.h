@@ -0,0 +1,41 @@
+#ifndef HEMELB_TRANSFEROPTIMISER_H
+#define HEMELB_TRANSFEROPTIMISER_H
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <vector>
+
+struct TransferParams
+{
+    float transferOffset, transferScale, density;
+};
+
+// Compass (coordinate pattern) search over offset, scale and density. Each
+// round tries a step either way along every parameter, keeps any improvement,
+// and halves the steps once nothing improves. Only needs MI values, which is
+// all we get out of a render, and revisits a lot of points as the steps
+// shrink, so results are memoised on the quantised parameters.
+class TransferOptimiser {
+
+    public:
+        typedef std::function<float(const TransferParams&)> Objective;   // Higher is better
+
+        TransferOptimiser(const TransferParams& lower, const TransferParams& upper, const TransferParams& initialStep);
+
+        // Runs until every step is below initialStep * minStepFraction or maxEvaluations renders have been spent
+        TransferParams  Optimise(const TransferParams& start, Objective objective,
+                                 size_t maxEvaluations, float minStepFraction, float* bestValue);
+
+        size_t          Evaluations() const { return evaluations; }
+        size_t          MemoHits() const    { return memoHits; }
+
+    private:
+        float           Evaluate(const TransferParams& params, Objective& objective);
+        TransferParams  Clamp(TransferParams params) const;
+
+        TransferParams  lower, upper, initialStep;
+        std::map<std::vector<long>, float> memo;
+        size_t          evaluations, memoHits;
+};
+#endif